@@ -0,0 +1,309 @@
+#include "pch.h"
+#include "animation.h"
+#include <cctype>
+#include <chrono>
+#include <future>
+
+static double ElapsedMs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+Timeline Timeline::load(const std::string& filename) {
+    std::ifstream in(filename);
+    if (!in.is_open())
+        throw std::runtime_error("Cannot open " + filename);
+
+    static const std::pair<const char*, Property> CAMERA[] = {
+        {"eye", Property::CameraEye}, {"lookat", Property::CameraLookAt}, {"fov", Property::CameraFov}};
+    static const std::pair<const char*, Property> OBJECT[] = {
+        {"position", Property::ObjectPosition}, {"rotation", Property::ObjectRotation},
+        {"scale", Property::ObjectScale}};
+    static const std::pair<const char*, Property> MATERIAL[] = {
+        {"diffuse", Property::Diffuse}, {"specular", Property::Specular},
+        {"diffuseAlbedo", Property::DiffuseAlbedo}, {"specularAlbedo", Property::SpecularAlbedo},
+        {"reflectAlbedo", Property::ReflectAlbedo}, {"refractAlbedo", Property::RefractAlbedo},
+        {"shininess", Property::Shininess}, {"refractive", Property::Refractive}};
+
+    Timeline timeline;
+    std::string line;
+    int number = 0;
+    while (std::getline(in, line)) {
+        number++;
+        std::istringstream stream(line);
+        auto fail = [&](const std::string& message) {
+            return std::runtime_error(filename + ":" + std::to_string(number) + ": " + message);
+        };
+        auto find = [&](const auto& names, const std::string& name) {
+            for (const auto& [key, property] : names)
+                if (name == key)
+                    return property;
+            throw fail("unknown property " + name);
+        };
+
+        float time;
+        std::string kind;
+        if (!(stream >> time)) {
+            stream.clear();
+            std::string word;
+            if (!(stream >> word) || word[0] == '#')
+                continue;
+            throw fail("expected a time");
+        }
+        if (!(stream >> kind))
+            throw fail("expected a parameter");
+
+        Property property;
+        uint32_t target = 0;
+        std::string name;
+        if (kind == "camera") {
+            stream >> name;
+            property = find(CAMERA, name);
+        } else if (kind == "object" || kind == "material") {
+            if (!(stream >> target >> name))
+                throw fail("expected an object ID and a property");
+            property = kind == "object" ? find(OBJECT, name) : find(MATERIAL, name);
+        } else if (kind == "light") {
+            if (!(stream >> target))
+                throw fail("expected a light index");
+            property = Property::Light;
+        } else if (kind == "ambient") {
+            property = Property::Ambient;
+        } else {
+            throw fail("unknown parameter " + kind);
+        }
+
+        bool vector = property == Property::CameraEye || property == Property::CameraLookAt ||
+                      property == Property::ObjectPosition || property == Property::ObjectRotation ||
+                      property == Property::Diffuse ||
+                      property == Property::Specular || property == Property::Light;
+        Vec3 value;
+        if (!(stream >> value.x) || (vector && !(stream >> value.y >> value.z)))
+            throw fail(vector ? "expected three values" : "expected a value");
+        timeline.addKey(property, target, time, value);
+    }
+    return timeline;
+}
+
+void Timeline::addKey(Property property, uint32_t target, float time, const Vec3& value) {
+    auto track = std::find_if(m_tracks.begin(), m_tracks.end(), [&](const Track& track) {
+        return track.property == property && track.target == target;
+    });
+    if (track == m_tracks.end())
+        track = m_tracks.insert(m_tracks.end(), Track{property, target, {}});
+
+    auto position = std::upper_bound(track->keys.begin(), track->keys.end(), time,
+                                     [](float time, const Key& key) { return time < key.time; });
+    track->keys.insert(position, Key{time, value});
+    m_duration = std::max(m_duration, time);
+}
+
+void Timeline::apply(float time, Scene& scene, Camera& camera) const {
+    bool cameraMoved = false;
+    for (const Track& track : m_tracks) {
+        const std::vector<Key>& keys = track.keys;
+        auto next = std::upper_bound(keys.begin(), keys.end(), time,
+                                     [](float time, const Key& key) { return time < key.time; });
+        Vec3 value;
+        if (next == keys.begin()) {
+            value = keys.front().value;
+        } else if (next == keys.end()) {
+            value = keys.back().value;
+        } else {
+            const Key& previous = *(next - 1);
+            float t = (time - previous.time) / (next->time - previous.time);
+            value = previous.value + t * (next->value - previous.value);
+        }
+
+        bool light = track.property == Property::Light;
+        bool object = track.property >= Property::ObjectPosition && track.property <= Property::Refractive;
+        if ((light && track.target >= scene.lights().size()) || (object && !scene.hasObject(track.target)))
+            throw std::runtime_error("Timeline refers to a missing " + std::string(light ? "light " : "object ") +
+                                     std::to_string(track.target));
+
+        auto material = [&]() -> Material& { return scene.ownMaterial(track.target); };
+        switch (track.property) {
+            case Property::CameraEye:      camera.eye() = value; cameraMoved = true; break;
+            case Property::CameraLookAt:   camera.lookAt() = value; cameraMoved = true; break;
+            case Property::CameraFov:      camera.fov() = value.x; cameraMoved = true; break;
+            case Property::ObjectPosition: scene.object(track.target).getPosition() = value; break;
+            case Property::ObjectRotation: scene.object(track.target).getRotation() = value; break;
+            case Property::ObjectScale:    scene.object(track.target).getScale() = value.x; break;
+            case Property::Diffuse:        material().diffuse = value; break;
+            case Property::Specular:       material().specular = value; break;
+            case Property::DiffuseAlbedo:  material().diffuseAlbedo = value.x; break;
+            case Property::SpecularAlbedo: material().specularAlbedo = value.x; break;
+            case Property::ReflectAlbedo:  material().reflectAlbedo = value.x; break;
+            case Property::RefractAlbedo:  material().refractAlbedo = value.x; break;
+            case Property::Shininess:      material().shininess = value.x; break;
+            case Property::Refractive:     material().refractive = value.x; break;
+            case Property::Light:          scene.lightAt(track.target) = value; break;
+            case Property::Ambient:        scene.getAmbient() = value.x; break;
+        }
+        if (track.property >= Property::ObjectPosition && track.property <= Property::ObjectScale) {
+            scene.object(track.target).update();
+            scene.invalidate(track.target);
+        }
+    }
+    if (cameraMoved)
+        camera.update();
+}
+
+FrameWriter::FrameWriter(size_t capacity, float exposure, float gamma)
+    : m_capacity(std::max<size_t>(1, capacity)), m_exposure(exposure), m_gamma(gamma) {
+    m_thread = std::thread(&FrameWriter::threadLoop, this);
+}
+
+FrameWriter::~FrameWriter() noexcept {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_pushed.notify_all();
+    if (m_thread.joinable())
+        m_thread.join();
+}
+
+void FrameWriter::push(std::string filename, Framebuffer frame) {
+    auto start = std::chrono::steady_clock::now();
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_popped.wait(lock, [this]() { return m_queue.size() < m_capacity || m_error; });
+        if (m_error)
+            std::rethrow_exception(m_error);
+        m_queue.push_back(Item{std::move(filename), std::move(frame)});
+        m_stallMs += ElapsedMs(start);
+    }
+    m_pushed.notify_one();
+}
+
+void FrameWriter::finish() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_pushed.notify_all();
+    if (m_thread.joinable())
+        m_thread.join();
+    if (m_error)
+        std::rethrow_exception(m_error);
+}
+
+void FrameWriter::threadLoop() {
+    while (true) {
+        std::optional<Item> item;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_pushed.wait(lock, [this]() { return m_stop || !m_queue.empty(); });
+            if (m_queue.empty())
+                return;
+            item.emplace(std::move(m_queue.front()));
+            m_queue.pop_front();
+        }
+        m_popped.notify_one();
+
+        try {
+            item->frame.save(item->filename, m_exposure, m_gamma);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_error = std::current_exception();
+            m_popped.notify_all();
+            return;
+        }
+    }
+}
+
+// Frame numbers are expanded here rather than by printf, which would take any
+// other conversion in a user-supplied pattern as an argument it never got.
+static std::string ExpandPattern(const std::string& pattern, int frame) {
+    auto invalid = [&] {
+        return std::runtime_error("Output pattern " + pattern +
+                                  " needs exactly one %d, %Nd or %0Nd; write %% for a literal %");
+    };
+    std::string name;
+    bool expanded = false;
+    for (size_t i = 0; i < pattern.size(); i++) {
+        if (pattern[i] != '%') {
+            name += pattern[i];
+            continue;
+        }
+        if (i + 1 < pattern.size() && pattern[i + 1] == '%') {
+            name += '%';
+            i++;
+            continue;
+        }
+        size_t end = i + 1;
+        bool zeros = end < pattern.size() && pattern[end] == '0';
+        size_t digits = zeros ? end + 1 : end;
+        for (end = digits; end < pattern.size() && std::isdigit(static_cast<unsigned char>(pattern[end])); end++) {}
+        if (expanded || end == pattern.size() || pattern[end] != 'd' || end - digits > 2)
+            throw invalid();
+        size_t width = end > digits ? std::stoul(pattern.substr(digits, end - digits)) : 0;
+        std::string index = std::to_string(frame);
+        if (index.size() < width)
+            index.insert(0, width - index.size(), zeros ? '0' : ' ');
+        name += index;
+        expanded = true;
+        i = end;
+    }
+    if (!expanded)
+        throw invalid();
+    return name;
+}
+
+std::string FrameFilename(const std::string& output, int frame) {
+    if (output.find('%') != std::string::npos)
+        return ExpandPattern(output, frame);
+    std::string index = std::to_string(frame);
+    index.insert(0, index.size() < 4 ? 4 - index.size() : 0, '0');
+    size_t dot = output.find_last_of('.');
+    size_t slash = output.find_last_of("/\\");
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        return output + "_" + index;
+    return output.substr(0, dot) + "_" + index + output.substr(dot);
+}
+
+SequenceStats RenderSequence(TileScheduler& scheduler, const Scene& scene, const Camera& camera,
+                             int width, int height, const Timeline& timeline, const SequenceSettings& settings) {
+    struct Frame {
+        Scene  scene;
+        Camera camera;
+        double prepareMs;
+    };
+    auto prepare = [&](int index) {
+        auto start = std::chrono::steady_clock::now();
+        float time = settings.frames > 1 ? timeline.duration() * index / (settings.frames - 1) : 0.0f;
+        Frame frame{scene.snapshot(), camera, 0.0};
+        timeline.apply(time, frame.scene, frame.camera);
+        frame.scene.commit(Scene::Rebuild::Immediate);
+        frame.prepareMs = ElapsedMs(start);
+        return frame;
+    };
+
+    // A bad output pattern fails before anything is rendered.
+    FrameFilename(settings.output, 0);
+
+    SequenceStats stats;
+    auto start = std::chrono::steady_clock::now();
+    FrameWriter writer(settings.queue, settings.exposure, settings.gamma);
+    std::future<Frame> next;
+    if (settings.frames > 0)
+        next = std::async(std::launch::async, prepare, 0);
+    for (int index = 0; index < settings.frames; index++) {
+        auto wait = std::chrono::steady_clock::now();
+        Frame frame = next.get();
+        stats.stallMs += ElapsedMs(wait);
+        stats.prepareMs += frame.prepareMs;
+        if (index + 1 < settings.frames)
+            next = std::async(std::launch::async, prepare, index + 1);
+
+        Framebuffer framebuffer(width, height);
+        auto render = std::chrono::steady_clock::now();
+        stats.render += Render(scheduler, &framebuffer, frame.camera, frame.scene, settings.render);
+        stats.renderMs += ElapsedMs(render);
+        writer.push(FrameFilename(settings.output, index), std::move(framebuffer));
+    }
+    writer.finish();
+    stats.stallMs += writer.stallMs();
+    stats.totalMs = ElapsedMs(start);
+    return stats;
+}
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "framebuffer.h"
+#include "renderer.h"
+#include "scene.h"
+#include "scheduler.h"
+
+// Keyframed scene parameters. Every animated parameter is a track of
+// (time, value) keys interpolated linearly and held constant before the first
+// and after the last key. Timeline files hold one key per line:
+//
+//     <time> camera eye|lookat X Y Z
+//     <time> camera fov DEGREES
+//     <time> object ID position X Y Z
+//     <time> object ID rotation DEGREES_X DEGREES_Y DEGREES_Z
+//     <time> object ID scale S
+//     <time> material ID diffuse|specular R G B
+//     <time> material ID diffuseAlbedo|specularAlbedo|reflectAlbedo|refractAlbedo|shininess|refractive X
+//     <time> light INDEX X Y Z
+//     <time> ambient X
+//
+// Object and material IDs are Scene::ObjectId values; a material key edits
+// the material of that object only, which first gets its own copy of a table
+// entry it shares with other objects (see Scene::ownMaterial()). Empty lines
+// and lines starting with # are skipped.
+class Timeline {
+public:
+    enum class Property : uint8_t {
+        CameraEye, CameraLookAt, CameraFov,
+        ObjectPosition, ObjectRotation, ObjectScale,
+        Diffuse, Specular, DiffuseAlbedo, SpecularAlbedo, ReflectAlbedo, RefractAlbedo, Shininess, Refractive,
+        Light, Ambient,
+    };
+
+    static Timeline load(const std::string& filename);
+
+    // Scalar properties use value.x.
+    void addKey(Property property, uint32_t target, float time, const Vec3& value);
+    float duration() const { return m_duration; }
+    bool empty() const     { return m_tracks.empty(); }
+
+    // Sets every animated parameter to its value at time. Moved objects are
+    // invalidated; the caller commits the scene.
+    void apply(float time, Scene& scene, Camera& camera) const;
+
+private:
+    struct Key {
+        float time;
+        Vec3  value;
+    };
+
+    struct Track {
+        Property         property;
+        uint32_t         target; // object ID or light index
+        std::vector<Key> keys;   // sorted by time
+    };
+
+private:
+    std::vector<Track> m_tracks;
+    float              m_duration = 0.0f;
+};
+
+// Encodes and writes frames on its own thread so that image compression and
+// disk I/O overlap rendering. The queue is bounded: push() blocks once
+// capacity frames are waiting, which keeps memory in check if the disk
+// falls behind for long.
+class FrameWriter {
+public:
+    FrameWriter(size_t capacity, float exposure = 1.0f, float gamma = 1.0f);
+    FrameWriter(const FrameWriter& other) = delete;
+    FrameWriter& operator=(const FrameWriter& other) = delete;
+    ~FrameWriter() noexcept;
+
+    void push(std::string filename, Framebuffer frame);
+    // Writes the remaining frames and rethrows the first write error.
+    void finish();
+
+    // Total time push() spent waiting for a free slot.
+    double stallMs() const { return m_stallMs; }
+
+private:
+    struct Item {
+        std::string filename;
+        Framebuffer frame;
+    };
+
+    void threadLoop();
+
+private:
+    size_t                  m_capacity;
+    float                   m_exposure;
+    float                   m_gamma;
+    std::mutex              m_mutex;
+    std::condition_variable m_pushed;
+    std::condition_variable m_popped;
+    std::deque<Item>        m_queue;
+    bool                    m_stop = false;
+    std::exception_ptr      m_error;
+    double                  m_stallMs = 0.0;
+    std::thread             m_thread;
+};
+
+struct SequenceSettings {
+    int            frames = 1;
+    std::string    output = "frame_%04d.png"; // printf pattern for the frame index
+    size_t         queue = 4;                 // frames waiting for the writer
+    float          exposure = 1.0f;
+    float          gamma = 1.0f;
+    RenderSettings render;
+};
+
+struct SequenceStats {
+    RenderStats render;
+    double      renderMs = 0.0;  // rendering only, summed over frames
+    double      prepareMs = 0.0; // scene updates and BVH builds, overlapped with rendering
+    double      stallMs = 0.0;   // renders waiting for the next scene or the writer
+    double      totalMs = 0.0;
+};
+
+// Output name of a frame: output is a pattern such as "frame_%04d.png" with
+// one %d, %Nd or %0Nd for the index and %% for a literal %; without a % the
+// index is appended to the stem. Throws std::runtime_error for any other
+// use of %.
+std::string FrameFilename(const std::string& output, int frame);
+
+// Renders frames evenly spread over the timeline. The scene of frame N + 1
+// is animated and committed on a separate thread while frame N renders, and
+// finished frames go to a FrameWriter. scene is only read.
+SequenceStats RenderSequence(TileScheduler& scheduler, const Scene& scene, const Camera& camera,
+                             int width, int height, const Timeline& timeline, const SequenceSettings& settings);
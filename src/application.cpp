@@ -3,29 +3,17 @@
 #include "renderer.h"
 #include "objects.h"
 #include "model.h"
-#include <chrono>
+#include "scenes.h"
+#include "tracestats.h"
+#include <imgui.h>
+#include <backends/imgui_impl_glfw.h>
+#include <backends/imgui_impl_opengl3.h>
 
 #define OBJECT_NAME(i) (("Object " + std::to_string(i)).c_str())
 #define LIGHT_NAME(i)  (("Light " + std::to_string(i)).c_str())
 
-Framebuffer::Framebuffer(int width, int height)
-    : m_width(width), m_height(height), m_buffer(width * height * 3) {}
-
-void Framebuffer::clear() {
-    std::fill(m_buffer.begin(), m_buffer.end(), 0);
-}
-
-void Framebuffer::setPixel(int x, int y, const Vec3& color) {
-    assert(x >= 0 && x < m_width);
-    assert(y >= 0 && y < m_height);
-    int index = (y * m_width + x) * 3;
-    m_buffer[index]     = static_cast<uint8_t>(std::min(1.0f, color.x) * 255);
-    m_buffer[index + 1] = static_cast<uint8_t>(std::min(1.0f, color.y) * 255);
-    m_buffer[index + 2] = static_cast<uint8_t>(std::min(1.0f, color.z) * 255);
-}
-
 Application::Application(int width, int height)
-    : m_framebuffer(width, height), m_rerender(false), m_depth(0) {
+    : m_framebuffer(width, height), m_renderer(width, height), m_rerender(false), m_depth(0) {
     if (glfwInit() != GLFW_TRUE)
         throw std::runtime_error("Cannot init GLFW");
 
@@ -70,17 +58,25 @@ Application::~Application() noexcept {
 void Application::Run() {
     while (!glfwWindowShouldClose(m_window)) {
         if (m_rerender) {
-            m_framebuffer.clear();
-
-
-            auto start = std::chrono::high_resolution_clock::now();
-
-            Render(&m_framebuffer, m_camera, m_scene, m_depth);
-            auto end = std::chrono::high_resolution_clock::now();
-
-            std::cout << std::chrono::duration_cast<std::chrono::nanoseconds>(end-start).count() << "ns\n";
+            m_scene.commit();
+            RenderSettings settings;
+            settings.depth = m_depth;
+            settings.minContribution = m_minContribution;
+            settings.shadows = m_shadows;
+            settings.maxSamples = m_maxSamples;
+            m_renderer.start(m_scene.snapshot(), m_camera, settings);
             m_rerender = false;
         }
+        if (auto frame = m_renderer.takeFrameStats()) {
+            m_frameStats = frame;
+            m_frameMs[m_frames % HISTORY] = static_cast<float>(frame->milliseconds);
+            m_mrays[m_frames % HISTORY] = static_cast<float>(frame->stats.rays / (frame->milliseconds * 1e3));
+            m_frames++;
+        }
+        if (m_renderer.present(m_framebuffer) || m_resolve) {
+            m_framebuffer.resolve(m_exposure, m_gamma);
+            m_resolve = false;
+        }
 
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
         glDrawPixels(m_framebuffer.width(), m_framebuffer.height(),
@@ -100,26 +96,8 @@ void Application::Run() {
 
 void Application::Init() {
     float aspect = (float)m_framebuffer.width() / m_framebuffer.height();
-    m_camera = Camera(Vec3(0, 4, -7), Vec3(0, 0, 0), 45.f, aspect);
-    m_scene.addObject(std::make_shared<Cube>());
-    m_scene.addLight(Vec3(0, 5, 0));
-
-    // Test image
-    srand(time(NULL));
-    for (int i = 0; i < 5; i++) {
-        float x = -2 + rand() % 5;
-        float y = -2 + rand() % 5;
-        float z = -2 + rand() % 5;
-        float r = 0.3;
-        m_scene.addObject(std::make_shared<Sphere>(Vec3(x, y, z), r));
-        Material& material = m_scene.objectAt(i+1)->getMaterial();
-        material.diffuse = Vec3(1, 1, 1);
-        material.diffuseAlbedo = 0.4f;
-        material.refractAlbedo = 1.0f;
-        material.refractive = 1.01f;
-        m_scene.objectAt(i+1)->getScale() *= -0.3f;
-        m_scene.objectAt(i+1)->getScale() -= -0.1f * i;
-    }
+    m_camera = DefaultCamera(aspect);
+    LoadIceScene(m_scene, static_cast<unsigned>(time(NULL)));
 
     m_depth = 3;
     m_rerender = true;
@@ -136,11 +114,13 @@ void Application::ImGuiUpdate() {
     ImGui::Separator();
     ImGuiUpdateScene();
     ImGui::End();
+    ImGuiUpdateStats();
 }
 
 void Application::ImGuiUpdateScene() {
     static bool showPlane = false;
     if (ImGui::SliderInt("Максимальная глубина", &m_depth, 0, 10)) m_rerender = true;
+    if (ImGui::SliderFloat("Минимальный вклад луча", &m_minContribution, 0, 0.05f, "%.4f")) m_rerender = true;
     if (ImGui::SliderFloat3("Позиция камеры", &m_camera.eye().x, -10, 10)) {
         m_camera.update();
         m_rerender = true;
@@ -154,6 +134,10 @@ void Application::ImGuiUpdateScene() {
         m_rerender = true;
     }
     if (ImGui::SliderFloat("Фоновое освещение", &m_scene.getAmbient(), 0, 1)) m_rerender = true;
+    if (ImGui::Checkbox("Тени", &m_shadows)) m_rerender = true;
+    if (ImGui::SliderInt("Сглаживание, выборок", &m_maxSamples, 1, 16)) m_rerender = true;
+    if (ImGui::SliderFloat("Экспозиция", &m_exposure, 0.1f, 4.0f)) m_resolve = true;
+    if (ImGui::SliderFloat("Гамма", &m_gamma, 1.0f, 3.0f)) m_resolve = true;
     if (ImGui::Checkbox("Показывать плоскость", &showPlane)) {
         m_scene.showPlane(showPlane);
         m_rerender = true;
@@ -161,24 +145,38 @@ void Application::ImGuiUpdateScene() {
 }
 
 void Application::ImGuiUpdateObjects() {
-    static int objectIdx  = 0;
-    std::vector<Scene::ObjectRef>& objects = m_scene.objects();
+    // Object IDs stay valid while other objects are added and removed.
+    static Scene::ObjectId objectId = 0;
+    const std::vector<Scene::ObjectId>& objects = m_scene.objectIds();
     if (!objects.empty()) {
-        if (ImGui::BeginCombo("Объекты", OBJECT_NAME(objectIdx))) {
-            for (int i = 0; i < objects.size(); i++) {
-                bool selected = objectIdx == i;
-                if (ImGui::Selectable(OBJECT_NAME(i), selected))
-                    objectIdx = i;
+        if (std::find(objects.begin(), objects.end(), objectId) == objects.end())
+            objectId = objects.front();
+        if (ImGui::BeginCombo("Объекты", OBJECT_NAME(objectId))) {
+            for (Scene::ObjectId id : objects) {
+                bool selected = objectId == id;
+                if (ImGui::Selectable(OBJECT_NAME(id), selected))
+                    objectId = id;
             }
             ImGui::EndCombo();
         }
 
-        Scene::ObjectRef object = m_scene.objectAt(objectIdx);
-        Material& material = object->getMaterial();
+        IObject& object = m_scene.object(objectId);
+        Material& material = m_scene.objectMaterial(objectId);
 
 
-        if (ImGui::SliderFloat("Масштабирование", &object->getScale(), -10, 10)) {
-            object->update();
+        if (ImGui::SliderFloat3("Позиция", &object.getPosition().x, -10, 10)) {
+            object.update();
+            m_scene.invalidate(objectId);
+            m_rerender = true;
+        }
+        if (ImGui::SliderFloat3("Поворот", &object.getRotation().x, -180, 180)) {
+            object.update();
+            m_scene.invalidate(objectId);
+            m_rerender = true;
+        }
+        if (ImGui::SliderFloat("Масштабирование", &object.getScale(), -10, 10)) {
+            object.update();
+            m_scene.invalidate(objectId);
             m_rerender = true;
         }
         if (ImGui::SliderFloat("Диффузное отражение", &material.diffuseAlbedo, 0, 1)) m_rerender = true;
@@ -187,15 +185,26 @@ void Application::ImGuiUpdateObjects() {
         if (ImGui::SliderFloat("Блеск", &material.shininess, 0, 1000)) m_rerender = true;
         if (ImGui::SliderFloat("Рефракция", &material.refractive, 1, 5)) m_rerender = true;
         if (ImGui::Button("Удалить объект")) {
-            objects.erase(objects.begin() + objectIdx);
-            objectIdx = 0;
+            m_scene.removeObject(objectId);
             m_rerender = true;
         }
         ImGui::SameLine();
     }
     if (ImGui::Button("Добавить пузырек")) {
-        m_scene.addObject(std::make_shared<Sphere>());
-        objectIdx = objects.size() - 1;
+        objectId = m_scene.addObject(Sphere());
+        m_rerender = true;
+    }
+    // A new cloud, with a new seed, replaces the previous one.
+    ImGui::SliderFloat("Плотность пузырьков", &m_cloudDensity, 10, 10000, "%.0f", ImGuiSliderFlags_Logarithmic);
+    if (ImGui::Button("Заполнить куб пузырьками")) {
+        if (m_cloud && m_scene.hasObject(*m_cloud))
+            m_scene.removeObject(*m_cloud);
+        BubbleSettings settings;
+        settings.seed = static_cast<unsigned>(time(NULL));
+        settings.density = m_cloudDensity;
+        settings.clustering = 0.5f;
+        objectId = AddBubbleCloud(m_scene, settings);
+        m_cloud = objectId;
         m_rerender = true;
     }
 
@@ -229,4 +238,61 @@ void Application::ImGuiUpdateLights() {
         lightIdx = lights.size() - 1;
         m_rerender = true;
     }
-}
\ No newline at end of file
+}
+
+void Application::ImGuiUpdateStats() {
+    ImGui::SetNextWindowPos(ImVec2(0.0f, 0.0f), ImGuiCond_FirstUseEver);
+    ImGui::SetNextWindowSize(ImVec2(360, 0), ImGuiCond_FirstUseEver);
+    ImGui::SetNextWindowBgAlpha(0.6f);
+    ImGui::Begin("Статистика");
+    ImGui::Text("Интерфейс: %.1f мс", 1000.0f / ImGui::GetIO().Framerate);
+    if (!m_frameStats) {
+        ImGui::TextUnformatted(m_renderer.busy() ? "Кадр рендерится..." : "Нет готовых кадров");
+        ImGui::End();
+        return;
+    }
+
+    const RenderStats& stats = m_frameStats->stats;
+    const TraceStats& trace = stats.trace;
+    int count = std::min(m_frames, HISTORY);
+    int offset = m_frames > HISTORY ? m_frames % HISTORY : 0;
+    ImGui::Text("Кадр: %.1f мс, %.2f Mrays/s", m_frameStats->milliseconds,
+                stats.rays / (m_frameStats->milliseconds * 1e3));
+    ImGui::PlotLines("мс", m_frameMs.data(), count, offset, nullptr, 0.0f, FLT_MAX, ImVec2(0, 50));
+    ImGui::PlotLines("Mrays/s", m_mrays.data(), count, offset, nullptr, 0.0f, FLT_MAX, ImVec2(0, 50));
+
+    ImGui::Separator();
+    ImGui::Text("Лучи: %llu, отброшено %llu, из G-буфера %llu", static_cast<unsigned long long>(stats.rays),
+                static_cast<unsigned long long>(stats.pruned), static_cast<unsigned long long>(stats.cached));
+    for (int i = 0; i < static_cast<int>(TraceStats::RayKind::Count); i++) {
+        auto kind = static_cast<TraceStats::RayKind>(i);
+        ImGui::BulletText("%s: %llu", TraceStats::name(kind), static_cast<unsigned long long>(trace[kind]));
+    }
+    ImGui::Text("Проверки пересечений:");
+    for (int i = 0; i < static_cast<int>(TraceStats::Primitive::Count); i++) {
+        auto primitive = static_cast<TraceStats::Primitive>(i);
+        ImGui::BulletText("%s: %llu", TraceStats::name(primitive), static_cast<unsigned long long>(trace[primitive]));
+    }
+    uint64_t traced = stats.rays + trace[TraceStats::RayKind::Shadow];
+    ImGui::Text("Узлы BVH: %llu, %.1f на луч", static_cast<unsigned long long>(trace.nodes),
+                traced ? static_cast<double>(trace.nodes) / traced : 0.0);
+
+    float depths[TraceStats::DEPTHS];
+    int last = 1;
+    for (int i = 0; i < TraceStats::DEPTHS; i++) {
+        depths[i] = static_cast<float>(trace.depths[i]);
+        if (trace.depths[i])
+            last = i + 1;
+    }
+    ImGui::PlotHistogram("Глубина", depths, last, 0, nullptr, 0.0f, FLT_MAX, ImVec2(0, 60));
+
+    if (ImGui::Button("Сохранить JSON")) {
+        std::ofstream out("stats.json");
+        if (out.is_open())
+            WriteStatsJson(out, stats, m_frameStats->milliseconds);
+    }
+#ifdef RAYTRACING_NO_STATS
+    ImGui::TextDisabled("Счётчики отключены при сборке (RAYTRACING_STATS=OFF)");
+#endif
+    ImGui::End();
+}
@@ -1,22 +1,13 @@
 #pragma once
 
+#include <glad/glad.h>
 #include <GLFW/glfw3.h>
 #include "renderer.h"
-
-class Framebuffer : public IFramebuffer {
-public:
-    Framebuffer(int width, int height);
-    int width()  const override { return m_width; }
-    int height() const override { return m_height; }
-    void clear() override;
-    void setPixel(int x, int y, const Vec3& color) override;
-    const uint8_t* data() const { return m_buffer.data(); }
-
-private:
-    int m_width;
-    int m_height;
-    std::vector<uint8_t> m_buffer;
-};
+#include "framebuffer.h"
+#include "progressive.h"
+#include "bubblecloud.h"
+#include <array>
+#include <optional>
 
 class Application {
 public:
@@ -32,12 +23,28 @@ private:
     void ImGuiUpdateScene();
     void ImGuiUpdateObjects();
     void ImGuiUpdateLights();
+    void ImGuiUpdateStats();
 
 private:
-    GLFWwindow*  m_window;
-    Framebuffer  m_framebuffer;
-    Camera       m_camera;
-    Scene        m_scene;
-    int          m_depth;
-    bool         m_rerender;
+    GLFWwindow*         m_window;
+    Framebuffer         m_framebuffer;
+    ProgressiveRenderer m_renderer;
+    Camera              m_camera;
+    Scene               m_scene;
+    int                 m_depth;
+    float               m_minContribution = RenderSettings().minContribution;
+    bool                m_shadows = RenderSettings().shadows;
+    int                 m_maxSamples = RenderSettings().maxSamples;
+    float               m_exposure = 1.0f;
+    float               m_gamma = 1.0f;
+    bool                m_resolve = false;
+    bool                m_rerender;
+    float               m_cloudDensity = BubbleSettings().density;
+    std::optional<Scene::ObjectId> m_cloud; // the bubble cloud filling the cube, if any
+
+    static constexpr int HISTORY = 120;
+    std::optional<ProgressiveRenderer::FrameStats> m_frameStats; // of the last finished frame
+    std::array<float, HISTORY> m_frameMs{};                     // ring of recent frame times
+    std::array<float, HISTORY> m_mrays{};                       // and their Mrays/s
+    int                        m_frames = 0;
 };
@@ -0,0 +1,284 @@
+#include "pch.h"
+#include "bubblecloud.h"
+#include "dispatch.h"
+#include "framebuffer.h"
+#include "model.h"
+#include "objloader.h"
+#include "renderer.h"
+#include "scenes.h"
+#include "scheduler.h"
+#include <chrono>
+#include <filesystem>
+#include <iomanip>
+#include <thread>
+
+// Thread-scaling benchmark. For every scene, resolution and depth it sweeps
+// the thread counts and writes a "len,time" CSV (threads, median ms) in the
+// same shape as docs/inc/csv/time.csv, plus one detailed report CSV.
+// With --obj it compares the OBJ loaders on one file instead.
+
+struct Resolution {
+    int width;
+    int height;
+};
+
+struct Options {
+    std::vector<std::string> scenes = {"ice", "cloud"};
+    std::vector<int>         threads = {1, 2, 4, 8, 12, 16, 24, 32};
+    std::vector<Resolution>  resolutions = {{1400, 700}};
+    std::vector<int>         depths = {3};
+    int                      repeats = 7;
+    int                      warmup = 1;
+    unsigned                 seed = 1;
+    std::string              output = "bench";
+    std::string              obj;
+};
+
+struct Result {
+    std::string scene;
+    Resolution  resolution;
+    int         depth;
+    int         threads;
+    double      medianMs;
+    double      p95Ms;
+    double      mraysPerSecond;
+    double      efficiency;
+};
+
+static std::vector<std::string> Split(const std::string& list) {
+    std::vector<std::string> items;
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ','))
+        if (!item.empty())
+            items.push_back(item);
+    return items;
+}
+
+static std::vector<int> ParseInts(const std::string& list) {
+    std::vector<int> values;
+    for (const auto& item : Split(list))
+        values.push_back(std::stoi(item));
+    return values;
+}
+
+static std::vector<Resolution> ParseResolutions(const std::string& list) {
+    std::vector<Resolution> values;
+    for (const auto& item : Split(list)) {
+        size_t separator = item.find('x');
+        if (separator == std::string::npos)
+            throw std::runtime_error("Resolution must look like 640x480: " + item);
+        values.push_back({std::stoi(item.substr(0, separator)), std::stoi(item.substr(separator + 1))});
+    }
+    return values;
+}
+
+static void PrintUsage(const char* program) {
+    std::cout << "Usage: " << program << " [options]\n"
+              << "  --scenes LIST        reference scenes, from ice,cloud,bubbles (default ice,cloud)\n"
+              << "  --threads LIST       thread counts (default 1,2,4,8,12,16,24,32)\n"
+              << "  --resolutions LIST   e.g. 320x160,1400x700 (default 1400x700)\n"
+              << "  --depths LIST        maximum ray depths (default 3)\n"
+              << "  --repeats N          measured frames per configuration (default 7)\n"
+              << "  --warmup N           unmeasured frames per configuration (default 1)\n"
+              << "  --seed N             scene seed (default 1)\n"
+              << "  --output DIR         directory for CSV files (default bench)\n"
+              << "  --obj FILE           time the OBJ loaders on FILE instead of rendering\n";
+}
+
+static Options ParseOptions(int argc, char** argv) {
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc)
+                throw std::runtime_error("Missing value for " + arg);
+            return argv[++i];
+        };
+
+        if (arg == "-h" || arg == "--help") {
+            PrintUsage(argv[0]);
+            std::exit(EXIT_SUCCESS);
+        } else if (arg == "--scenes") {
+            options.scenes = Split(value());
+        } else if (arg == "--threads") {
+            options.threads = ParseInts(value());
+        } else if (arg == "--resolutions") {
+            options.resolutions = ParseResolutions(value());
+        } else if (arg == "--depths") {
+            options.depths = ParseInts(value());
+        } else if (arg == "--repeats") {
+            options.repeats = std::max(1, std::stoi(value()));
+        } else if (arg == "--warmup") {
+            options.warmup = std::max(0, std::stoi(value()));
+        } else if (arg == "--seed") {
+            options.seed = static_cast<unsigned>(std::stoul(value()));
+        } else if (arg == "--output") {
+            options.output = value();
+        } else if (arg == "--obj") {
+            options.obj = value();
+        } else {
+            throw std::runtime_error("Unknown option " + arg);
+        }
+    }
+    if (options.threads.empty() || options.resolutions.empty() || options.depths.empty())
+        throw std::runtime_error("Empty sweep");
+    std::sort(options.threads.begin(), options.threads.end());
+    return options;
+}
+
+static double Percentile(std::vector<double> samples, double fraction) {
+    std::sort(samples.begin(), samples.end());
+    double position = fraction * (samples.size() - 1);
+    size_t lower = static_cast<size_t>(position);
+    size_t upper = std::min(lower + 1, samples.size() - 1);
+    return samples[lower] + (samples[upper] - samples[lower]) * (position - lower);
+}
+
+static Result Measure(const Options& options, const std::string& name, const Scene& scene,
+                      Resolution resolution, int depth, int threads) {
+    Camera camera = DefaultCamera(static_cast<float>(resolution.width) / resolution.height);
+    Framebuffer framebuffer(resolution.width, resolution.height);
+    TileScheduler scheduler(threads);
+    RenderSettings settings;
+    settings.depth = depth;
+
+    for (int i = 0; i < options.warmup; i++)
+        Render(scheduler, &framebuffer, camera, scene, settings);
+
+    std::vector<double> times;
+    uint64_t rays = 0;
+    for (int i = 0; i < options.repeats; i++) {
+        framebuffer.clear();
+        auto start = std::chrono::steady_clock::now();
+        RenderStats stats = Render(scheduler, &framebuffer, camera, scene, settings);
+        auto end = std::chrono::steady_clock::now();
+        times.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+        rays = stats.rays;
+    }
+
+    Result result;
+    result.scene = name;
+    result.resolution = resolution;
+    result.depth = depth;
+    result.threads = threads;
+    result.medianMs = Percentile(times, 0.5);
+    result.p95Ms = Percentile(times, 0.95);
+    result.mraysPerSecond = rays / (result.medianMs * 1e3);
+    result.efficiency = 1.0;
+    return result;
+}
+
+static void BenchmarkObj(const Options& options) {
+    auto measure = [&](const std::string& name, const std::function<ObjMesh()>& load) {
+        std::vector<double> times;
+        ObjMesh mesh;
+        for (int i = 0; i < options.warmup + options.repeats; i++) {
+            auto start = std::chrono::steady_clock::now();
+            mesh = load();
+            auto end = std::chrono::steady_clock::now();
+            if (i >= options.warmup)
+                times.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+        }
+        double median = Percentile(times, 0.5);
+        double megabytes = std::filesystem::file_size(options.obj) / 1e6;
+        std::cout << std::left << std::setw(20) << name << std::fixed << std::setprecision(2)
+                  << std::setw(12) << median << std::setw(12) << Percentile(times, 0.95)
+                  << megabytes / (median * 1e-3) << "\n";
+        return mesh;
+    };
+
+    std::cout << std::left << std::setw(20) << "loader" << std::setw(12) << "median ms"
+              << std::setw(12) << "p95 ms" << "MB/s\n";
+    ObjMesh fast;
+    for (int threads : options.threads) {
+        std::string name = "from_chars, " + std::to_string(threads) + "t";
+        fast = measure(name, [&]() { return LoadObj(options.obj, threads); });
+    }
+    std::cout << fast.vertices.size() << " vertices, " << fast.faces.size() / 3 << " triangles\n";
+
+    // The old parser only reads plain triangles; compare where it can.
+    ObjMesh legacy;
+    try {
+        legacy = measure("getline+istream", [&]() { return LoadObjLegacy(options.obj); });
+    } catch (const std::exception& error) {
+        std::cout << "getline+istream     " << error.what() << "\n";
+        return;
+    }
+    bool same = legacy.faces == fast.faces && legacy.vertices.size() == fast.vertices.size() &&
+                std::equal(legacy.vertices.begin(), legacy.vertices.end(), fast.vertices.begin(),
+                           [](const Vec3& a, const Vec3& b) { return a.x == b.x && a.y == b.y && a.z == b.z; });
+    std::cout << (same ? "identical meshes\n" : "MESHES DIFFER\n");
+}
+
+int main(int argc, char** argv) {
+    try {
+        Options options = ParseOptions(argc, argv);
+        if (!options.obj.empty()) {
+            BenchmarkObj(options);
+            return EXIT_SUCCESS;
+        }
+        std::filesystem::create_directories(options.output);
+
+#ifndef NDEBUG
+        std::cerr << "warning: benchmark built without NDEBUG, timings include assertions\n";
+#endif
+        std::cout << "hardware threads: " << std::thread::hardware_concurrency() << "\n";
+        std::cout << "SIMD: " << SimdLevelName(BuildSimdLevel()) << " build, "
+                  << SimdLevelName(ActiveKernels().level) << " kernels\n";
+        std::cout << std::left << std::setw(8) << "scene" << std::setw(12) << "resolution"
+                  << std::setw(7) << "depth" << std::setw(9) << "threads" << std::setw(12) << "median ms"
+                  << std::setw(12) << "p95 ms" << std::setw(10) << "Mrays/s" << "efficiency\n";
+
+        std::vector<Result> results;
+        for (const auto& name : options.scenes) {
+            Scene scene;
+            LoadReferenceScene(scene, name, options.seed);
+            scene.commit();
+            for (Scene::ObjectId id : scene.objectIds())
+                if (auto* cloud = dynamic_cast<const BubbleCloud*>(&scene.object(id)))
+                    std::cout << "Bubbles: " << cloud->stats() << "\n";
+                else if (auto* model = dynamic_cast<const Model*>(&scene.object(id)))
+                    std::cout << "Model: " << model->stats() << "\n";
+
+            for (Resolution resolution : options.resolutions) {
+                for (int depth : options.depths) {
+                    std::string suffix = name + "_" + std::to_string(resolution.width) + "x" +
+                                         std::to_string(resolution.height) + "_d" + std::to_string(depth);
+                    std::ofstream csv(std::filesystem::path(options.output) / ("time_" + suffix + ".csv"));
+                    csv << "len,time\n";
+
+                    double baseline = 0.0;
+                    for (int threads : options.threads) {
+                        Result result = Measure(options, name, scene, resolution, depth, threads);
+                        // Efficiency relative to the smallest thread count in the sweep.
+                        if (baseline == 0.0)
+                            baseline = result.medianMs * threads;
+                        result.efficiency = baseline / (result.medianMs * threads);
+                        results.push_back(result);
+
+                        csv << threads << "," << std::lround(result.medianMs) << "\n";
+                        std::cout << std::left << std::setw(8) << name
+                                  << std::setw(12) << (std::to_string(resolution.width) + "x" + std::to_string(resolution.height))
+                                  << std::setw(7) << depth << std::setw(9) << threads
+                                  << std::fixed << std::setprecision(2)
+                                  << std::setw(12) << result.medianMs << std::setw(12) << result.p95Ms
+                                  << std::setw(10) << result.mraysPerSecond << result.efficiency << "\n";
+                    }
+                }
+            }
+        }
+
+        std::ofstream report(std::filesystem::path(options.output) / "report.csv");
+        report << "scene,width,height,depth,threads,median_ms,p95_ms,mrays_per_s,efficiency\n";
+        for (const auto& result : results) {
+            report << result.scene << "," << result.resolution.width << "," << result.resolution.height << ","
+                   << result.depth << "," << result.threads << "," << result.medianMs << "," << result.p95Ms << ","
+                   << result.mraysPerSecond << "," << result.efficiency << "\n";
+        }
+    } catch (const std::exception& error) {
+        std::cerr << error.what() << "\n";
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,285 @@
+#include "pch.h"
+#include "bubblecloud.h"
+#include <chrono>
+#include <random>
+
+// Grid cells per bubble: small enough that a cell holds a couple of bubbles,
+// large enough that a ray does not spend its time stepping through empty ones.
+constexpr float BUBBLES_PER_CELL = 2.0f;
+constexpr int   MAX_CELLS_PER_AXIS = 1024;
+
+std::vector<Bubble> GenerateBubbles(const AABB& volume, const BubbleSettings& settings) {
+    Vec3 extent = volume.max() - volume.min();
+    float smallest = std::min(extent.x, std::min(extent.y, extent.z));
+    double count = std::max(0.0, static_cast<double>(settings.density) * extent.x * extent.y * extent.z);
+    if (smallest <= 0.0f || count < 1.0)
+        return {};
+
+    std::mt19937 generator(settings.seed);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    std::normal_distribution<float> spread(0.0f, settings.clusterSize);
+    std::lognormal_distribution<float> size(std::log(settings.medianRadius), settings.radiusSpread);
+    float largest = std::min(settings.maxRadius, smallest / 2.0f);
+
+    // Points of volume shrunk by radius on every side.
+    auto inside = [&](float radius) {
+        Vec3 margin(radius, radius, radius);
+        return AABB(volume.min() + margin, volume.max() - margin);
+    };
+    auto uniform = [&](const AABB& box) {
+        Vec3 t(unit(generator), unit(generator), unit(generator));
+        return box.min() + (box.max() - box.min()) * t;
+    };
+
+    size_t bubbles = static_cast<size_t>(count);
+    float clustering = std::clamp(settings.clustering, 0.0f, 1.0f);
+    size_t clusters = clustering > 0.0f
+        ? std::max<size_t>(1, static_cast<size_t>(bubbles * clustering / std::max(settings.clusterBubbles, 1)))
+        : 0;
+    std::vector<Vec3> centers(clusters);
+    for (Vec3& center : centers)
+        center = uniform(volume);
+    std::uniform_int_distribution<size_t> pick(0, clusters ? clusters - 1 : 0);
+
+    std::vector<Bubble> result;
+    result.reserve(bubbles);
+    for (size_t i = 0; i < bubbles; i++) {
+        float radius = std::min(size(generator), largest);
+        AABB room = inside(radius);
+        Vec3 center = uniform(room);
+        if (clusters && unit(generator) < clustering) {
+            // A few tries to land in the volume, then the bubble stays where
+            // the uniform draw put it rather than piling up on the walls.
+            const Vec3& cluster = centers[pick(generator)];
+            for (int attempt = 0; attempt < 8; attempt++) {
+                Vec3 point = cluster + Vec3(spread(generator), spread(generator), spread(generator));
+                if (point.x >= room.min().x && point.y >= room.min().y && point.z >= room.min().z &&
+                    point.x <= room.max().x && point.y <= room.max().y && point.z <= room.max().z) {
+                    center = point;
+                    break;
+                }
+            }
+        }
+        result.push_back({center, -radius});
+    }
+    return result;
+}
+
+bool BubbleGrid::valid() const {
+    size_t count = radius.size();
+    if (x.size() != count || y.size() != count || z.size() != count)
+        return false;
+    for (int axis = 0; axis < 3; axis++)
+        if (dims[axis] < 1 || dims[axis] > MAX_CELLS_PER_AXIS)
+            return false;
+    // Walks convert offsets into the bounds to cell indices, which must stay
+    // within int; an empty grid is never walked.
+    for (int axis = 0; count > 0 && axis < 3; axis++) {
+        float low = bounds.min()[axis], high = bounds.max()[axis];
+        if (!std::isfinite(low) || !std::isfinite(high) || !(low <= high) || !(cellSize[axis] > 0.0f) ||
+            !std::isfinite(invCellSize[axis]) || !((high - low) * invCellSize[axis] <= dims[axis] + 1.0f))
+            return false;
+    }
+    size_t cellCount = static_cast<size_t>(dims[0]) * dims[1] * dims[2];
+    if (cells.size() != cellCount + 1 || cells.front() != 0 || cells.back() != items.size())
+        return false;
+    for (size_t cell = 0; cell < cellCount; cell++)
+        if (cells[cell] > cells[cell + 1])
+            return false;
+    for (uint32_t item : items)
+        if (item >= count)
+            return false;
+    return true;
+}
+
+// Cells of the grid covering a coordinate of one axis.
+static int CellOf(const BubbleGrid& grid, int axis, float value) {
+    int index = static_cast<int>((value - grid.bounds.min()[axis]) * grid.invCellSize[axis]);
+    return std::clamp(index, 0, grid.dims[axis] - 1);
+}
+
+static std::shared_ptr<BubbleGrid> BuildGrid(const std::vector<Bubble>& bubbles) {
+    auto grid = std::make_shared<BubbleGrid>();
+    size_t count = bubbles.size();
+    if (count == 0) {
+        grid->cells.assign(2, 0);
+        return grid;
+    }
+
+    AABB bounds = AABB::empty();
+    for (const Bubble& bubble : bubbles) {
+        float extent = std::abs(bubble.radius);
+        bounds.extend(AABB(bubble.center - extent, bubble.center + extent));
+    }
+    grid->bounds = bounds;
+
+    // Cubic cells, as many as give the wanted bubbles per cell; a flat axis
+    // gets a single layer.
+    Vec3 extent = bounds.max() - bounds.min();
+    float largest = std::max(extent.x, std::max(extent.y, extent.z));
+    float floor = std::max(largest * 1e-3f, 1e-6f);
+    Vec3 sides(std::max(extent.x, floor), std::max(extent.y, floor), std::max(extent.z, floor));
+    float cell = std::cbrt(sides.x * sides.y * sides.z * BUBBLES_PER_CELL / count);
+    for (int axis = 0; axis < 3; axis++) {
+        int cells = static_cast<int>(std::lround(sides[axis] / cell));
+        grid->dims[axis] = std::clamp(cells, 1, MAX_CELLS_PER_AXIS);
+        grid->cellSize[axis] = sides[axis] / grid->dims[axis];
+        grid->invCellSize[axis] = 1.0f / grid->cellSize[axis];
+    }
+    size_t cells = static_cast<size_t>(grid->dims[0]) * grid->dims[1] * grid->dims[2];
+
+    auto cellOf = [&](const Vec3& point) {
+        int x = CellOf(*grid, 0, point.x), y = CellOf(*grid, 1, point.y), z = CellOf(*grid, 2, point.z);
+        return (static_cast<size_t>(z) * grid->dims[1] + y) * grid->dims[0] + x;
+    };
+
+    // Counting sort by the cell of the center, so the bubbles of a cell, and
+    // mostly those of its neighbours, sit next to each other in memory.
+    std::vector<uint32_t> start(cells + 1, 0);
+    for (const Bubble& bubble : bubbles)
+        start[cellOf(bubble.center) + 1]++;
+    for (size_t i = 0; i < cells; i++)
+        start[i + 1] += start[i];
+    std::vector<uint32_t> order(count);
+    for (uint32_t i = 0; i < count; i++)
+        order[start[cellOf(bubbles[i].center)]++] = i;
+
+    grid->x.resize(count);
+    grid->y.resize(count);
+    grid->z.resize(count);
+    grid->radius.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        const Bubble& bubble = bubbles[order[i]];
+        grid->x[i] = bubble.center.x;
+        grid->y[i] = bubble.center.y;
+        grid->z[i] = bubble.center.z;
+        grid->radius[i] = bubble.radius;
+    }
+
+    // Every bubble goes into each cell its box overlaps. The box is padded a
+    // little so that rounding never leaves out the cell a hit lies in.
+    auto range = [&](size_t i, int axis, int& first, int& last) {
+        float center = axis == 0 ? grid->x[i] : axis == 1 ? grid->y[i] : grid->z[i];
+        float extent = std::abs(grid->radius[i]) + grid->cellSize[axis] * 1e-3f;
+        first = CellOf(*grid, axis, center - extent);
+        last = CellOf(*grid, axis, center + extent);
+    };
+    auto overlapped = [&](size_t i, auto&& visit) {
+        int first[3], last[3];
+        for (int axis = 0; axis < 3; axis++)
+            range(i, axis, first[axis], last[axis]);
+        for (int z = first[2]; z <= last[2]; z++)
+            for (int y = first[1]; y <= last[1]; y++)
+                for (int x = first[0]; x <= last[0]; x++)
+                    visit((static_cast<size_t>(z) * grid->dims[1] + y) * grid->dims[0] + x);
+    };
+
+    grid->cells.assign(cells + 1, 0);
+    for (size_t i = 0; i < count; i++)
+        overlapped(i, [&](size_t cell) { grid->cells[cell + 1]++; });
+    for (size_t i = 0; i < cells; i++)
+        grid->cells[i + 1] += grid->cells[i];
+    grid->items.resize(grid->cells[cells]);
+    std::vector<uint32_t> fill(grid->cells.begin(), grid->cells.end() - 1);
+    for (uint32_t i = 0; i < count; i++)
+        overlapped(i, [&](size_t cell) { grid->items[fill[cell]++] = i; });
+    return grid;
+}
+
+BubbleCloud::BubbleCloud(const std::vector<Bubble>& bubbles) {
+    auto start = std::chrono::steady_clock::now();
+    m_grid = BuildGrid(bubbles);
+    auto end = std::chrono::steady_clock::now();
+    m_buildMs = std::chrono::duration<double, std::milli>(end - start).count();
+    m_center = m_grid->bounds.center();
+}
+
+BubbleCloud::BubbleCloud(const AABB& volume, const BubbleSettings& settings)
+    : BubbleCloud(GenerateBubbles(volume, settings)) {}
+
+BubbleCloud::BubbleCloud(std::shared_ptr<const BubbleGrid> grid)
+    : m_grid(std::move(grid)), m_center(m_grid->bounds.center()) {}
+
+BubbleCloudStats BubbleCloud::stats() const {
+    const BubbleGrid& grid = *m_grid;
+    BubbleCloudStats stats;
+    stats.bubbles = grid.radius.size();
+    std::copy(grid.dims, grid.dims + 3, stats.dims);
+    size_t cells = static_cast<size_t>(grid.dims[0]) * grid.dims[1] * grid.dims[2];
+    stats.perCell = static_cast<double>(grid.items.size()) / cells;
+    stats.buildMs = m_buildMs;
+    stats.bytes = (grid.x.size() * 4 + grid.cells.size() + grid.items.size()) * sizeof(float);
+    return stats;
+}
+
+std::ostream& operator<<(std::ostream& out, const BubbleCloudStats& stats) {
+    return out << stats.bubbles << " in a " << stats.dims[0] << "x" << stats.dims[1] << "x" << stats.dims[2]
+               << " grid, " << stats.perCell << " per cell, " << stats.buildMs << " ms, " << stats.bytes / 1024
+               << " KiB";
+}
+
+// Nearer root of the ray-sphere equation, computed as for a Sphere so that
+// a cloud renders exactly like the same bubbles added one by one.
+static float BubbleRoot(const BubbleGrid& grid, uint32_t bubble, const Ray& ray) {
+    Vec3 oc = ray.origin - Vec3(grid.x[bubble], grid.y[bubble], grid.z[bubble]);
+    float radius = grid.radius[bubble];
+    float a = Dot(ray.direction, ray.direction);
+    float h = Dot(oc, ray.direction);
+    float c = Dot(oc, oc) - radius * radius;
+
+    float discriminant = h * h - a * c;
+    if (discriminant < 0)
+        return -1.0f;
+    return (-h - std::sqrt(discriminant)) / a;
+}
+
+bool BubbleCloud::hit(const Ray& worldRay, Hit& hit) const {
+    const BubbleGrid& grid = *m_grid;
+    Ray ray = m_instance.rayToObject(worldRay);
+    bool found = false;
+    grid.walk(ray, hit.t, [&](size_t cell, float tExit) {
+        uint32_t first = grid.cells[cell], last = grid.cells[cell + 1];
+        CountTests(TraceStats::Primitive::Sphere, last - first);
+        for (uint32_t i = first; i < last; i++) {
+            uint32_t bubble = grid.items[i];
+            float root = BubbleRoot(grid, bubble, ray);
+            if (root >= 0.001f && root < hit.t) {
+                hit.t = root;
+                hit.primitive = bubble;
+                found = true;
+            }
+        }
+        // A bubble met in a later cell can only be hit further away.
+        return found && hit.t <= tExit;
+    });
+    return found;
+}
+
+bool BubbleCloud::occluded(const Ray& worldRay, float tMax) const {
+    const BubbleGrid& grid = *m_grid;
+    Ray ray = m_instance.rayToObject(worldRay);
+    bool blocked = false;
+    grid.walk(ray, tMax, [&](size_t cell, float) {
+        uint32_t first = grid.cells[cell], last = grid.cells[cell + 1];
+        for (uint32_t i = first; i < last; i++) {
+            float root = BubbleRoot(grid, grid.items[i], ray);
+            if (root >= 0.001f && root < tMax) {
+                CountTests(TraceStats::Primitive::Sphere, i - first + 1);
+                return blocked = true;
+            }
+        }
+        CountTests(TraceStats::Primitive::Sphere, last - first);
+        return false;
+    });
+    return blocked;
+}
+
+Vec3 BubbleCloud::normal(const Vec3& position, uint32_t primitive) const {
+    const BubbleGrid& grid = *m_grid;
+    Vec3 center(grid.x[primitive], grid.y[primitive], grid.z[primitive]);
+    return m_instance.normalToWorld((m_instance.pointToObject(position) - center) / grid.radius[primitive]);
+}
+
+void BubbleCloud::update() {
+    m_instance.place(m_center, m_rotation, m_scale, m_grid->bounds.center());
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <ostream>
+#include <vector>
+#include "geometry.h"
+#include "renderer.h"
+
+// One bubble: a sphere that, like Sphere, turns its normals inward when the
+// radius is negative.
+struct Bubble {
+    Vec3  center;
+    float radius;
+};
+
+// Procedural population of a volume, the same for the same settings.
+struct BubbleSettings {
+    unsigned seed = 0;
+    float    density = 200.0f;      // bubbles per unit of volume
+    float    medianRadius = 0.03f;  // radii are log-normal around the median
+    float    radiusSpread = 0.5f;   // standard deviation of the log of the radius
+    float    maxRadius = 0.25f;
+    float    clustering = 0.0f;     // share of the bubbles gathered in clusters, 0 to 1
+    float    clusterSize = 0.3f;    // standard deviation of a cluster around its center
+    int      clusterBubbles = 500;  // average bubbles per cluster
+};
+
+// Bubbles with negative radii filling volume, each one entirely inside it.
+std::vector<Bubble> GenerateBubbles(const AABB& volume, const BubbleSettings& settings);
+
+// Bubbles in packed arrays, sorted by the cell of their center, and a
+// uniform grid over them: cells[cell] .. cells[cell + 1] index the items of
+// every bubble that overlaps the cell. Shared by every copy of a cloud.
+struct BubbleGrid {
+    std::vector<float>    x, y, z;
+    std::vector<float>    radius;
+    std::vector<uint32_t> cells;
+    std::vector<uint32_t> items;
+    AABB                  bounds;
+    int                   dims[3] = {1, 1, 1};
+    Vec3                  cellSize;
+    Vec3                  invCellSize;
+
+    // Whether a grid received from another process can be walked without
+    // leaving its arrays: one entry per bubble in each array, finite bounds
+    // split into the cells by cellSize and invCellSize, a cell range per
+    // cell within items and items naming existing bubbles.
+    bool valid() const;
+
+    // Calls visit(cell, tExit) for the cells the ray crosses before tMax,
+    // nearest first, walking the grid with the 3D DDA of Amanatides and Woo.
+    // tExit is where the ray leaves the cell; visit returns true to stop.
+    template <typename Visit>
+    void walk(const Ray& ray, float tMax, Visit&& visit) const;
+};
+
+// Size of the grid of a cloud and the time it took to build.
+struct BubbleCloudStats {
+    size_t bubbles = 0;
+    int    dims[3] = {1, 1, 1};
+    double perCell = 0.0; // bubbles listed per cell, one entry for each cell a bubble overlaps
+    double buildMs = 0.0; // 0 for a grid built elsewhere
+    size_t bytes = 0;
+};
+
+// "N in a XxYxZ grid, P per cell, T ms, K KiB".
+std::ostream& operator<<(std::ostream& out, const BubbleCloudStats& stats);
+
+// Thousands to millions of bubbles as one object. A ray only tests the
+// bubbles of the grid cells it crosses, so its cost grows with the bubbles
+// along it rather than with the total. Like a Model, the cloud is placed by
+// a position (of the center of its bounds), a rotation and a uniform scale.
+class BubbleCloud final : public IObject {
+public:
+    explicit BubbleCloud(const std::vector<Bubble>& bubbles);
+    BubbleCloud(const AABB& volume, const BubbleSettings& settings);
+    explicit BubbleCloud(std::shared_ptr<const BubbleGrid> grid);
+    // The primitive of a hit is the index of the bubble in the grid.
+    bool hit(const Ray& ray, Hit& hit) const override;
+    bool occluded(const Ray& ray, float tMax) const override;
+    using IObject::occluded;
+    Vec3 normal(const Vec3& position, uint32_t primitive) const override;
+    AABB bounds() const override { return m_instance.boundsToWorld(m_grid->bounds); }
+    std::shared_ptr<IObject> clone() const override { return std::make_shared<BubbleCloud>(*this); }
+    Vec3& getPosition() override { return m_center; }
+    Vec3& getRotation() override { return m_rotation; }
+    float& getScale() override { return m_scale; }
+    void update() override;
+    size_t size() const { return m_grid->radius.size(); }
+    const std::shared_ptr<const BubbleGrid>& grid() const { return m_grid; }
+    BubbleCloudStats stats() const;
+
+private:
+    std::shared_ptr<const BubbleGrid> m_grid;
+    double            m_buildMs = 0.0;
+    Vec3              m_center;
+    Vec3              m_rotation;
+    float             m_scale = 1.0f;
+    InstanceTransform m_instance;
+};
+
+template <typename Visit>
+void BubbleGrid::walk(const Ray& ray, float tMax, Visit&& visit) const {
+    Vec3 invDirection(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+    float tEntry;
+    if (radius.empty() || !bounds.hit(ray, invDirection, tMax, tEntry))
+        return;
+
+    Vec3 entry = ray.at(tEntry);
+    int cell[3], step[3];
+    float next[3], delta[3];
+    for (int axis = 0; axis < 3; axis++) {
+        int index = static_cast<int>((entry[axis] - bounds.min()[axis]) * invCellSize[axis]);
+        cell[axis] = std::clamp(index, 0, dims[axis] - 1);
+        if (ray.direction[axis] == 0.0f) {
+            step[axis] = 0;
+            next[axis] = delta[axis] = std::numeric_limits<float>::infinity();
+            continue;
+        }
+        step[axis] = ray.direction[axis] > 0.0f ? 1 : -1;
+        float boundary = bounds.min()[axis] + (cell[axis] + (step[axis] > 0)) * cellSize[axis];
+        next[axis] = (boundary - ray.origin[axis]) * invDirection[axis];
+        delta[axis] = cellSize[axis] * std::abs(invDirection[axis]);
+    }
+
+    NodeCounter visited;
+    while (true) {
+        int axis = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2) : (next[1] < next[2] ? 1 : 2);
+        float tExit = std::min(next[axis], tMax);
+        visited++;
+        if (visit((static_cast<size_t>(cell[2]) * dims[1] + cell[1]) * dims[0] + cell[0], tExit) || next[axis] >= tMax)
+            return;
+        cell[axis] += step[axis];
+        if (cell[axis] < 0 || cell[axis] >= dims[axis])
+            return;
+        next[axis] += delta[axis];
+    }
+}
@@ -0,0 +1,259 @@
+#include "pch.h"
+#include "bvh.h"
+#include <algorithm>
+#include <chrono>
+#include <numeric>
+
+constexpr int SAH_BINS = 16;
+constexpr float SAH_TRAVERSAL_COST = 1.0f;
+
+float BVH::nodeCost(const BVHNode& node) {
+    return node.isLeaf() ? static_cast<float>(node.count) : SAH_TRAVERSAL_COST;
+}
+
+void BVH::updateCost(const Storage& storage) {
+    float rootArea = storage.nodes.empty() ? 0.0f : storage.nodes[0].bounds.area();
+    m_stats.sahCost = rootArea > 0.0f ? static_cast<float>(storage.area / rootArea) : 0.0f;
+}
+
+void BVH::build(const std::vector<AABB>& primitives, int maxLeafSize) {
+    auto start = std::chrono::steady_clock::now();
+
+    auto storage = std::make_shared<Storage>();
+    m_stats = BVHStats();
+    storage->indices.resize(primitives.size());
+    std::iota(storage->indices.begin(), storage->indices.end(), 0);
+
+    if (!primitives.empty()) {
+        std::vector<Vec3> centroids;
+        centroids.reserve(primitives.size());
+        for (const auto& bounds : primitives)
+            centroids.push_back(bounds.center());
+
+        storage->nodes.reserve(2 * primitives.size());
+        buildNode(*storage, primitives, centroids, 0, static_cast<uint32_t>(primitives.size()), 1,
+                  std::max(1, maxLeafSize));
+        storage->nodes.shrink_to_fit();
+    }
+    for (const BVHNode& node : storage->nodes)
+        storage->area += nodeCost(node) * node.bounds.area();
+    updateCost(*storage);
+
+    m_nodes = storage->nodes;
+    m_indices = storage->indices;
+    m_storage = std::move(storage);
+    m_owner = nullptr;
+
+    auto end = std::chrono::steady_clock::now();
+    m_stats.nodes = static_cast<int>(m_nodes.size());
+    m_stats.buildMs = std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+BVH BVH::view(std::span<const BVHNode> nodes, std::span<const uint32_t> indices, const BVHStats& stats,
+              std::shared_ptr<const void> owner) {
+    BVH bvh;
+    bvh.m_owner = std::move(owner);
+    bvh.m_nodes = nodes;
+    bvh.m_indices = indices;
+    bvh.m_stats = stats;
+    return bvh;
+}
+
+bool BVH::valid(size_t primitives) const {
+    for (uint32_t primitive : m_indices)
+        if (primitive >= primitives)
+            return false;
+
+    // Children come after their parent, so depths are final when reached.
+    std::vector<int> depth(m_nodes.size(), 0);
+    for (size_t index = 0; index < m_nodes.size(); index++) {
+        const BVHNode& node = m_nodes[index];
+        if (node.isLeaf()) {
+            if (static_cast<uint64_t>(node.offset) + node.count > m_indices.size())
+                return false;
+            continue;
+        }
+        if (depth[index] >= MAX_DEPTH || index + 1 >= m_nodes.size() || node.offset <= index + 1 ||
+            node.offset >= m_nodes.size())
+            return false;
+        depth[index + 1] = std::max(depth[index + 1], depth[index] + 1);
+        depth[node.offset] = std::max(depth[node.offset], depth[index] + 1);
+    }
+    return true;
+}
+
+BVH::Storage& BVH::unshare() {
+    assert(m_storage && "only built trees can be refitted");
+    // A scene snapshot being rendered may share this tree.
+    if (m_storage.use_count() > 1) {
+        m_storage = std::make_shared<Storage>(*m_storage);
+        m_nodes = m_storage->nodes;
+        m_indices = m_storage->indices;
+    }
+    return *m_storage;
+}
+
+void BVH::refitNode(Storage& storage, const std::vector<AABB>& primitives, uint32_t index) {
+    BVHNode& node = storage.nodes[index];
+    AABB bounds = AABB::empty();
+    if (node.isLeaf()) {
+        for (uint32_t slot = node.offset; slot < node.offset + node.count; slot++)
+            bounds.extend(primitives[storage.indices[slot]]);
+    } else {
+        bounds.extend(storage.nodes[index + 1].bounds);
+        bounds.extend(storage.nodes[node.offset].bounds);
+    }
+    storage.area += nodeCost(node) * (bounds.area() - node.bounds.area());
+    node.bounds = bounds;
+}
+
+void BVH::refit(const std::vector<AABB>& primitives, std::span<const uint32_t> changed) {
+    if (m_nodes.empty() || changed.empty())
+        return;
+    Storage& storage = unshare();
+    assert(primitives.size() == storage.indices.size());
+
+    if (storage.parents.empty()) {
+        storage.parents.assign(storage.nodes.size(), NO_PARENT);
+        storage.leaves.resize(storage.indices.size());
+        for (uint32_t index = 0; index < storage.nodes.size(); index++) {
+            const BVHNode& node = storage.nodes[index];
+            if (node.isLeaf()) {
+                for (uint32_t slot = node.offset; slot < node.offset + node.count; slot++)
+                    storage.leaves[storage.indices[slot]] = index;
+            } else {
+                storage.parents[index + 1] = index;
+                storage.parents[node.offset] = index;
+            }
+        }
+    }
+
+    // Children are stored after their parent, so refitting the affected
+    // nodes from the highest index down sees every child before its parent.
+    std::vector<uint32_t> affected;
+    for (uint32_t primitive : changed)
+        for (uint32_t node = storage.leaves[primitive]; node != NO_PARENT; node = storage.parents[node])
+            affected.push_back(node);
+    std::sort(affected.begin(), affected.end(), std::greater<uint32_t>());
+    affected.erase(std::unique(affected.begin(), affected.end()), affected.end());
+    for (uint32_t node : affected)
+        refitNode(storage, primitives, node);
+    updateCost(storage);
+}
+
+void BVH::refit(const std::vector<AABB>& primitives) {
+    if (m_nodes.empty())
+        return;
+    Storage& storage = unshare();
+    assert(primitives.size() == storage.indices.size());
+    for (uint32_t index = static_cast<uint32_t>(storage.nodes.size()); index-- > 0;)
+        refitNode(storage, primitives, index);
+    // Recomputed from scratch to drop the rounding of earlier partial refits.
+    storage.area = 0.0;
+    for (const BVHNode& node : storage.nodes)
+        storage.area += nodeCost(node) * node.bounds.area();
+    updateCost(storage);
+}
+
+uint32_t BVH::buildNode(Storage& storage, const std::vector<AABB>& primitives, const std::vector<Vec3>& centroids,
+                        uint32_t begin, uint32_t end, int depth, int maxLeafSize) {
+    uint32_t index = static_cast<uint32_t>(storage.nodes.size());
+    storage.nodes.emplace_back();
+    m_stats.depth = std::max(m_stats.depth, depth);
+
+    AABB bounds = AABB::empty();
+    AABB centroidBounds = AABB::empty();
+    for (uint32_t i = begin; i < end; i++) {
+        bounds.extend(primitives[storage.indices[i]]);
+        centroidBounds.extend(centroids[storage.indices[i]]);
+    }
+    storage.nodes[index].bounds = bounds;
+
+    uint32_t count = end - begin;
+    auto makeLeaf = [&]() {
+        storage.nodes[index].offset = begin;
+        storage.nodes[index].count = count;
+        m_stats.leaves++;
+        return index;
+    };
+    if (count <= static_cast<uint32_t>(maxLeafSize) || depth >= MAX_DEPTH)
+        return makeLeaf();
+
+    struct Bin {
+        AABB bounds = AABB::empty();
+        uint32_t count = 0;
+    };
+
+    int bestAxis = -1;
+    int bestSplit = 0;
+    float bestCost = std::numeric_limits<float>::max();
+    Vec3 extent = centroidBounds.max() - centroidBounds.min();
+    for (int axis = 0; axis < 3; axis++) {
+        if (extent[axis] <= 0.0f)
+            continue;
+
+        Bin bins[SAH_BINS];
+        float scale = SAH_BINS / extent[axis];
+        for (uint32_t i = begin; i < end; i++) {
+            uint32_t primitive = storage.indices[i];
+            int bin = std::min(SAH_BINS - 1, static_cast<int>((centroids[primitive][axis] - centroidBounds.min()[axis]) * scale));
+            bins[bin].bounds.extend(primitives[primitive]);
+            bins[bin].count++;
+        }
+
+        // Sweep from the right to get the cost of every "bins [split + 1, end)" side.
+        float rightArea[SAH_BINS - 1];
+        uint32_t rightCount[SAH_BINS - 1];
+        AABB right = AABB::empty();
+        uint32_t accumulated = 0;
+        for (int split = SAH_BINS - 2; split >= 0; split--) {
+            right.extend(bins[split + 1].bounds);
+            accumulated += bins[split + 1].count;
+            rightArea[split] = right.area();
+            rightCount[split] = accumulated;
+        }
+
+        AABB left = AABB::empty();
+        accumulated = 0;
+        for (int split = 0; split < SAH_BINS - 1; split++) {
+            left.extend(bins[split].bounds);
+            accumulated += bins[split].count;
+            if (accumulated == 0 || rightCount[split] == 0)
+                continue;
+            float cost = left.area() * accumulated + rightArea[split] * rightCount[split];
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = split;
+            }
+        }
+    }
+
+    uint32_t middle = begin;
+    if (bestAxis >= 0) {
+        float area = bounds.area();
+        float leafCost = static_cast<float>(count);
+        float splitCost = area > 0.0f ? SAH_TRAVERSAL_COST + bestCost / area : leafCost;
+        if (splitCost >= leafCost && count <= 4 * static_cast<uint32_t>(maxLeafSize))
+            return makeLeaf();
+
+        float scale = SAH_BINS / extent[bestAxis];
+        float minimum = centroidBounds.min()[bestAxis];
+        auto first = storage.indices.begin();
+        auto it = std::partition(first + begin, first + end, [&](uint32_t primitive) {
+            int bin = std::min(SAH_BINS - 1, static_cast<int>((centroids[primitive][bestAxis] - minimum) * scale));
+            return bin <= bestSplit;
+        });
+        middle = static_cast<uint32_t>(it - first);
+    }
+
+    // Coincident centroids cannot be separated by binning, split them evenly.
+    if (middle == begin || middle == end)
+        middle = begin + count / 2;
+
+    buildNode(storage, primitives, centroids, begin, middle, depth + 1, maxLeafSize);
+    uint32_t second = buildNode(storage, primitives, centroids, middle, end, depth + 1, maxLeafSize);
+    storage.nodes[index].offset = second;
+    storage.nodes[index].count = 0;
+    return index;
+}
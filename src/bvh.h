@@ -0,0 +1,319 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <vector>
+#include "geometry.h"
+#include "packet.h"
+#include "tracestats.h"
+
+// Nodes are stored depth-first in one flat array: the first child of an
+// interior node always directly follows it, so only the second one is stored.
+struct BVHNode {
+    AABB     bounds;
+    uint32_t offset; // leaf: first primitive slot, interior: index of the second child
+    uint32_t count;  // number of primitives in a leaf, 0 for interior nodes
+
+    bool isLeaf() const { return count > 0; }
+};
+
+struct BVHStats {
+    int    nodes = 0;
+    int    leaves = 0;
+    int    depth = 0;
+    double buildMs = 0.0;
+    // Expected intersection cost of a ray entering the root under the
+    // surface area heuristic; refits that stretch nodes drive it up. Only
+    // known for trees made by build().
+    float  sahCost = 0.0f;
+};
+
+class BVH {
+public:
+    static constexpr int MAX_DEPTH = 64;
+
+    BVH() = default;
+
+    // Binned SAH build over primitive bounds. Leaves reference ranges of
+    // "slots"; indices()[slot] is the input primitive stored in that slot.
+    void build(const std::vector<AABB>& primitives, int maxLeafSize = 4);
+
+    // Wraps prebuilt node and slot arrays, e.g. from a mapped mesh cache,
+    // without copying them. owner keeps the memory behind the spans alive.
+    static BVH view(std::span<const BVHNode> nodes, std::span<const uint32_t> indices, const BVHStats& stats,
+                    std::shared_ptr<const void> owner);
+    // Whether a viewed tree can be traversed without leaving its arrays:
+    // children follow their parent, leaves cover existing slots, slots hold
+    // primitives below primitives and no leaf is deeper than MAX_DEPTH.
+    bool valid(size_t primitives) const;
+
+    // Recomputes the bounds of the leaves holding the changed primitives and
+    // of their ancestors from primitives, keeping the tree as it is, and
+    // updates stats().sahCost. Copies of the tree are left untouched. Only
+    // for trees made by build().
+    void refit(const std::vector<AABB>& primitives, std::span<const uint32_t> changed);
+    // Same for every node.
+    void refit(const std::vector<AABB>& primitives);
+
+    // Front-to-back traversal. intersect(slot, tMax) is called for every
+    // primitive slot in a visited leaf and shrinks tMax on a closer hit;
+    // subtrees entered beyond tMax are skipped.
+    template <typename Intersect>
+    void traverse(const Ray& ray, float& tMax, Intersect&& intersect) const;
+
+    // Same traversal with one intersectLeaf(leaf, tMax) call per visited leaf.
+    template <typename IntersectLeaf>
+    void traverseLeaves(const Ray& ray, float& tMax, IntersectLeaf&& intersectLeaf) const;
+
+    // Any-hit traversal for shadow rays: stops as soon as occluded(slot) or
+    // occludedLeaf(leaf) reports a primitive closer than tMax, without ordering
+    // the children. Returns whether that happened.
+    template <typename Occluded>
+    bool anyHit(const Ray& ray, float tMax, Occluded&& occluded) const;
+
+    template <typename OccludedLeaf>
+    bool anyHitLeaves(const Ray& ray, float tMax, OccludedLeaf&& occludedLeaf) const;
+
+    // Packet variant: a node is visited when any active lane enters it before
+    // its tMax, and intersect(slot, mask) receives the lanes that entered the
+    // leaf. Children are visited nearer-first along the packet's mean direction.
+    template <typename Intersect>
+    void traverse(const RayPacket& packet, Mask4 active, Float4& tMax, Intersect&& intersect) const;
+
+    template <typename IntersectLeaf>
+    void traverseLeaves(const RayPacket& packet, Mask4 active, Float4& tMax, IntersectLeaf&& intersectLeaf) const;
+
+    // Packet any-hit traversal: occluded(slot, mask) or occludedLeaf(leaf,
+    // mask) returns the lanes of mask that are blocked before their tMax, and
+    // those lanes leave the traversal. Returns the blocked lanes.
+    template <typename Occluded>
+    Mask4 anyHit(const RayPacket& packet, Mask4 active, const Float4& tMax, Occluded&& occluded) const;
+
+    template <typename OccludedLeaf>
+    Mask4 anyHitLeaves(const RayPacket& packet, Mask4 active, const Float4& tMax, OccludedLeaf&& occludedLeaf) const;
+
+    bool empty() const                           { return m_nodes.empty(); }
+    std::span<const BVHNode> nodes() const       { return m_nodes; }
+    std::span<const uint32_t> indices() const    { return m_indices; }
+    const BVHStats& stats() const                { return m_stats; }
+
+private:
+    struct Storage {
+        std::vector<BVHNode>  nodes;
+        std::vector<uint32_t> indices;
+        double                area = 0.0; // SAH cost times the root area
+        // Filled on the first partial refit.
+        std::vector<uint32_t> parents;    // by node, NO_PARENT for the root
+        std::vector<uint32_t> leaves;     // leaf node by primitive
+    };
+
+    static constexpr uint32_t NO_PARENT = ~0u;
+
+    uint32_t buildNode(Storage& storage, const std::vector<AABB>& primitives, const std::vector<Vec3>& centroids,
+                       uint32_t begin, uint32_t end, int depth, int maxLeafSize);
+    // Makes this tree the only owner of its storage before it is modified.
+    Storage& unshare();
+    static float nodeCost(const BVHNode& node);
+    void refitNode(Storage& storage, const std::vector<AABB>& primitives, uint32_t index);
+    void updateCost(const Storage& storage);
+
+private:
+    // Built trees own their arrays; views share whatever owns the mapping.
+    std::shared_ptr<Storage>    m_storage;
+    std::shared_ptr<const void> m_owner;
+    std::span<const BVHNode>    m_nodes;
+    std::span<const uint32_t>   m_indices;
+    BVHStats                    m_stats;
+};
+
+template <typename Intersect>
+void BVH::traverse(const Ray& ray, float& tMax, Intersect&& intersect) const {
+    traverseLeaves(ray, tMax, [&](const BVHNode& leaf, float& t) {
+        for (uint32_t slot = leaf.offset; slot < leaf.offset + leaf.count; slot++)
+            intersect(slot, t);
+    });
+}
+
+template <typename IntersectLeaf>
+void BVH::traverseLeaves(const Ray& ray, float& tMax, IntersectLeaf&& intersectLeaf) const {
+    if (m_nodes.empty())
+        return;
+
+    struct Entry {
+        uint32_t node;
+        float    tEntry;
+    };
+    Entry stack[MAX_DEPTH];
+    int size = 0;
+
+    Vec3 invDirection(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+    float tEntry;
+    if (!m_nodes[0].bounds.hit(ray, invDirection, tMax, tEntry))
+        return;
+
+    NodeCounter visited;
+    uint32_t index = 0;
+    while (true) {
+        const BVHNode& node = m_nodes[index];
+        visited++;
+        if (node.isLeaf()) {
+            intersectLeaf(node, tMax);
+        } else {
+            uint32_t near = index + 1;
+            uint32_t far = node.offset;
+            float tNear, tFar;
+            bool hitNear = m_nodes[near].bounds.hit(ray, invDirection, tMax, tNear);
+            bool hitFar = m_nodes[far].bounds.hit(ray, invDirection, tMax, tFar);
+            if (hitNear && hitFar) {
+                if (tFar < tNear) {
+                    std::swap(near, far);
+                    std::swap(tNear, tFar);
+                }
+                stack[size++] = {far, tFar};
+                index = near;
+                continue;
+            }
+            if (hitNear || hitFar) {
+                index = hitNear ? near : far;
+                continue;
+            }
+        }
+
+        // Pop the next subtree that may still contain something closer than tMax.
+        while (size > 0 && stack[size - 1].tEntry > tMax)
+            size--;
+        if (size == 0)
+            break;
+        index = stack[--size].node;
+    }
+}
+
+template <typename Occluded>
+bool BVH::anyHit(const Ray& ray, float tMax, Occluded&& occluded) const {
+    return anyHitLeaves(ray, tMax, [&](const BVHNode& leaf) {
+        for (uint32_t slot = leaf.offset; slot < leaf.offset + leaf.count; slot++)
+            if (occluded(slot))
+                return true;
+        return false;
+    });
+}
+
+template <typename OccludedLeaf>
+bool BVH::anyHitLeaves(const Ray& ray, float tMax, OccludedLeaf&& occludedLeaf) const {
+    if (m_nodes.empty())
+        return false;
+
+    Vec3 invDirection(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+    NodeCounter visited;
+    uint32_t stack[MAX_DEPTH + 1];
+    int size = 0;
+    stack[size++] = 0;
+    while (size > 0) {
+        const BVHNode& node = m_nodes[stack[--size]];
+        visited++;
+        float tEntry;
+        if (!node.bounds.hit(ray, invDirection, tMax, tEntry))
+            continue;
+
+        if (node.isLeaf()) {
+            if (occludedLeaf(node))
+                return true;
+            continue;
+        }
+        stack[size++] = node.offset;
+        stack[size++] = static_cast<uint32_t>(&node - m_nodes.data()) + 1;
+    }
+    return false;
+}
+
+template <typename Intersect>
+void BVH::traverse(const RayPacket& packet, Mask4 active, Float4& tMax, Intersect&& intersect) const {
+    traverseLeaves(packet, active, tMax, [&](const BVHNode& leaf, Mask4 lanes) {
+        for (uint32_t slot = leaf.offset; slot < leaf.offset + leaf.count; slot++)
+            intersect(slot, lanes);
+    });
+}
+
+template <typename IntersectLeaf>
+void BVH::traverseLeaves(const RayPacket& packet, Mask4 active, Float4& tMax, IntersectLeaf&& intersectLeaf) const {
+    if (m_nodes.empty() || active.none())
+        return;
+
+    Vec3x4 invDirection(Float4(1.0f) / packet.direction.x,
+                        Float4(1.0f) / packet.direction.y,
+                        Float4(1.0f) / packet.direction.z);
+    Vec3 meanDirection;
+    for (int lane = 0; lane < PACKET_SIZE; lane++) {
+        if (active[lane])
+            meanDirection += packet.ray(lane).direction;
+    }
+
+    NodeCounter visited;
+    uint32_t stack[MAX_DEPTH + 1];
+    int size = 0;
+    stack[size++] = 0;
+    while (size > 0) {
+        const BVHNode& node = m_nodes[stack[--size]];
+        visited++;
+        Float4 tEntry;
+        Mask4 entered = active & HitAABB(node.bounds, packet, invDirection, tMax, tEntry);
+        if (entered.none())
+            continue;
+
+        if (node.isLeaf()) {
+            intersectLeaf(node, entered);
+            continue;
+        }
+
+        uint32_t near = static_cast<uint32_t>(&node - m_nodes.data()) + 1;
+        uint32_t far = node.offset;
+        if (Dot(m_nodes[far].bounds.center() - m_nodes[near].bounds.center(), meanDirection) < 0.0f)
+            std::swap(near, far);
+        stack[size++] = far;
+        stack[size++] = near;
+    }
+}
+
+template <typename Occluded>
+Mask4 BVH::anyHit(const RayPacket& packet, Mask4 active, const Float4& tMax, Occluded&& occluded) const {
+    return anyHitLeaves(packet, active, tMax, [&](const BVHNode& leaf, Mask4 lanes) {
+        Mask4 blocked;
+        for (uint32_t slot = leaf.offset; slot < leaf.offset + leaf.count && (lanes & !blocked).any(); slot++)
+            blocked = blocked | occluded(slot, lanes & !blocked);
+        return blocked;
+    });
+}
+
+template <typename OccludedLeaf>
+Mask4 BVH::anyHitLeaves(const RayPacket& packet, Mask4 active, const Float4& tMax, OccludedLeaf&& occludedLeaf) const {
+    Mask4 open = active;
+    if (m_nodes.empty() || open.none())
+        return Mask4();
+
+    Vec3x4 invDirection(Float4(1.0f) / packet.direction.x,
+                        Float4(1.0f) / packet.direction.y,
+                        Float4(1.0f) / packet.direction.z);
+    NodeCounter visited;
+    uint32_t stack[MAX_DEPTH + 1];
+    int size = 0;
+    stack[size++] = 0;
+    while (size > 0) {
+        const BVHNode& node = m_nodes[stack[--size]];
+        visited++;
+        Float4 tEntry;
+        Mask4 entered = open & HitAABB(node.bounds, packet, invDirection, tMax, tEntry);
+        if (entered.none())
+            continue;
+
+        if (node.isLeaf()) {
+            open = open & !occludedLeaf(node, entered);
+            if (open.none())
+                break;
+            continue;
+        }
+        stack[size++] = node.offset;
+        stack[size++] = static_cast<uint32_t>(&node - m_nodes.data()) + 1;
+    }
+    return active & !open;
+}
@@ -0,0 +1,292 @@
+#include "pch.h"
+#include "animation.h"
+#include "bubblecloud.h"
+#include "framebuffer.h"
+#include "renderer.h"
+#include "scene.h"
+#include "model.h"
+#include "scenes.h"
+#include "scheduler.h"
+#include <chrono>
+#ifdef RAYTRACING_DISTRIBUTED
+#include "distributed.h"
+#endif
+
+struct Options {
+    int         width = 1400;
+    int         height = 700;
+    int         depth = 3;
+    int         threads = 0;
+    int         tileSize = 16;
+    int         bubbles = 5;
+    float       cloud = 0.0f;
+    unsigned    seed = 0;
+    float       ambient = 0.0f;
+    float       exposure = 1.0f;
+    float       gamma = 1.0f;
+    float       minContribution = RenderSettings().minContribution;
+    int         maxSamples = RenderSettings().maxSamples;
+    float       aaThreshold = RenderSettings().aaThreshold;
+    float       aaBudget = RenderSettings().aaBudget;
+    bool        plane = false;
+    bool        packets = true;
+    bool        indexedMesh = false;
+    bool        shadows = false;
+    std::string model;
+    std::string output = "render.png";
+    std::string timeline;
+    std::string stats;
+    int         frames = 1;
+    int         queue = 4;
+#ifdef RAYTRACING_DISTRIBUTED
+    std::string listen;
+    std::string worker;
+    int         spawn = 0;
+    int         rangeTiles = DistributedSettings().tilesPerRange;
+#endif
+};
+
+static void PrintUsage(const char* program) {
+    std::cout << "Usage: " << program << " [options]\n"
+              << "  -o, --output FILE   output image, .png or .ppm (default render.png)\n"
+              << "  --width N           image width (default 1400)\n"
+              << "  --height N          image height (default 700)\n"
+              << "  --depth N           maximum ray depth (default 3)\n"
+              << "  --threads N         render threads, 0 = all hardware threads (default 0)\n"
+              << "  --tile N            tile size in pixels (default 16)\n"
+              << "  --seed N            bubble placement seed (default 0)\n"
+              << "  --bubbles N         number of bubbles in the cube (default 5)\n"
+              << "  --cloud X           X small bubbles per unit of cube volume (default 0, none)\n"
+              << "  --ambient X         ambient light, 0..1 (default 0)\n"
+              << "  --exposure X        scale linear colors before quantizing (default 1)\n"
+              << "  --gamma X           encode the image with gamma X (default 1, linear)\n"
+              << "  --plane             show the ground plane\n"
+              << "  --shadows           trace shadow rays to the lights\n"
+              << "  --no-packets        trace primary rays one by one\n"
+              << "  --min-contribution X skip secondary rays adding less than X to a pixel (default 1/512)\n"
+              << "  --aa N              up to N samples in high-contrast pixels, 4, 9, 16... (default 1, off)\n"
+              << "  --aa-threshold X    contrast to a neighbour that triggers supersampling (default 0.1)\n"
+              << "  --aa-budget X       average samples per pixel allowed per frame (default 2)\n"
+              << "  --model FILE        add a triangulated OBJ model to the scene\n"
+              << "  --timeline FILE     render the animation keyed in FILE (format in animation.h);\n"
+              << "                      -o is then a pattern like frame_%04d.png\n"
+              << "  --frames N          animation frames spread over the timeline (default 1)\n"
+              << "  --queue N           finished frames waiting to be written (default 4)\n"
+              << "  --indexed-mesh      keep the model indexed instead of packing triangles\n"
+              << "  --stats FILE        write ray, intersection and traversal counts as JSON\n";
+#ifdef RAYTRACING_DISTRIBUTED
+    std::cout << "  --listen ADDRESS    render on the workers that connect to host:port or unix:/path\n"
+              << "  --spawn N           start N local workers for --listen\n"
+              << "  --range-tiles N     tiles handed to a worker at a time (default 16)\n"
+              << "  --worker ADDRESS    render for the coordinator at ADDRESS; scene options are ignored\n";
+#endif
+}
+
+static Options ParseOptions(int argc, char** argv) {
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc)
+                throw std::runtime_error("Missing value for " + arg);
+            return argv[++i];
+        };
+
+        if (arg == "-h" || arg == "--help") {
+            PrintUsage(argv[0]);
+            std::exit(EXIT_SUCCESS);
+        } else if (arg == "-o" || arg == "--output") {
+            options.output = value();
+        } else if (arg == "--width") {
+            options.width = std::stoi(value());
+        } else if (arg == "--height") {
+            options.height = std::stoi(value());
+        } else if (arg == "--depth") {
+            options.depth = std::stoi(value());
+        } else if (arg == "--threads") {
+            options.threads = std::stoi(value());
+        } else if (arg == "--tile") {
+            options.tileSize = std::stoi(value());
+        } else if (arg == "--seed") {
+            options.seed = static_cast<unsigned>(std::stoul(value()));
+        } else if (arg == "--bubbles") {
+            options.bubbles = std::stoi(value());
+#ifdef RAYTRACING_DISTRIBUTED
+        } else if (arg == "--listen") {
+            options.listen = value();
+        } else if (arg == "--worker") {
+            options.worker = value();
+        } else if (arg == "--spawn") {
+            options.spawn = std::stoi(value());
+        } else if (arg == "--range-tiles") {
+            options.rangeTiles = std::stoi(value());
+#endif
+        } else if (arg == "--cloud") {
+            options.cloud = std::stof(value());
+        } else if (arg == "--ambient") {
+            options.ambient = std::stof(value());
+        } else if (arg == "--exposure") {
+            options.exposure = std::stof(value());
+        } else if (arg == "--gamma") {
+            options.gamma = std::stof(value());
+        } else if (arg == "--plane") {
+            options.plane = true;
+        } else if (arg == "--min-contribution") {
+            options.minContribution = std::stof(value());
+        } else if (arg == "--aa") {
+            options.maxSamples = std::stoi(value());
+        } else if (arg == "--aa-threshold") {
+            options.aaThreshold = std::stof(value());
+        } else if (arg == "--aa-budget") {
+            options.aaBudget = std::stof(value());
+        } else if (arg == "--shadows") {
+            options.shadows = true;
+        } else if (arg == "--no-packets") {
+            options.packets = false;
+        } else if (arg == "--indexed-mesh") {
+            options.indexedMesh = true;
+        } else if (arg == "--model") {
+            options.model = value();
+        } else if (arg == "--timeline") {
+            options.timeline = value();
+        } else if (arg == "--frames") {
+            options.frames = std::stoi(value());
+        } else if (arg == "--queue") {
+            options.queue = std::stoi(value());
+        } else if (arg == "--stats") {
+            options.stats = value();
+        } else {
+            throw std::runtime_error("Unknown option " + arg);
+        }
+    }
+    if (options.width < 2 || options.height < 2)
+        throw std::runtime_error("Image must be at least 2x2 pixels");
+    if (options.frames < 1 || options.queue < 1)
+        throw std::runtime_error("Frame count and queue length must be positive");
+    if (options.gamma <= 0.0f)
+        throw std::runtime_error("Gamma must be positive");
+    if (options.tileSize < 1)
+        throw std::runtime_error("Tile size must be positive");
+    return options;
+}
+
+static void WriteStats(const std::string& filename, const RenderStats& stats, double milliseconds) {
+    std::ofstream out(filename);
+    if (!out.is_open())
+        throw std::runtime_error("Cannot open " + filename);
+    WriteStatsJson(out, stats, milliseconds);
+}
+
+// Renders here, or on the workers of --listen.
+static RenderStats RenderFrame([[maybe_unused]] const Options& options, [[maybe_unused]] const char* program,
+                               TileScheduler& scheduler, Framebuffer& framebuffer, const Camera& camera,
+                               const Scene& scene, const RenderSettings& settings) {
+#ifdef RAYTRACING_DISTRIBUTED
+    if (!options.listen.empty()) {
+        DistributedSettings distributed;
+        distributed.address = options.listen;
+        distributed.tilesPerRange = options.rangeTiles;
+        distributed.spawn = options.spawn;
+        distributed.program = program;
+        // Local workers share the cores unless told otherwise.
+        distributed.spawnThreads = options.threads > 0
+            ? options.threads
+            : std::max(1, static_cast<int>(std::thread::hardware_concurrency()) / std::max(1, options.spawn));
+        distributed.onListening = [&](size_t sceneBytes) {
+            std::cout << "Waiting for workers at " << options.listen << ", scene of " << sceneBytes / 1024
+                      << " KiB\n";
+        };
+        DistributedStats stats = RenderDistributed(distributed, &framebuffer, camera, scene, settings);
+        for (const DroppedWorker& worker : stats.dropped)
+            std::cerr << "Worker " << worker.index << " dropped after " << worker.ranges << " ranges: "
+                      << worker.reason << "\n";
+        std::cout << "Distributed: " << stats.workers << " workers, " << stats.ranges << " ranges of "
+                  << stats.tilesPerRange << " tiles, " << stats.lost << " lost, " << stats.backups
+                  << " backups, " << stats.wasted << " wasted\n";
+        return stats.render;
+    }
+#endif
+    return Render(scheduler, &framebuffer, camera, scene, settings);
+}
+
+int main(int argc, char** argv) {
+    try {
+        Options options = ParseOptions(argc, argv);
+#ifdef RAYTRACING_DISTRIBUTED
+        if (!options.worker.empty()) {
+            TileScheduler scheduler(options.threads);
+            int ranges = RunWorker(options.worker, scheduler);
+            std::cout << "Worker: " << ranges << " ranges rendered\n";
+            return EXIT_SUCCESS;
+        }
+        if (!options.listen.empty() && !options.timeline.empty())
+            throw std::runtime_error("--listen renders single frames and cannot be used with --timeline");
+        if (!options.listen.empty() && options.maxSamples >= 4)
+            throw std::runtime_error("--aa needs the whole frame and cannot be used with --listen");
+#endif
+
+        Scene scene;
+        LoadIceScene(scene, options.seed, options.bubbles);
+        if (options.cloud > 0.0f) {
+            BubbleSettings cloud;
+            cloud.seed = options.seed;
+            cloud.density = options.cloud;
+            Scene::ObjectId id = AddBubbleCloud(scene, cloud);
+            std::cout << "Bubbles: " << static_cast<const BubbleCloud&>(scene.object(id)).stats() << "\n";
+        }
+        if (!options.model.empty()) {
+            Model model(options.model, options.indexedMesh ? MeshLayout::Indexed : MeshLayout::Packed);
+            std::cout << "Model " << options.model << ": " << model.stats() << "\n";
+            scene.addObject(model);
+        }
+        scene.showPlane(options.plane);
+        scene.getAmbient() = options.ambient;
+        scene.commit();
+
+        Camera camera = DefaultCamera(static_cast<float>(options.width) / options.height);
+        Framebuffer framebuffer(options.width, options.height);
+        TileScheduler scheduler(options.threads);
+        RenderSettings settings;
+        settings.depth = options.depth;
+        settings.tileSize = options.tileSize;
+        settings.packets = options.packets;
+        settings.minContribution = options.minContribution;
+        settings.shadows = options.shadows;
+        settings.maxSamples = options.maxSamples;
+        settings.aaThreshold = options.aaThreshold;
+        settings.aaBudget = options.aaBudget;
+
+        if (!options.timeline.empty()) {
+            SequenceSettings sequence;
+            sequence.frames = options.frames;
+            sequence.output = options.output;
+            sequence.queue = options.queue;
+            sequence.exposure = options.exposure;
+            sequence.gamma = options.gamma;
+            sequence.render = settings;
+            SequenceStats stats = RenderSequence(scheduler, scene, camera, options.width, options.height,
+                                                 Timeline::load(options.timeline), sequence);
+            std::cout << options.frames << " frames in " << stats.totalMs << " ms: rendering " << stats.renderMs
+                      << " ms, scene updates " << stats.prepareMs << " ms (overlapped), stalled "
+                      << stats.stallMs << " ms, " << stats.render.rays << " rays\n";
+            if (!options.stats.empty())
+                WriteStats(options.stats, stats.render, stats.renderMs);
+            return EXIT_SUCCESS;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        RenderStats stats = RenderFrame(options, argv[0], scheduler, framebuffer, camera, scene, settings);
+        double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::cout << milliseconds << " ms, "
+                  << stats.rays << " rays, " << stats.pruned << " pruned, " << stats.shadowRays << " shadow rays, "
+                  << static_cast<double>(stats.samples) / (options.width * options.height) << " spp\n";
+
+        framebuffer.save(options.output, options.exposure, options.gamma);
+        if (!options.stats.empty())
+            WriteStats(options.stats, stats, milliseconds);
+    } catch (const std::exception& error) {
+        std::cerr << error.what() << "\n";
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,96 @@
+#include "pch.h"
+#include "dispatch.h"
+#include "packet.h"
+#include <cstdlib>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#endif
+
+#ifdef RAYTRACING_DISPATCH_AVX2
+int HitSpheres8AVX2(const float* first, const float* second, const float* ray, float tMax, float* t);
+void ResolveAVX2(const float* values, size_t count, uint8_t* output, float exposure, float gamma);
+#endif
+
+const char* SimdLevelName(SimdLevel level) {
+    switch (level) {
+        case SimdLevel::Scalar: return "scalar";
+        case SimdLevel::SSE2:   return "sse2";
+        case SimdLevel::SSE41:  return "sse4";
+        case SimdLevel::AVX2:   return "avx2";
+    }
+    return "unknown";
+}
+
+SimdLevel BuildSimdLevel() {
+#if defined(__AVX2__)
+    return SimdLevel::AVX2;
+#elif defined(__SSE4_1__)
+    return SimdLevel::SSE41;
+#elif defined(RAYTRACING_SSE)
+    return SimdLevel::SSE2;
+#else
+    return SimdLevel::Scalar;
+#endif
+}
+
+SimdLevel CpuSimdLevel() {
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+    // Also checks that the operating system saves the AVX registers.
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return SimdLevel::AVX2;
+    if (__builtin_cpu_supports("sse4.1"))
+        return SimdLevel::SSE41;
+    if (__builtin_cpu_supports("sse2"))
+        return SimdLevel::SSE2;
+    return SimdLevel::Scalar;
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    int info[4];
+    __cpuid(info, 0);
+    int maximum = info[0];
+    __cpuid(info, 1);
+    bool sse2 = (info[3] >> 26) & 1;
+    bool sse41 = (info[2] >> 19) & 1;
+    bool osxsave = (info[2] >> 27) & 1;
+    bool avx = (info[2] >> 28) & 1;
+    bool avx2 = false;
+    if (maximum >= 7 && osxsave && avx && (_xgetbv(0) & 0x6) == 0x6) {
+        __cpuidex(info, 7, 0);
+        avx2 = (info[1] >> 5) & 1;
+    }
+    if (avx2)
+        return SimdLevel::AVX2;
+    if (sse41)
+        return SimdLevel::SSE41;
+    return sse2 ? SimdLevel::SSE2 : SimdLevel::Scalar;
+#else
+    return BuildSimdLevel();
+#endif
+}
+
+static Kernels SelectKernels() {
+    SimdLevel level = CpuSimdLevel();
+    if (const char* cap = std::getenv("RAYTRACING_KERNELS")) {
+        for (SimdLevel candidate : {SimdLevel::Scalar, SimdLevel::SSE2, SimdLevel::SSE41, SimdLevel::AVX2})
+            if (std::strcmp(cap, SimdLevelName(candidate)) == 0)
+                level = std::min(level, candidate);
+    }
+
+    // Code compiled for the build level runs regardless of the selection.
+    Kernels kernels;
+    kernels.level = BuildSimdLevel();
+#ifdef RAYTRACING_DISPATCH_AVX2
+    if (level >= SimdLevel::AVX2) {
+        kernels.level = SimdLevel::AVX2;
+        kernels.hitSpheres8 = HitSpheres8AVX2;
+        kernels.resolve = ResolveAVX2;
+    }
+#endif
+    return kernels;
+}
+
+const Kernels& ActiveKernels() {
+    static const Kernels kernels = SelectKernels();
+    return kernels;
+}
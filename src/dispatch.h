@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Instruction set levels, in increasing order.
+enum class SimdLevel : uint8_t { Scalar, SSE2, SSE41, AVX2 };
+
+const char* SimdLevelName(SimdLevel level);
+// Level the whole build was compiled for (RAYTRACING_SIMD in CMakeLists.txt).
+SimdLevel BuildSimdLevel();
+// Highest level this processor and operating system support.
+SimdLevel CpuSimdLevel();
+
+// Kernels that exist in wider variants than the build level, compiled in
+// their own translation units and picked at startup, so that one binary runs
+// everywhere and still uses AVX2 where the processor has it. A null entry
+// means the caller's own code for the build level is the best available.
+// Every variant computes bit-identical results to the baseline code.
+struct Kernels {
+    SimdLevel level = SimdLevel::Scalar;
+
+    // One ray against the eight spheres of two consecutive sphere blocks,
+    // each laid out as center[3][4], radius[4]. ray holds the origin and the
+    // direction; writes eight distances to t and returns the lanes that hit
+    // between 0.001 and tMax as a bit mask.
+    int (*hitSpheres8)(const float* first, const float* second, const float* ray, float tMax, float* t) = nullptr;
+
+    // Framebuffer::resolve over count channel values, padded to a multiple
+    // of 16 and 64-byte aligned.
+    void (*resolve)(const float* values, size_t count, uint8_t* output, float exposure, float gamma) = nullptr;
+};
+
+// The kernels of the best level available, capped by the RAYTRACING_KERNELS
+// environment variable (scalar, sse2, sse4 or avx2) when it is set.
+const Kernels& ActiveKernels();
@@ -0,0 +1,424 @@
+#include "pch.h"
+#include "distributed.h"
+#include "framebuffer.h"
+#include "sceneio.h"
+#include "scheduler.h"
+#include "socket.h"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <thread>
+
+#include <csignal>
+#include <spawn.h>
+#include <sys/wait.h>
+
+extern char** environ;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Seconds a worker keeps trying to reach a coordinator that is not up yet.
+constexpr double CONNECT_RETRY_SECONDS = 10.0;
+constexpr uint64_t MAX_MESSAGE_SIZE = uint64_t(1) << 36;
+
+// Coordinator to worker: Job once, then Range until Done. Worker to
+// coordinator: one Result per Range.
+enum class Message : uint32_t { Job, Range, Result, Done };
+
+struct MessageHeader {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t size;
+};
+
+void SendMessage(const Socket& socket, Message type, const std::string& payload = {}) {
+    MessageHeader header = {static_cast<uint32_t>(type), 0, payload.size()};
+    socket.send(&header, sizeof(header));
+    socket.send(payload.data(), payload.size());
+}
+
+// Returns false when the peer closed the connection between two messages.
+bool ReceiveMessage(const Socket& socket, Message& type, std::string& payload) {
+    MessageHeader header;
+    if (!socket.receive(&header, sizeof(header)))
+        return false;
+    if (header.type > static_cast<uint32_t>(Message::Done) || header.size > MAX_MESSAGE_SIZE)
+        throw std::runtime_error("Malformed message");
+    type = static_cast<Message>(header.type);
+    payload.resize(header.size);
+    if (header.size > 0 && !socket.receive(payload.data(), payload.size()))
+        throw std::runtime_error("Connection closed in the middle of a message");
+    return true;
+}
+
+// What a worker needs besides the scene; other render settings keep their
+// defaults.
+struct JobSettings {
+    int32_t width;
+    int32_t height;
+    Camera  camera;
+    int32_t depth;
+    int32_t tileSize;
+    float   minContribution;
+    uint8_t packets;
+    uint8_t shadows;
+};
+
+// Floats of rgb in the tiles of a range.
+size_t RangeFloats(const std::vector<Tile>& tiles, int first, int last) {
+    size_t floats = 0;
+    for (int i = first; i < last; i++)
+        floats += static_cast<size_t>(tiles[i].x1 - tiles[i].x0) * (tiles[i].y1 - tiles[i].y0) * 3;
+    return floats;
+}
+
+class Coordinator {
+public:
+    Coordinator(const DistributedSettings& distributed, IFramebuffer* framebuffer, const RenderSettings& settings,
+                std::string job);
+    DistributedStats run(const Socket& listener);
+
+private:
+    struct Range {
+        int               first = 0;   // tiles [first, last)
+        int               last = 0;
+        int               copies = 0;  // handed out and neither back nor lost
+        bool              done = false;
+        Clock::time_point issued = {}; // when the oldest copy out was handed out
+    };
+
+    struct Connection {
+        Socket socket;
+        int    index;
+        bool   busy = true; // talking to the worker rather than waiting for a range
+        int    ranges = 0;
+    };
+
+    void serve(Connection& connection);
+    // The next range for a worker, or -1 once the frame is done.
+    int next(Connection& connection);
+    int straggler(Clock::time_point now) const;
+    void accept(Connection& connection, int range, const std::string& payload);
+    void lose(Connection& connection, int range, const std::string& reason);
+
+private:
+    const DistributedSettings& m_distributed;
+    IFramebuffer*              m_framebuffer;
+    const RenderSettings&      m_settings;
+    std::string                m_job;
+    std::vector<Tile>          m_tiles;
+
+    std::mutex              m_mutex;
+    std::condition_variable m_changed;
+    std::vector<Range>      m_ranges;
+    std::deque<int>         m_pending;   // ranges not out with any worker
+    std::vector<double>     m_durations; // seconds of the ranges done so far
+    int                     m_remaining;
+    bool                    m_finished = false;
+    DistributedStats        m_stats;
+};
+
+Coordinator::Coordinator(const DistributedSettings& distributed, IFramebuffer* framebuffer,
+                         const RenderSettings& settings, std::string job)
+    : m_distributed(distributed), m_framebuffer(framebuffer), m_settings(settings), m_job(std::move(job)) {
+    m_tiles = MakeTiles(framebuffer->width(), framebuffer->height(), settings.tileSize);
+    int size = std::max(1, distributed.tilesPerRange);
+    for (int first = 0; first < static_cast<int>(m_tiles.size()); first += size) {
+        m_pending.push_back(static_cast<int>(m_ranges.size()));
+        m_ranges.push_back({first, std::min(first + size, static_cast<int>(m_tiles.size()))});
+    }
+    m_remaining = static_cast<int>(m_ranges.size());
+}
+
+DistributedStats Coordinator::run(const Socket& listener) {
+    std::list<Connection> connections;
+    std::vector<std::thread> threads;
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_remaining == 0 || (m_settings.cancel && m_settings.cancel->load(std::memory_order_relaxed)))
+                break;
+        }
+        Socket socket = listener.accept(10);
+        if (!socket)
+            continue;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        connections.push_back({std::move(socket), static_cast<int>(connections.size())});
+        threads.emplace_back(&Coordinator::serve, this, std::ref(connections.back()));
+    }
+
+    {
+        // Workers still rendering a copy of a range that is done are cut off.
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_finished = true;
+        for (Connection& connection : connections)
+            if (connection.busy)
+                connection.socket.shutdown();
+    }
+    m_changed.notify_all();
+    for (std::thread& thread : threads)
+        thread.join();
+
+    m_stats.workers = static_cast<int>(connections.size());
+    m_stats.ranges = static_cast<int>(m_ranges.size());
+    m_stats.tilesPerRange = std::max(1, m_distributed.tilesPerRange);
+    return m_stats;
+}
+
+void Coordinator::serve(Connection& connection) {
+    int range = -1;
+    try {
+        connection.socket.setTimeout(m_distributed.timeoutMs);
+        SendMessage(connection.socket, Message::Job, m_job);
+        while ((range = next(connection)) >= 0) {
+            std::string request;
+            ByteWriter writer(request);
+            writer.value<int32_t>(range);
+            writer.value<int32_t>(m_ranges[range].first);
+            writer.value<int32_t>(m_ranges[range].last);
+            SendMessage(connection.socket, Message::Range, request);
+
+            Message type;
+            std::string result;
+            if (!ReceiveMessage(connection.socket, type, result))
+                throw std::runtime_error("connection closed");
+            if (type != Message::Result)
+                throw std::runtime_error("unexpected message");
+            accept(connection, range, result);
+            range = -1;
+        }
+        SendMessage(connection.socket, Message::Done);
+    } catch (const std::exception& error) {
+        lose(connection, range, error.what());
+    }
+}
+
+int Coordinator::next(Connection& connection) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    connection.busy = false;
+    while (m_remaining > 0 && !m_finished) {
+        Clock::time_point now = Clock::now();
+        int range = -1;
+        if (!m_pending.empty()) {
+            range = m_pending.front();
+            m_pending.pop_front();
+            m_ranges[range].issued = now;
+        } else if ((range = straggler(now)) >= 0) {
+            m_stats.backups++;
+        }
+        if (range >= 0) {
+            m_ranges[range].copies++;
+            connection.busy = true;
+            return range;
+        }
+        m_changed.wait_for(lock, std::chrono::milliseconds(10));
+    }
+    return -1;
+}
+
+// The range out the longest, if it has been out for straggler times the
+// median and nobody else is on it yet.
+int Coordinator::straggler(Clock::time_point now) const {
+    if (m_durations.empty())
+        return -1;
+    std::vector<double> durations = m_durations;
+    std::nth_element(durations.begin(), durations.begin() + durations.size() / 2, durations.end());
+    double threshold = m_distributed.straggler * durations[durations.size() / 2];
+
+    int oldest = -1;
+    for (int i = 0; i < static_cast<int>(m_ranges.size()); i++) {
+        const Range& range = m_ranges[i];
+        if (range.done || range.copies != 1 || std::chrono::duration<double>(now - range.issued).count() < threshold)
+            continue;
+        if (oldest < 0 || range.issued < m_ranges[oldest].issued)
+            oldest = i;
+    }
+    return oldest;
+}
+
+void Coordinator::accept(Connection& connection, int index, const std::string& payload) {
+    ByteReader reader(payload);
+    if (reader.value<int32_t>() != index)
+        throw std::runtime_error("result for another range");
+    RenderStats stats = reader.value<RenderStats>();
+    std::vector<float> rgb = reader.array<float>();
+    Range& range = m_ranges[index];
+    if (rgb.size() != RangeFloats(m_tiles, range.first, range.last))
+        throw std::runtime_error("result of the wrong size");
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        connection.busy = false;
+        range.copies--;
+        if (range.done) {
+            m_stats.wasted++;
+            return;
+        }
+        range.done = true;
+        m_durations.push_back(std::chrono::duration<double>(Clock::now() - range.issued).count());
+        m_stats.render += stats;
+        connection.ranges++;
+    }
+
+    // Only the first copy back gets here, so tiles are written once.
+    const float* pixels = rgb.data();
+    for (int i = range.first; i < range.last; i++) {
+        const Tile& tile = m_tiles[i];
+        m_framebuffer->writeTile(tile, pixels);
+        pixels += static_cast<size_t>(tile.x1 - tile.x0) * (tile.y1 - tile.y0) * 3;
+        if (m_settings.onTile)
+            m_settings.onTile(tile);
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_remaining--;
+    m_changed.notify_all();
+}
+
+void Coordinator::lose(Connection& connection, int index, const std::string& reason) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    connection.busy = false;
+    if (m_finished)
+        return;
+    m_stats.dropped.push_back({connection.index, connection.ranges, reason});
+    if (index >= 0) {
+        Range& range = m_ranges[index];
+        range.copies--;
+        if (!range.done && range.copies == 0) {
+            m_pending.push_front(index);
+            m_stats.lost++;
+        }
+    }
+    m_changed.notify_all();
+}
+
+} // namespace
+
+// Workers that were told the frame is done have exited or are about to;
+// the others may still be waiting to connect.
+static void StopProcesses(const std::vector<int>& processes) {
+    for (int process : processes)
+        kill(process, SIGTERM);
+    for (int process : processes) {
+        int status;
+        waitpid(process, &status, 0);
+    }
+}
+
+static std::vector<int> SpawnWorkers(const DistributedSettings& distributed) {
+    const std::string& program = distributed.program;
+    std::vector<std::string> arguments = {program, "--worker", distributed.address, "--threads",
+                                          std::to_string(distributed.spawnThreads)};
+    std::vector<char*> argv;
+    for (std::string& argument : arguments)
+        argv.push_back(argument.data());
+    argv.push_back(nullptr);
+
+    std::vector<int> processes;
+    for (int i = 0; i < distributed.spawn; i++) {
+        pid_t process;
+        int error = posix_spawnp(&process, program.c_str(), nullptr, nullptr, argv.data(), environ);
+        if (error != 0) {
+            StopProcesses(processes);
+            throw std::runtime_error("Cannot start " + program + ": " + std::strerror(error));
+        }
+        processes.push_back(process);
+    }
+    return processes;
+}
+
+DistributedStats RenderDistributed(const DistributedSettings& distributed, IFramebuffer* framebuffer,
+                              const Camera& camera, const Scene& scene, const RenderSettings& settings) {
+    JobSettings job = {};
+    job.width = framebuffer->width();
+    job.height = framebuffer->height();
+    job.camera = camera;
+    job.depth = settings.depth;
+    job.tileSize = settings.tileSize;
+    job.minContribution = settings.minContribution;
+    job.packets = settings.packets;
+    job.shadows = settings.shadows;
+
+    std::string serialized = SerializeScene(scene);
+    std::string payload;
+    ByteWriter writer(payload);
+    writer.value(job);
+    writer.array(std::span<const char>(serialized));
+
+    Socket listener = Socket::listen(distributed.address);
+    if (distributed.onListening)
+        distributed.onListening(payload.size());
+    std::vector<int> processes = SpawnWorkers(distributed);
+    Coordinator coordinator(distributed, framebuffer, settings, std::move(payload));
+    DistributedStats stats;
+    try {
+        stats = coordinator.run(listener);
+    } catch (...) {
+        StopProcesses(processes);
+        throw;
+    }
+    StopProcesses(processes);
+    return stats;
+}
+
+int RunWorker(const std::string& address, TileScheduler& scheduler) {
+    Socket socket = Socket::connect(address, CONNECT_RETRY_SECONDS);
+    Message type;
+    std::string payload;
+    if (!ReceiveMessage(socket, type, payload) || type == Message::Done)
+        return 0;
+    if (type != Message::Job)
+        throw std::runtime_error("Expected a job from " + address);
+
+    ByteReader reader(payload);
+    JobSettings job = reader.value<JobSettings>();
+    if (job.width < 2 || job.height < 2 || job.tileSize < 1)
+        throw std::runtime_error("Invalid job from " + address);
+    std::vector<char> serialized = reader.array<char>();
+    Scene scene;
+    DeserializeScene(std::string_view(serialized.data(), serialized.size()), scene);
+    scene.commit(Scene::Rebuild::Immediate);
+
+    RenderSettings settings;
+    settings.depth = job.depth;
+    settings.tileSize = job.tileSize;
+    settings.minContribution = job.minContribution;
+    settings.packets = job.packets != 0;
+    settings.shadows = job.shadows != 0;
+    Framebuffer framebuffer(job.width, job.height);
+    std::vector<Tile> tiles = MakeTiles(job.width, job.height, job.tileSize);
+
+    int ranges = 0;
+    std::vector<float> rgb;
+    while (ReceiveMessage(socket, type, payload) && type == Message::Range) {
+        ByteReader request(payload);
+        int32_t index = request.value<int32_t>();
+        settings.firstTile = request.value<int32_t>();
+        settings.lastTile = request.value<int32_t>();
+        if (settings.firstTile < 0 || settings.firstTile > settings.lastTile ||
+            settings.lastTile > static_cast<int>(tiles.size()))
+            throw std::runtime_error("Invalid tile range");
+        RenderStats stats = Render(scheduler, &framebuffer, job.camera, scene, settings);
+
+        rgb.clear();
+        for (int i = settings.firstTile; i < settings.lastTile; i++) {
+            const Tile& tile = tiles[i];
+            for (int y = tile.y0; y < tile.y1; y++) {
+                const float* row = framebuffer.pixels() + (static_cast<size_t>(y) * job.width + tile.x0) * 3;
+                rgb.insert(rgb.end(), row, row + (tile.x1 - tile.x0) * 3);
+            }
+        }
+        std::string result;
+        ByteWriter writer(result);
+        writer.value(index);
+        writer.value(stats);
+        writer.array(std::span<const float>(rgb));
+        SendMessage(socket, Message::Result, result);
+        ranges++;
+    }
+    return ranges;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+#include "renderer.h"
+#include "scene.h"
+
+class TileScheduler;
+
+// Renders one frame on worker processes, on this machine or on others. The
+// coordinator listens at an address (see Socket), sends every worker that
+// connects the scene, camera and settings once and then hands out ranges of
+// tiles; tiles are in Morton order, so a range covers a compact area. The
+// returned pixels go into the framebuffer as they arrive.
+//
+// A worker that disconnects, fails or stays silent for timeoutMs loses its
+// range to the others. Once nothing is left to hand out, idle workers take a
+// second copy of a range that has been out for straggler times the median
+// range time; the first copy back wins. Workers may join at any time.
+//
+// Local workers can be started once the coordinator listens: spawn copies of
+// program run with --worker ADDRESS --threads spawnThreads. Those still
+// running when the frame is done are stopped.
+struct DistributedSettings {
+    std::string address;
+    int         tilesPerRange = 16;
+    float       straggler = 3.0f;
+    int         timeoutMs = 30000;
+    int         spawn = 0;
+    std::string program;
+    int         spawnThreads = 0;
+    // Called once the coordinator listens, with the bytes of scene and
+    // settings every worker is sent.
+    std::function<void(size_t sceneBytes)> onListening;
+};
+
+struct DroppedWorker {
+    int         index;  // in the order workers connected
+    int         ranges; // rendered before the drop
+    std::string reason;
+};
+
+// How the frame was shared out. render is the statistics of the ranges that
+// were used, not of lost or duplicate ones.
+struct DistributedStats {
+    RenderStats                render;
+    int                        workers = 0;
+    int                        ranges = 0;
+    int                        tilesPerRange = 0;
+    int                        lost = 0;    // handed out again after their worker was dropped
+    int                        backups = 0; // second copies of straggling ranges
+    int                        wasted = 0;  // copies that came back after the first
+    std::vector<DroppedWorker> dropped;
+};
+
+// Settings other than the tile range are the same as for Render(), except
+// that adaptive anti-aliasing is not available.
+DistributedStats RenderDistributed(const DistributedSettings& distributed, IFramebuffer* framebuffer,
+                              const Camera& camera, const Scene& scene, const RenderSettings& settings);
+
+// Connects to the coordinator at address, retrying for a few seconds, and
+// renders the ranges it hands out with scheduler until the frame is done or
+// the coordinator goes away. Returns the number of ranges rendered.
+int RunWorker(const std::string& address, TileScheduler& scheduler);
@@ -0,0 +1,154 @@
+#include "pch.h"
+#include "framebuffer.h"
+#include "dispatch.h"
+#include "packet.h"
+#include "scheduler.h"
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include <stb_image_write.h>
+
+Framebuffer::Framebuffer(int width, int height)
+    : m_width(width), m_height(height), m_pixels((width * height * 3 + 15) / 16), m_buffer(width * height * 3) {}
+
+void Framebuffer::clear() {
+    std::fill(m_pixels.begin(), m_pixels.end(), Block{});
+    std::fill(m_buffer.begin(), m_buffer.end(), 0);
+}
+
+void Framebuffer::setPixel(int x, int y, const Vec3& color) {
+    assert(x >= 0 && x < m_width);
+    assert(y >= 0 && y < m_height);
+    float* pixel = pixelData() + (y * m_width + x) * 3;
+    pixel[0] = color.x;
+    pixel[1] = color.y;
+    pixel[2] = color.z;
+}
+
+void Framebuffer::writeTile(const Tile& tile, const float* rgb) {
+    assert(0 <= tile.x0 && tile.x0 <= tile.x1 && tile.x1 <= m_width);
+    assert(0 <= tile.y0 && tile.y0 <= tile.y1 && tile.y1 <= m_height);
+    int row = (tile.x1 - tile.x0) * 3;
+    for (int y = tile.y0; y < tile.y1; y++, rgb += row)
+        std::copy_n(rgb, row, pixelData() + (y * m_width + tile.x0) * 3);
+}
+
+void Framebuffer::resolve(float exposure, float gamma) {
+    resolve(m_buffer.data(), exposure, gamma);
+}
+
+#ifdef RAYTRACING_SSE
+
+// x ^ power for x in [0, 1] as exp2(power * log2(x)), both evaluated with
+// fifth-degree polynomials. The relative error stays around 1e-6, far below
+// one step of the 8-bit output.
+static __m128 Pow(__m128 x, __m128 power) {
+    const __m128 one = _mm_set1_ps(1.0f);
+    __m128i bits = _mm_castps_si128(x);
+    __m128 exponent = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(127)));
+    __m128 mantissa = _mm_or_ps(_mm_castsi128_ps(_mm_and_si128(bits, _mm_set1_epi32(0x007fffff))), one);
+    __m128 p = _mm_set1_ps(-3.4436006e-2f);
+    p = _mm_add_ps(_mm_mul_ps(p, mantissa), _mm_set1_ps(3.1821337e-1f));
+    p = _mm_add_ps(_mm_mul_ps(p, mantissa), _mm_set1_ps(-1.2315303f));
+    p = _mm_add_ps(_mm_mul_ps(p, mantissa), _mm_set1_ps(2.5988452f));
+    p = _mm_add_ps(_mm_mul_ps(p, mantissa), _mm_set1_ps(-3.3241990f));
+    p = _mm_add_ps(_mm_mul_ps(p, mantissa), _mm_set1_ps(3.1157899f));
+    __m128 log2 = _mm_add_ps(_mm_mul_ps(p, _mm_sub_ps(mantissa, one)), exponent);
+
+    // y <= 0 here, so floor is the truncation minus one where that rounded up.
+    __m128 y = _mm_max_ps(_mm_mul_ps(log2, power), _mm_set1_ps(-126.0f));
+    __m128 whole = _mm_cvtepi32_ps(_mm_cvttps_epi32(y));
+    whole = _mm_sub_ps(whole, _mm_and_ps(_mm_cmpgt_ps(whole, y), one));
+    __m128 fraction = _mm_sub_ps(y, whole);
+    __m128 q = _mm_set1_ps(1.8775767e-3f);
+    q = _mm_add_ps(_mm_mul_ps(q, fraction), _mm_set1_ps(8.9893397e-3f));
+    q = _mm_add_ps(_mm_mul_ps(q, fraction), _mm_set1_ps(5.5826318e-2f));
+    q = _mm_add_ps(_mm_mul_ps(q, fraction), _mm_set1_ps(2.4015361e-1f));
+    q = _mm_add_ps(_mm_mul_ps(q, fraction), _mm_set1_ps(6.9315308e-1f));
+    q = _mm_add_ps(_mm_mul_ps(q, fraction), _mm_set1_ps(9.9999994e-1f));
+    __m128i scale = _mm_slli_epi32(_mm_add_epi32(_mm_cvttps_epi32(whole), _mm_set1_epi32(127)), 23);
+    return _mm_mul_ps(q, _mm_castsi128_ps(scale));
+}
+
+// Sixteen channel values per step: scale and clamp, optional gamma, then
+// truncate to integers and saturate-pack them into sixteen bytes.
+static void Resolve(const float* values, size_t count, uint8_t* output, float exposure, float gamma) {
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 scale = _mm_set1_ps(exposure);
+    const __m128 power = _mm_set1_ps(1.0f / gamma);
+    const __m128 maximum = _mm_set1_ps(255.0f);
+    bool linear = gamma == 1.0f;
+
+    for (size_t block = 0; block < (count + 15) / 16; block++) {
+        const float* chunk = values + block * 16;
+        __m128i lanes[4];
+        for (int i = 0; i < 4; i++) {
+            __m128 color = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_load_ps(chunk + i * 4), scale), zero), one);
+            if (!linear)
+                color = _mm_min_ps(Pow(color, power), one);
+            lanes[i] = _mm_cvttps_epi32(_mm_mul_ps(color, maximum));
+        }
+        __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(lanes[0], lanes[1]), _mm_packs_epi32(lanes[2], lanes[3]));
+
+        size_t offset = block * 16;
+        if (offset + 16 <= count) {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(output + offset), bytes);
+        } else {
+            alignas(16) uint8_t tail[16];
+            _mm_store_si128(reinterpret_cast<__m128i*>(tail), bytes);
+            std::copy_n(tail, count - offset, output + offset);
+        }
+    }
+}
+
+#else
+
+static void Resolve(const float* values, size_t count, uint8_t* output, float exposure, float gamma) {
+    for (size_t i = 0; i < count; i++) {
+        float color = std::min(1.0f, std::max(0.0f, values[i] * exposure));
+        if (gamma != 1.0f)
+            color = std::min(1.0f, std::pow(color, 1.0f / gamma));
+        output[i] = static_cast<uint8_t>(color * 255);
+    }
+}
+
+#endif
+
+void Framebuffer::resolve(uint8_t* output, float exposure, float gamma) const {
+    auto resolve = ActiveKernels().resolve;
+    (resolve ? resolve : Resolve)(pixels(), m_buffer.size(), output, exposure, gamma);
+}
+
+void Framebuffer::copyRegion(const Framebuffer& source, int x0, int y0, int x1, int y1) {
+    assert(source.m_width == m_width && source.m_height == m_height);
+    assert(0 <= x0 && x0 <= x1 && x1 <= m_width);
+    assert(0 <= y0 && y0 <= y1 && y1 <= m_height);
+    for (int y = y0; y < y1; y++) {
+        int offset = (y * m_width + x0) * 3;
+        std::copy_n(source.pixels() + offset, (x1 - x0) * 3, pixelData() + offset);
+    }
+}
+
+void Framebuffer::save(const std::string& filename, float exposure, float gamma) const {
+    std::vector<uint8_t> buffer(m_buffer.size());
+    resolve(buffer.data(), exposure, gamma);
+
+    int stride = m_width * 3;
+    const uint8_t* lastRow = buffer.data() + (m_height - 1) * stride;
+
+    bool png = filename.size() >= 4 && filename.compare(filename.size() - 4, 4, ".png") == 0;
+    if (png) {
+        if (!stbi_write_png(filename.c_str(), m_width, m_height, 3, lastRow, -stride))
+            throw std::runtime_error("Cannot write " + filename);
+        return;
+    }
+
+    std::ofstream out(filename, std::ios::binary);
+    if (!out.is_open())
+        throw std::runtime_error("Cannot write " + filename);
+    out << "P6\n" << m_width << " " << m_height << "\n255\n";
+    for (int y = m_height - 1; y >= 0; y--)
+        out.write(reinterpret_cast<const char*>(buffer.data() + y * stride), stride);
+    if (!out)
+        throw std::runtime_error("Cannot write " + filename);
+}
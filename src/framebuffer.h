@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "renderer.h"
+
+// Linear float RGB image with an RGB8 copy for display. Tiles are written as
+// floats, so colors above 1 survive until resolve() applies exposure and
+// gamma and quantizes the whole image.
+class Framebuffer : public IFramebuffer {
+public:
+    Framebuffer(int width, int height);
+    int width()  const override { return m_width; }
+    int height() const override { return m_height; }
+    void clear() override;
+    void setPixel(int x, int y, const Vec3& color) override;
+    void writeTile(const Tile& tile, const float* rgb) override;
+
+    // Converts to RGB8 as min(1, exposure * color) ^ (1 / gamma), with the
+    // channel values truncated to 0..255.
+    void resolve(float exposure = 1.0f, float gamma = 1.0f);
+    // RGB8 pixels as of the last resolve().
+    const uint8_t* data() const { return m_buffer.data(); }
+    const float* pixels() const { return m_pixels.data()->values; }
+
+    // Copies the pixels of [x0, x1) x [y0, y1) from a framebuffer of the same size.
+    void copyRegion(const Framebuffer& source, int x0, int y0, int x1, int y1);
+
+    // Resolves the image as resolve() does and writes it as binary PPM, or as
+    // PNG when the name ends in ".png". Row 0 is the bottom of the image, as
+    // glDrawPixels expects it.
+    void save(const std::string& filename, float exposure = 1.0f, float gamma = 1.0f) const;
+
+private:
+    // Cache-line aligned storage so that the resolve loop only issues aligned loads.
+    struct alignas(64) Block {
+        float values[16];
+    };
+
+    float* pixelData() { return m_pixels.data()->values; }
+    void resolve(uint8_t* output, float exposure, float gamma) const;
+
+private:
+    int m_width;
+    int m_height;
+    std::vector<Block>   m_pixels; // three floats per pixel, padded to whole blocks
+    std::vector<uint8_t> m_buffer;
+};
@@ -73,32 +73,158 @@ Vec3 Transform::apply(const Vec3& vector) const {
     return result / w;
 }
 
-AABB::AABB(const std::vector<Vec3>& vertices) {
-    float minX = std::numeric_limits<float>::max();
-    float minY = std::numeric_limits<float>::max();
-    float minZ = std::numeric_limits<float>::max();
-    float maxX = std::numeric_limits<float>::min();
-    float maxY = std::numeric_limits<float>::min();
-    float maxZ = std::numeric_limits<float>::min();
-    for (const auto& vertex : vertices) {
-        minX = std::min(minX, vertex.x);
-        minY = std::min(minY, vertex.y);
-        minZ = std::min(minZ, vertex.z);
-        maxX = std::max(maxX, vertex.x);
-        maxY = std::max(maxY, vertex.y);
-        maxZ = std::max(maxZ, vertex.z);
+Vec3 Transform::applyPoint(const Vec3& point) const {
+    return applyVector(point) + Vec3(matrix[0][3], matrix[1][3], matrix[2][3]);
+}
+
+Vec3 Transform::applyVector(const Vec3& vector) const {
+    Vec3 result;
+    result.x = matrix[0][0] * vector.x + matrix[0][1] * vector.y + matrix[0][2] * vector.z;
+    result.y = matrix[1][0] * vector.x + matrix[1][1] * vector.y + matrix[1][2] * vector.z;
+    result.z = matrix[2][0] * vector.x + matrix[2][1] * vector.y + matrix[2][2] * vector.z;
+    return result;
+}
+
+Transform Transform::operator*(const Transform& other) const {
+    Transform product;
+    for (int row = 0; row < 4; row++)
+        for (int column = 0; column < 4; column++) {
+            float sum = 0.0f;
+            for (int i = 0; i < 4; i++)
+                sum += matrix[row][i] * other.matrix[i][column];
+            product.matrix[row][column] = sum;
+        }
+    return product;
+}
+
+// Cofactors of the linear part divided by its determinant; the translation
+// is then undone by the inverted linear part.
+Transform Transform::inverse() const {
+    const auto& m = matrix;
+    float c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+    float c01 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+    float c02 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+    float det = m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02;
+    assert(det < 0 || det > 0);
+    float inv = 1.0f / det;
+
+    Transform result = identity();
+    auto& r = result.matrix;
+    r[0][0] = c00 * inv;
+    r[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv;
+    r[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv;
+    r[1][0] = c01 * inv;
+    r[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv;
+    r[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv;
+    r[2][0] = c02 * inv;
+    r[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv;
+    r[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv;
+    Vec3 translation = result.applyVector(Vec3(m[0][3], m[1][3], m[2][3]));
+    r[0][3] = -translation.x;
+    r[1][3] = -translation.y;
+    r[2][3] = -translation.z;
+    return result;
+}
+
+Transform Transform::normalMatrix() const {
+    Transform linear = inverse();
+    Transform result = identity();
+    for (int row = 0; row < 3; row++)
+        for (int column = 0; column < 3; column++)
+            result.matrix[row][column] = linear.matrix[column][row];
+    return result;
+}
+
+void InstanceTransform::place(const Vec3& position, const Vec3& rotation, float scale, const Vec3& pivot) {
+    m_identity = position.x == pivot.x && position.y == pivot.y && position.z == pivot.z &&
+                 rotation.x == 0.0f && rotation.y == 0.0f && rotation.z == 0.0f && scale == 1.0f;
+    if (m_identity) {
+        m_toWorld = m_toObject = m_normal = Transform::identity();
+        return;
     }
-    m_min = Vec3(minX, minY, minZ);
-    m_max = Vec3(maxX, maxY, maxZ);
+
+    // A zero scale would collapse the shape and leave nothing to invert.
+    constexpr float MIN_SCALE = 1e-4f;
+    if (std::abs(scale) < MIN_SCALE)
+        scale = scale < 0.0f ? -MIN_SCALE : MIN_SCALE;
+    Vec3 origin;
+    m_toWorld = Transform::translate(position.x, position.y, position.z) *
+                Transform::rotateZ(rotation.z, origin) * Transform::rotateY(rotation.y, origin) *
+                Transform::rotateX(rotation.x, origin) * Transform::scale(origin, scale, scale, scale) *
+                Transform::translate(-pivot.x, -pivot.y, -pivot.z);
+    m_toObject = m_toWorld.inverse();
+    m_normal = m_toWorld.normalMatrix();
+}
+
+Ray InstanceTransform::rayToObject(const Ray& ray) const {
+    if (m_identity)
+        return ray;
+    return {m_toObject.applyPoint(ray.origin), m_toObject.applyVector(ray.direction)};
+}
+
+Vec3 InstanceTransform::normalToWorld(const Vec3& normal) const {
+    if (m_identity)
+        return normal;
+    return Normalize(m_normal.applyVector(normal));
+}
+
+AABB InstanceTransform::boundsToWorld(const AABB& bounds) const {
+    if (m_identity)
+        return bounds;
+    AABB result = AABB::empty();
+    for (int corner = 0; corner < 8; corner++) {
+        Vec3 point((corner & 1 ? bounds.max() : bounds.min()).x,
+                   (corner & 2 ? bounds.max() : bounds.min()).y,
+                   (corner & 4 ? bounds.max() : bounds.min()).z);
+        result.extend(m_toWorld.applyPoint(point));
+    }
+    return result;
+}
+
+AABB::AABB(const std::vector<Vec3>& vertices) : AABB(empty()) {
+    for (const auto& vertex : vertices)
+        extend(vertex);
+}
+
+AABB AABB::empty() {
+    float inf = std::numeric_limits<float>::max();
+    return {Vec3(inf), Vec3(-inf)};
 }
 
 bool AABB::hit(const Ray& ray) const {
+    Vec3 invDirection(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+    float tEntry;
+    return hit(ray, invDirection, std::numeric_limits<float>::max(), tEntry);
+}
+
+
+bool AABB::hit(const Ray& ray, const Vec3& invDirection, float tMax, float& tEntry) const {
+    float tMin = 0.0f;
     for (int axis = 0; axis < 3; axis++) {
-        float invD = 1.0f / ray.direction[axis];
-        float t0 = (m_min[axis] - ray.origin[axis]) * invD;
-        float t1 = (m_max[axis] - ray.origin[axis]) * invD;
-        if (invD < 0.0f) std::swap(t0, t1);
-        if (t1 <= t0) return false;
+        float t0 = (m_min[axis] - ray.origin[axis]) * invDirection[axis];
+        float t1 = (m_max[axis] - ray.origin[axis]) * invDirection[axis];
+        if (invDirection[axis] < 0.0f) std::swap(t0, t1);
+        // Written so that a NaN slab (origin on the plane of a flat box) is ignored.
+        tMin = t0 > tMin ? t0 : tMin;
+        tMax = t1 < tMax ? t1 : tMax;
+        if (tMax < tMin) return false;
     }
+    tEntry = tMin;
     return true;
 }
+
+void AABB::extend(const Vec3& point) {
+    m_min = Vec3(std::min(m_min.x, point.x), std::min(m_min.y, point.y), std::min(m_min.z, point.z));
+    m_max = Vec3(std::max(m_max.x, point.x), std::max(m_max.y, point.y), std::max(m_max.z, point.z));
+}
+
+void AABB::extend(const AABB& other) {
+    m_min = Vec3(std::min(m_min.x, other.m_min.x), std::min(m_min.y, other.m_min.y), std::min(m_min.z, other.m_min.z));
+    m_max = Vec3(std::max(m_max.x, other.m_max.x), std::max(m_max.y, other.m_max.y), std::max(m_max.z, other.m_max.z));
+}
+
+float AABB::area() const {
+    Vec3 extent = m_max - m_min;
+    if (extent.x < 0.0f || extent.y < 0.0f || extent.z < 0.0f) return 0.0f;
+    return 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+}
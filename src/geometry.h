@@ -3,6 +3,7 @@
 #include <cmath>
 #include <cassert>
 #include <array>
+#include <optional>
 #include <vector>
 
 constexpr float EPSILON = 1e-6;
@@ -151,12 +152,14 @@ inline Vec3 Reflect(const Vec3& incidence, const Vec3& normal) noexcept {
     return incidence - 2.f * normal * Dot(incidence, normal);
 }
 
-inline Vec3 Refract(const Vec3& I, const Vec3& N, const float eta_t, const float eta_i=1.f) {
+// nullopt on total internal reflection.
+inline std::optional<Vec3> Refract(const Vec3& I, const Vec3& N, const float eta_t, const float eta_i=1.f) {
     float cosi = - std::max(-1.f, std::min(1.f, Dot(I,N)));
     if (cosi<0) return Refract(I, -N, eta_i, eta_t);
     float eta = eta_i / eta_t;
     float k = 1 - eta*eta*(1 - cosi*cosi);
-    return k<0 ? Vec3(1,0,0) : I*eta + N*(eta*cosi - std::sqrt(k));
+    if (k<0) return std::nullopt;
+    return I*eta + N*(eta*cosi - std::sqrt(k));
 }
 
 class Transform {
@@ -175,6 +178,17 @@ public:
               float a30, float a31, float a32, float a33);
     Vec3 apply(const Vec3& vector) const;
 
+    // The affine helpers below ignore the bottom row, which is (0, 0, 0, 1)
+    // for everything built from translations, rotations and scales.
+    Vec3 applyPoint(const Vec3& point) const;
+    Vec3 applyVector(const Vec3& vector) const;
+    // this after other, so that (A * B).apply(v) == A.apply(B.apply(v)).
+    Transform operator*(const Transform& other) const;
+    Transform inverse() const;
+    // Inverse transpose of the linear part, for transforming normals.
+    Transform normalMatrix() const;
+    float operator()(int row, int column) const { return matrix[row][column]; }
+
 private:
     std::array<std::array<float,4>,4> matrix;
 };
@@ -197,8 +211,14 @@ public:
     AABB(const Vec3& minimum, const Vec3& maximum)
         : m_min(minimum), m_max(maximum) {}
     explicit AABB(const std::vector<Vec3>& vertices);
+    static AABB empty();
 
     bool hit(const Ray& ray) const;
+    bool hit(const Ray& ray, const Vec3& invDirection, float tMax, float& tEntry) const;
+    void extend(const Vec3& point);
+    void extend(const AABB& other);
+    float area() const;
+    Vec3 center() const { return (m_min + m_max) / 2.0f; }
     Vec3 min() const { return m_min; }
     Vec3 max() const { return m_max; }
 
@@ -206,3 +226,32 @@ private:
     Vec3 m_min;
     Vec3 m_max;
 };
+
+// Placement of one instance of a shape that is stored in its own object
+// space. Rays are brought into object space rather than the shape into the
+// world, so any number of instances share one mesh and its hierarchy. Ray
+// directions are not renormalized, which keeps hit distances equal in both
+// spaces.
+class InstanceTransform {
+public:
+    // World = translate(position) * rotateZ * rotateY * rotateX * scale,
+    // about pivot; rotation is in degrees. A position equal to the pivot,
+    // no rotation and a scale of 1 leave the shape where it is.
+    void place(const Vec3& position, const Vec3& rotation, float scale, const Vec3& pivot);
+
+    bool identity() const               { return m_identity; }
+    const Transform& toWorld() const    { return m_toWorld; }
+    const Transform& toObject() const   { return m_toObject; }
+
+    Ray  rayToObject(const Ray& ray) const;
+    Vec3 pointToObject(const Vec3& point) const { return m_identity ? point : m_toObject.applyPoint(point); }
+    Vec3 normalToWorld(const Vec3& normal) const;
+    // Box around the transformed corners of an object-space box.
+    AABB boundsToWorld(const AABB& bounds) const;
+
+private:
+    Transform m_toWorld = Transform::identity();
+    Transform m_toObject = Transform::identity();
+    Transform m_normal = Transform::identity();
+    bool      m_identity = true;
+};
@@ -0,0 +1,101 @@
+// AVX2 variants of the kernels in dispatch.h. This file is compiled with
+// AVX2 enabled even when the rest of the build is not, so it includes
+// nothing but wide.h and type definitions: an inline function of any other
+// header instantiated here could replace the baseline copy at link time and
+// crash processors without AVX2.
+
+#include <cstddef>
+#include <cstdint>
+#include "wide.h"
+
+// Same arithmetic, in the same order, as Scene::hitBlock.
+int HitSpheres8AVX2(const float* first, const float* second, const float* ray, float tMax, float* t) {
+    Vec3x8 center(Float8::load(first, second), Float8::load(first + 4, second + 4), Float8::load(first + 8, second + 8));
+    Float8 radius = Float8::load(first + 12, second + 12);
+    Vec3x8 direction(ray[3], ray[4], ray[5]);
+
+    Vec3x8 oc = Vec3x8(ray[0], ray[1], ray[2]) - center;
+    Float8 a(ray[3] * ray[3] + ray[4] * ray[4] + ray[5] * ray[5]);
+    Float8 h = Dot(oc, direction);
+    Float8 c = Dot(oc, oc) - radius * radius;
+
+    Float8 discriminant = h * h - a * c;
+    Mask8 valid = discriminant >= Float8(0.0f);
+    if (valid.none())
+        return 0;
+
+    Float8 root = (-h - Sqrt(Max(discriminant, Float8(0.0f)))) / a;
+    root.store(t);
+    return (valid & (root >= Float8(0.001f)) & (root < Float8(tMax))).bits();
+}
+
+// Same polynomials and operation order as Pow in framebuffer.cpp.
+static __m256 Pow(__m256 x, __m256 power) {
+    const __m256 one = _mm256_set1_ps(1.0f);
+    __m256i bits = _mm256_castps_si256(x);
+    __m256 exponent = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(127)));
+    __m256 mantissa = _mm256_or_ps(_mm256_castsi256_ps(_mm256_and_si256(bits, _mm256_set1_epi32(0x007fffff))), one);
+    __m256 p = _mm256_set1_ps(-3.4436006e-2f);
+    p = _mm256_add_ps(_mm256_mul_ps(p, mantissa), _mm256_set1_ps(3.1821337e-1f));
+    p = _mm256_add_ps(_mm256_mul_ps(p, mantissa), _mm256_set1_ps(-1.2315303f));
+    p = _mm256_add_ps(_mm256_mul_ps(p, mantissa), _mm256_set1_ps(2.5988452f));
+    p = _mm256_add_ps(_mm256_mul_ps(p, mantissa), _mm256_set1_ps(-3.3241990f));
+    p = _mm256_add_ps(_mm256_mul_ps(p, mantissa), _mm256_set1_ps(3.1157899f));
+    __m256 log2 = _mm256_add_ps(_mm256_mul_ps(p, _mm256_sub_ps(mantissa, one)), exponent);
+
+    __m256 y = _mm256_max_ps(_mm256_mul_ps(log2, power), _mm256_set1_ps(-126.0f));
+    __m256 whole = _mm256_cvtepi32_ps(_mm256_cvttps_epi32(y));
+    whole = _mm256_sub_ps(whole, _mm256_and_ps(_mm256_cmp_ps(whole, y, _CMP_GT_OQ), one));
+    __m256 fraction = _mm256_sub_ps(y, whole);
+    __m256 q = _mm256_set1_ps(1.8775767e-3f);
+    q = _mm256_add_ps(_mm256_mul_ps(q, fraction), _mm256_set1_ps(8.9893397e-3f));
+    q = _mm256_add_ps(_mm256_mul_ps(q, fraction), _mm256_set1_ps(5.5826318e-2f));
+    q = _mm256_add_ps(_mm256_mul_ps(q, fraction), _mm256_set1_ps(2.4015361e-1f));
+    q = _mm256_add_ps(_mm256_mul_ps(q, fraction), _mm256_set1_ps(6.9315308e-1f));
+    q = _mm256_add_ps(_mm256_mul_ps(q, fraction), _mm256_set1_ps(9.9999994e-1f));
+    __m256i scale = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvttps_epi32(whole), _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(q, _mm256_castsi256_ps(scale));
+}
+
+// Thirty-two channel values per step. The packs work within 128-bit halves,
+// so a final permute puts the four groups of eight bytes back in order.
+void ResolveAVX2(const float* values, size_t count, uint8_t* output, float exposure, float gamma) {
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 scale = _mm256_set1_ps(exposure);
+    const __m256 power = _mm256_set1_ps(1.0f / gamma);
+    const __m256 maximum = _mm256_set1_ps(255.0f);
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    bool linear = gamma == 1.0f;
+
+    size_t padded = (count + 15) / 16 * 16;
+    alignas(64) float last[32];
+    for (size_t offset = 0; offset < padded; offset += 32) {
+        const float* chunk = values + offset;
+        if (offset + 32 > padded) {
+            // A single block of sixteen is left.
+            for (int i = 0; i < 32; i++)
+                last[i] = i < 16 ? chunk[i] : 0.0f;
+            chunk = last;
+        }
+
+        __m256i lanes[4];
+        for (int i = 0; i < 4; i++) {
+            __m256 color = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_load_ps(chunk + i * 8), scale), zero), one);
+            if (!linear)
+                color = _mm256_min_ps(Pow(color, power), one);
+            lanes[i] = _mm256_cvttps_epi32(_mm256_mul_ps(color, maximum));
+        }
+        __m256i bytes = _mm256_packus_epi16(_mm256_packs_epi32(lanes[0], lanes[1]), _mm256_packs_epi32(lanes[2], lanes[3]));
+        bytes = _mm256_permutevar8x32_epi32(bytes, order);
+
+        if (offset + 32 <= count) {
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(output + offset), bytes);
+        } else {
+            alignas(32) uint8_t tail[32];
+            _mm256_store_si256(reinterpret_cast<__m256i*>(tail), bytes);
+            for (size_t i = 0; offset + i < count; i++)
+                output[offset + i] = tail[i];
+        }
+    }
+}
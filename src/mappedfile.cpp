@@ -0,0 +1,103 @@
+#include "pch.h"
+#include "mappedfile.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const std::string& filename) {
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        throw std::runtime_error("Cannot open " + filename);
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size)) {
+        CloseHandle(file);
+        throw std::runtime_error("Cannot read size of " + filename);
+    }
+    m_size = static_cast<size_t>(size.QuadPart);
+    if (m_size > 0) {
+        m_mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (m_mapping)
+            m_data = static_cast<const char*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+    }
+    CloseHandle(file);
+    if (m_size > 0 && !m_data) {
+        close();
+        throw std::runtime_error("Cannot map " + filename);
+    }
+}
+
+void MappedFile::close() noexcept {
+    if (m_data)
+        UnmapViewOfFile(m_data);
+    if (m_mapping)
+        CloseHandle(m_mapping);
+    m_data = nullptr;
+    m_mapping = nullptr;
+    m_size = 0;
+}
+
+#else
+
+MappedFile::MappedFile(const std::string& filename) {
+    int file = ::open(filename.c_str(), O_RDONLY);
+    if (file < 0)
+        throw std::runtime_error("Cannot open " + filename);
+
+    struct stat status;
+    if (fstat(file, &status) != 0) {
+        ::close(file);
+        throw std::runtime_error("Cannot read size of " + filename);
+    }
+    m_size = static_cast<size_t>(status.st_size);
+    if (m_size > 0) {
+        void* data = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, file, 0);
+        if (data == MAP_FAILED) {
+            ::close(file);
+            m_size = 0;
+            throw std::runtime_error("Cannot map " + filename);
+        }
+        m_data = static_cast<const char*>(data);
+    }
+    ::close(file);
+}
+
+void MappedFile::close() noexcept {
+    if (m_data)
+        munmap(const_cast<char*>(m_data), m_size);
+    m_data = nullptr;
+    m_size = 0;
+}
+
+#endif
+
+MappedFile::MappedFile(MappedFile&& other) noexcept {
+    *this = std::move(other);
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept {
+    if (this != &other) {
+        close();
+        std::swap(m_data, other.m_data);
+        std::swap(m_size, other.m_size);
+#ifdef _WIN32
+        std::swap(m_mapping, other.m_mapping);
+#endif
+    }
+    return *this;
+}
+
+MappedFile::~MappedFile() noexcept {
+    close();
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// Read-only memory mapping of a whole file. Pages are shared with every other
+// process mapping the same file and are loaded on first access.
+class MappedFile {
+public:
+    MappedFile() = default;
+    explicit MappedFile(const std::string& filename);
+    MappedFile(MappedFile&& other) noexcept;
+    MappedFile& operator=(MappedFile&& other) noexcept;
+    MappedFile(const MappedFile& other) = delete;
+    MappedFile& operator=(const MappedFile& other) = delete;
+    ~MappedFile() noexcept;
+
+    const char* data() const { return m_data; }
+    size_t size() const      { return m_size; }
+    bool empty() const       { return m_size == 0; }
+
+private:
+    void close() noexcept;
+
+private:
+    const char* m_data = nullptr;
+    size_t      m_size = 0;
+#ifdef _WIN32
+    void*       m_mapping = nullptr;
+#endif
+};
@@ -0,0 +1,216 @@
+#include "pch.h"
+#include "meshcache.h"
+#include <filesystem>
+#include <random>
+
+constexpr char MESH_CACHE_MAGIC[8] = "ICEMESH";
+constexpr uint32_t MESH_CACHE_ENDIANNESS = 0x01020304;
+constexpr uint64_t MESH_CACHE_ALIGNMENT = 64;
+
+namespace {
+
+struct Section {
+    uint64_t offset;
+    uint64_t count;
+};
+
+// Everything is stored in the native layout of the writing machine; the
+// endianness marker and the struct sizes reject caches from other builds.
+struct Header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t endianness;
+    uint32_t vec3Size;
+    uint32_t nodeSize;
+    uint32_t blockSize;
+    uint32_t reserved;
+    uint64_t sourceHash;
+    uint64_t fileSize;
+    float    bounds[6];
+    int32_t  bvhNodes;
+    int32_t  bvhLeaves;
+    int32_t  bvhDepth;
+    int32_t  padding;
+    double   bvhBuildMs;
+    Section  vertices;
+    Section  faces;
+    Section  nodes;
+    Section  indices;
+    Section  blocks;
+    Section  leafBlocks;
+};
+
+static_assert(std::is_trivially_copyable_v<Vec3> && sizeof(Vec3) == 3 * sizeof(float));
+static_assert(std::is_trivially_copyable_v<BVHNode> && std::is_trivially_copyable_v<TriangleBlock>);
+
+} // namespace
+
+static uint64_t Align(uint64_t offset) {
+    return (offset + MESH_CACHE_ALIGNMENT - 1) / MESH_CACHE_ALIGNMENT * MESH_CACHE_ALIGNMENT;
+}
+
+std::string MeshCachePath(const std::string& filename) {
+    return filename + ".meshcache";
+}
+
+uint64_t HashBytes(const char* data, size_t size) {
+    // Four independent multiply-xorshift lanes keep the multiplier busy;
+    // hashing runs at several GB/s, far ahead of parsing.
+    constexpr uint64_t PRIME = 0x9e3779b97f4a7c15ull;
+    uint64_t lanes[4] = {size, PRIME, ~size, ~PRIME};
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        for (int lane = 0; lane < 4; lane++) {
+            uint64_t word;
+            std::memcpy(&word, data + i + lane * 8, 8);
+            lanes[lane] = (lanes[lane] ^ word) * PRIME;
+            lanes[lane] ^= lanes[lane] >> 32;
+        }
+    }
+
+    uint64_t hash = lanes[0];
+    for (int lane = 1; lane < 4; lane++)
+        hash = ((hash ^ lanes[lane]) * PRIME) ^ (hash >> 29);
+    for (; i < size; i += 8) {
+        uint64_t word = 0;
+        std::memcpy(&word, data + i, std::min<size_t>(8, size - i));
+        hash = (hash ^ word) * PRIME;
+        hash ^= hash >> 32;
+    }
+    return hash;
+}
+
+std::shared_ptr<Mesh> LoadMeshCache(const std::string& path, uint64_t sourceHash) {
+    std::error_code error;
+    if (!std::filesystem::is_regular_file(path, error))
+        return nullptr;
+
+    auto mesh = std::make_shared<Mesh>();
+    try {
+        mesh->file = MappedFile(path);
+    } catch (const std::exception&) {
+        return nullptr;
+    }
+    const MappedFile& file = mesh->file;
+    if (file.size() < sizeof(Header))
+        return nullptr;
+
+    Header header;
+    std::memcpy(&header, file.data(), sizeof(Header));
+    if (std::memcmp(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != MESH_CACHE_VERSION || header.endianness != MESH_CACHE_ENDIANNESS ||
+        header.vec3Size != sizeof(Vec3) || header.nodeSize != sizeof(BVHNode) ||
+        header.blockSize != sizeof(TriangleBlock) || header.sourceHash != sourceHash ||
+        header.fileSize != file.size())
+        return nullptr;
+
+    auto view = [&]<typename T>(const Section& section, std::span<const T>& span) {
+        if (section.offset % MESH_CACHE_ALIGNMENT != 0 || section.offset > file.size() ||
+            section.count > (file.size() - section.offset) / sizeof(T))
+            return false;
+        span = std::span<const T>(reinterpret_cast<const T*>(file.data() + section.offset), section.count);
+        return true;
+    };
+    std::span<const BVHNode> nodes;
+    std::span<const uint32_t> indices;
+    if (!view(header.vertices, mesh->vertices) || !view(header.faces, mesh->faces) ||
+        !view(header.nodes, nodes) || !view(header.indices, indices) ||
+        !view(header.blocks, mesh->blocks) || !view(header.leafBlocks, mesh->leafBlocks))
+        return nullptr;
+    if (mesh->faces.size() != indices.size() * 3 || mesh->leafBlocks.size() != nodes.size() ||
+        header.bvhNodes != static_cast<int32_t>(nodes.size()))
+        return nullptr;
+
+    BVHStats stats;
+    stats.nodes = header.bvhNodes;
+    stats.leaves = header.bvhLeaves;
+    stats.depth = header.bvhDepth;
+    stats.buildMs = header.bvhBuildMs;
+    // The mesh owns the mapping, so the BVH needs no owner of its own.
+    mesh->bvh = BVH::view(nodes, indices, stats, nullptr);
+    mesh->aabb = AABB(Vec3(header.bounds[0], header.bounds[1], header.bounds[2]),
+                      Vec3(header.bounds[3], header.bounds[4], header.bounds[5]));
+    // A damaged file of the right size still passes the header; one pass over
+    // the indices keeps it from sending traversal out of bounds. The cache
+    // always holds the packed blocks, whatever layout the model then uses.
+    mesh->layout = MeshLayout::Packed;
+    if (!mesh->valid())
+        return nullptr;
+    return mesh;
+}
+
+void SaveMeshCache(const std::string& path, uint64_t sourceHash, const Mesh& mesh) {
+    Header header = {};
+    std::memcpy(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic));
+    header.version = MESH_CACHE_VERSION;
+    header.endianness = MESH_CACHE_ENDIANNESS;
+    header.vec3Size = sizeof(Vec3);
+    header.nodeSize = sizeof(BVHNode);
+    header.blockSize = sizeof(TriangleBlock);
+    header.sourceHash = sourceHash;
+    for (int axis = 0; axis < 3; axis++) {
+        header.bounds[axis] = mesh.aabb.min()[axis];
+        header.bounds[3 + axis] = mesh.aabb.max()[axis];
+    }
+    const BVHStats& stats = mesh.bvh.stats();
+    header.bvhNodes = stats.nodes;
+    header.bvhLeaves = stats.leaves;
+    header.bvhDepth = stats.depth;
+    header.bvhBuildMs = stats.buildMs;
+
+    struct Data {
+        Section&    section;
+        const void* data;
+        size_t      bytes;
+    };
+    std::vector<Data> sections = {
+        {header.vertices, mesh.vertices.data(), mesh.vertices.size_bytes()},
+        {header.faces, mesh.faces.data(), mesh.faces.size_bytes()},
+        {header.nodes, mesh.bvh.nodes().data(), mesh.bvh.nodes().size_bytes()},
+        {header.indices, mesh.bvh.indices().data(), mesh.bvh.indices().size_bytes()},
+        {header.blocks, mesh.blocks.data(), mesh.blocks.size_bytes()},
+        {header.leafBlocks, mesh.leafBlocks.data(), mesh.leafBlocks.size_bytes()},
+    };
+    header.vertices.count = mesh.vertices.size();
+    header.faces.count = mesh.faces.size();
+    header.nodes.count = mesh.bvh.nodes().size();
+    header.indices.count = mesh.bvh.indices().size();
+    header.blocks.count = mesh.blocks.size();
+    header.leafBlocks.count = mesh.leafBlocks.size();
+    uint64_t offset = Align(sizeof(Header));
+    for (Data& data : sections) {
+        data.section.offset = offset;
+        offset = Align(offset + data.bytes);
+    }
+    header.fileSize = offset;
+
+    // A unique temporary name lets several processes build the same cache
+    // at once; whichever rename lands last wins with identical contents.
+    std::string temporary = path + ".tmp" + std::to_string(std::random_device()());
+    std::error_code error;
+    {
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        const char zeros[MESH_CACHE_ALIGNMENT] = {};
+        uint64_t position = sizeof(Header);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+        for (const Data& data : sections) {
+            out.write(zeros, data.section.offset - position);
+            out.write(static_cast<const char*>(data.data), data.bytes);
+            position = data.section.offset + data.bytes;
+        }
+        out.write(zeros, header.fileSize - position);
+        if (out.good())
+            out.close();
+        if (!out.good()) {
+            std::filesystem::remove(temporary, error);
+            std::cerr << "warning: cannot write mesh cache " << path << "\n";
+            return;
+        }
+    }
+
+    std::filesystem::rename(temporary, path, error);
+    if (error) {
+        std::filesystem::remove(temporary, error);
+        std::cerr << "warning: cannot write mesh cache " << path << "\n";
+    }
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include "model.h"
+
+// Binary mesh cache written next to a source OBJ file. It stores the
+// vertices, the triangles in leaf order, the bounds, the BVH and the packed
+// triangle blocks in one file whose sections are used in place after mapping
+// it, so there is no per-element deserialization and every renderer process
+// loading the model shares the same physical pages.
+//
+// The cache is keyed by a hash of the OBJ contents and by a format version
+// that has to be bumped whenever the layout of any stored struct, the BVH
+// builder or the block packing changes.
+constexpr uint32_t MESH_CACHE_VERSION = 1;
+
+std::string MeshCachePath(const std::string& filename);
+
+// 64-bit hash of a byte range, eight bytes at a time.
+uint64_t HashBytes(const char* data, size_t size);
+
+// Maps the cache and returns a mesh viewing it, or nullptr when the file is
+// missing, was written for other contents or by another version, or is damaged.
+std::shared_ptr<Mesh> LoadMeshCache(const std::string& path, uint64_t sourceHash);
+
+// Writes the cache through a temporary file renamed into place, so readers
+// never see a partial file. Failures only print a warning.
+void SaveMeshCache(const std::string& path, uint64_t sourceHash, const Mesh& mesh);
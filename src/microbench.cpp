@@ -0,0 +1,638 @@
+#include "pch.h"
+#include "dispatch.h"
+#include "model.h"
+#include "objects.h"
+#include "renderer.h"
+#include "scene.h"
+#include "scenes.h"
+#include <chrono>
+#include <iomanip>
+#include <random>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define RAYTRACING_TSC
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define RAYTRACING_TSC
+#endif
+
+// Kernel micro-benchmarks. Every kernel runs over a seeded set of rays with
+// a chosen share of hits, outside of any render, single-threaded. Every
+// variant is checked against the scalar reference of its kernel before it is
+// timed. Cycles are time stamp counter ticks, which run at the nominal clock
+// of the processor whatever its actual frequency.
+
+struct Options {
+    std::vector<std::string> kernels = {"sphere", "spheres8", "box", "cube", "cube-rotated",
+                                        "triangle", "triangles4", "reflect", "refract", "rcp", "rsqrt",
+                                        "lights", "shadows"};
+    size_t                   rays = 1 << 16;
+    int                      repeats = 15;
+    float                    hitRate = 0.5f;
+    unsigned                 seed = 1;
+    std::string              scene = "ice";
+    std::string              csv;
+};
+
+// One timed implementation of a kernel. run handles every ray of the set and
+// writes one value per ray: the distance of the closest hit or infinity, or
+// whatever the kernel produces.
+struct Variant {
+    std::string                        name;
+    int                                tests; // primitive tests per call
+    std::function<void(float* output)> run;
+    bool                               hitOnly = false; // compared as hit or miss only
+};
+
+struct Row {
+    std::string kernel;
+    std::string variant;
+    int         tests;
+    double      nsPerCall;
+    double      cyclesPerCall;
+    double      hitRate;    // negative where it means nothing
+    long long   mismatches; // against the first variant; negative for the reference itself
+    double      maxError;   // largest difference to the first variant, relative above 1; negative for the reference
+};
+
+constexpr float MISS = std::numeric_limits<float>::infinity();
+
+static std::vector<std::string> Split(const std::string& list) {
+    std::vector<std::string> items;
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ','))
+        if (!item.empty())
+            items.push_back(item);
+    return items;
+}
+
+static void PrintUsage(const char* program) {
+    std::cout << "Usage: " << program << " [options]\n"
+              << "  --kernels LIST   from sphere,spheres8,box,cube,cube-rotated,triangle,triangles4,\n"
+              << "                   reflect,refract,rcp,rsqrt,lights,shadows (default all)\n"
+              << "  --rays N         rays per set (default 65536)\n"
+              << "  --repeats N      timed passes over the set, the median is kept (default 15)\n"
+              << "  --hit-rate F     share of rays that hit, 0 to 1 (default 0.5)\n"
+              << "  --seed N         seed of the ray sets (default 1)\n"
+              << "  --scene NAME     reference scene of the lighting kernels (default ice)\n"
+              << "  --csv FILE       also write the results as CSV\n";
+}
+
+static Options ParseOptions(int argc, char** argv) {
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc)
+                throw std::runtime_error("Missing value for " + arg);
+            return argv[++i];
+        };
+
+        if (arg == "-h" || arg == "--help") {
+            PrintUsage(argv[0]);
+            std::exit(EXIT_SUCCESS);
+        } else if (arg == "--kernels") {
+            options.kernels = Split(value());
+        } else if (arg == "--rays") {
+            // Whole packets, so that every variant sees the same rays.
+            options.rays = std::max<size_t>(PACKET_SIZE, std::stoul(value()) / PACKET_SIZE * PACKET_SIZE);
+        } else if (arg == "--repeats") {
+            options.repeats = std::max(1, std::stoi(value()));
+        } else if (arg == "--hit-rate") {
+            options.hitRate = std::clamp(std::stof(value()), 0.0f, 1.0f);
+        } else if (arg == "--seed") {
+            options.seed = static_cast<unsigned>(std::stoul(value()));
+        } else if (arg == "--scene") {
+            options.scene = value();
+        } else if (arg == "--csv") {
+            options.csv = value();
+        } else {
+            throw std::runtime_error("Unknown option " + arg);
+        }
+    }
+    return options;
+}
+
+static uint64_t ReadCycles() {
+#ifdef RAYTRACING_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static double Median(std::vector<double> samples) {
+    std::sort(samples.begin(), samples.end());
+    size_t middle = samples.size() / 2;
+    return samples.size() % 2 ? samples[middle] : (samples[middle - 1] + samples[middle]) / 2.0;
+}
+
+static Vec3 RandomUnit(std::mt19937& random) {
+    std::normal_distribution<float> normal;
+    while (true) {
+        Vec3 v(normal(random), normal(random), normal(random));
+        float length = Length(v);
+        if (length > 1e-3f)
+            return v / length;
+    }
+}
+
+// Rays from all around target, aimed at points near it, kept so that a
+// share hitRate of them hits according to the reference test, then shuffled
+// so that hits and misses interleave as they do in a render.
+static std::vector<Ray> AimRays(std::mt19937& random, const AABB& target, size_t count, float hitRate,
+                                const std::function<bool(const Ray&)>& hits) {
+    Vec3 center = target.center();
+    float extent = std::max(Length(target.max() - target.min()) / 2.0f, 1e-3f);
+    std::uniform_real_distribution<float> offset(-extent, extent);
+
+    size_t wantedHits = static_cast<size_t>(std::lround(count * static_cast<double>(hitRate)));
+    std::vector<Ray> hitting, missing;
+    for (size_t attempt = 0; hitting.size() < wantedHits || missing.size() < count - wantedHits; attempt++) {
+        if (attempt > count * 1000)
+            throw std::runtime_error("Cannot aim rays at the requested hit rate");
+        Vec3 origin = center + 4.0f * extent * RandomUnit(random);
+        Vec3 aim = center + Vec3(offset(random), offset(random), offset(random));
+        Ray ray(origin, Normalize(aim - origin));
+        std::vector<Ray>& kept = hits(ray) ? hitting : missing;
+        if (kept.size() < (&kept == &hitting ? wantedHits : count - wantedHits))
+            kept.push_back(ray);
+    }
+    hitting.insert(hitting.end(), missing.begin(), missing.end());
+    std::shuffle(hitting.begin(), hitting.end(), random);
+    return hitting;
+}
+
+// Runs each variant once to check it against the first, then times it.
+static void Measure(const Options& options, const std::string& kernel, size_t calls,
+                    const std::vector<Variant>& variants, bool distances, std::vector<Row>& rows) {
+    std::vector<float> reference(calls);
+    std::vector<float> output(calls);
+    for (size_t index = 0; index < variants.size(); index++) {
+        const Variant& variant = variants[index];
+        variant.run(output.data());
+        if (index == 0)
+            reference = output;
+
+        Row row{kernel, variant.name, variant.tests, 0.0, 0.0, -1.0, -1, -1.0};
+        if (distances) {
+            size_t hits = std::count_if(output.begin(), output.end(), [](float t) { return t != MISS; });
+            row.hitRate = static_cast<double>(hits) / calls;
+        }
+        if (index > 0) {
+            row.mismatches = 0;
+            row.maxError = 0.0;
+            for (size_t i = 0; i < calls; i++) {
+                float a = reference[i], b = output[i];
+                if (a == b || (std::isnan(a) && std::isnan(b)) || (variant.hitOnly && (a == MISS) == (b == MISS)))
+                    continue;
+                float error = std::abs(a - b) / std::max(1.0f, std::abs(a));
+                if (a != MISS && b != MISS)
+                    row.maxError = std::max<double>(row.maxError, error);
+                if (a == MISS || b == MISS || error > 1e-5f)
+                    row.mismatches++;
+            }
+        }
+
+        std::vector<double> times, cycles;
+        for (int repeat = 0; repeat < options.repeats; repeat++) {
+            auto start = std::chrono::steady_clock::now();
+            uint64_t startCycles = ReadCycles();
+            variant.run(output.data());
+            uint64_t endCycles = ReadCycles();
+            auto end = std::chrono::steady_clock::now();
+            times.push_back(std::chrono::duration<double, std::nano>(end - start).count() / calls);
+            cycles.push_back(static_cast<double>(endCycles - startCycles) / calls);
+        }
+        row.nsPerCall = Median(times);
+        row.cyclesPerCall = Median(cycles);
+        rows.push_back(row);
+    }
+}
+
+// Closest hits of the four rays of a packet.
+static void StoreLanes(const PacketHit& hits, float* output) {
+    for (int lane = 0; lane < PACKET_SIZE; lane++)
+        output[lane] = hits.parameter[lane] < std::numeric_limits<float>::max() ? hits.parameter[lane] : MISS;
+}
+
+// One object against single rays, packets and shadow rays.
+static std::vector<Variant> ObjectVariants(const IObject& object, const std::vector<Ray>& rays) {
+    auto single = [&object, &rays](float* output) {
+        for (size_t i = 0; i < rays.size(); i++) {
+            Hit hit;
+            output[i] = object.hit(rays[i], hit) ? hit.t : MISS;
+        }
+    };
+    auto packet = [&object, &rays](float* output) {
+        for (size_t i = 0; i < rays.size(); i += PACKET_SIZE) {
+            RayPacket packet(*reinterpret_cast<const Ray(*)[PACKET_SIZE]>(&rays[i]));
+            PacketHit hits;
+            object.hit(packet, Mask4(true), hits);
+            StoreLanes(hits, output + i);
+        }
+    };
+    auto occluded = [&object, &rays](float* output) {
+        for (size_t i = 0; i < rays.size(); i++)
+            output[i] = object.occluded(rays[i], std::numeric_limits<float>::max()) ? 0.0f : MISS;
+    };
+    return {{"hit", 1, single}, {"packet hit", 1, packet}, {"occluded", 1, occluded, true}};
+}
+
+static void SphereKernels(const Options& options, std::mt19937& random, std::vector<Row>& rows) {
+    Sphere sphere(Vec3(0.3f, -0.2f, 0.1f), 1.5f);
+    auto hits = [&](const Ray& ray) { Hit hit; return sphere.hit(ray, hit); };
+    std::vector<Ray> rays = AimRays(random, sphere.bounds(), options.rays, options.hitRate, hits);
+    Measure(options, "sphere", rays.size(), ObjectVariants(sphere, rays), true, rows);
+}
+
+// One ray against a leaf of eight spheres: one at a time as Sphere::hit,
+// four at a time as the sphere BVH does, and eight at a time with the
+// dispatched kernel.
+static void SpheresKernels(const Options& options, std::mt19937& random, std::vector<Row>& rows) {
+    std::uniform_real_distribution<float> position(-2.0f, 2.0f);
+    std::uniform_real_distribution<float> size(0.3f, 0.8f);
+    std::vector<Sphere> spheres;
+    AABB bounds = AABB::empty();
+    alignas(32) Scene::SphereBlock blocks[2] = {};
+    for (int i = 0; i < 8; i++) {
+        Vec3 center(position(random), position(random), position(random));
+        float radius = size(random);
+        spheres.emplace_back(center, radius);
+        bounds.extend(spheres.back().bounds());
+        Scene::SphereBlock& block = blocks[i / 4];
+        for (int axis = 0; axis < 3; axis++)
+            block.center[axis][i % 4] = center[axis];
+        block.radius[i % 4] = radius;
+        block.id[i % 4] = i;
+    }
+
+    auto closest = [&spheres](const Ray& ray) {
+        Hit hit;
+        for (const Sphere& sphere : spheres)
+            sphere.hit(ray, hit);
+        return hit.t < std::numeric_limits<float>::max() ? hit.t : MISS;
+    };
+    std::vector<Ray> rays = AimRays(random, bounds, options.rays, options.hitRate,
+                                    [&](const Ray& ray) { return closest(ray) != MISS; });
+
+    auto nearest = [](int bits, const float* t, int lanes) {
+        float best = MISS;
+        for (int lane = 0; lane < lanes; lane++)
+            if (bits & (1 << lane))
+                best = std::min(best, t[lane]);
+        return best;
+    };
+    std::vector<Variant> variants = {
+        {"Sphere::hit x8", 8, [&](float* output) {
+             for (size_t i = 0; i < rays.size(); i++)
+                 output[i] = closest(rays[i]);
+         }},
+        {std::string("block x4, ") + SimdLevelName(BuildSimdLevel()), 8, [&](float* output) {
+             alignas(16) float t[8];
+             for (size_t i = 0; i < rays.size(); i++) {
+                 Float4 first, second;
+                 int bits = Scene::hitBlock(blocks[0], rays[i], MISS, first).bits();
+                 bits |= Scene::hitBlock(blocks[1], rays[i], MISS, second).bits() << 4;
+                 first.store(t);
+                 second.store(t + 4);
+                 output[i] = nearest(bits, t, 8);
+             }
+         }}};
+    if (auto hitSpheres8 = ActiveKernels().hitSpheres8) {
+        variants.push_back({std::string("x8, ") + SimdLevelName(ActiveKernels().level), 8, [&, hitSpheres8](float* output) {
+            alignas(32) float t[8];
+            for (size_t i = 0; i < rays.size(); i++) {
+                const Ray& ray = rays[i];
+                const float values[6] = {ray.origin.x, ray.origin.y, ray.origin.z,
+                                         ray.direction.x, ray.direction.y, ray.direction.z};
+                output[i] = nearest(hitSpheres8(blocks[0].center[0], blocks[1].center[0], values, MISS, t), t, 8);
+            }
+        }});
+    }
+    Measure(options, "spheres8", rays.size(), variants, true, rows);
+}
+
+static void BoxKernels(const Options& options, std::mt19937& random, std::vector<Row>& rows) {
+    AABB box(Vec3(-1.0f, -0.5f, -2.0f), Vec3(1.5f, 0.5f, 1.0f));
+    std::vector<Ray> rays = AimRays(random, box, options.rays, options.hitRate,
+                                    [&](const Ray& ray) { return box.hit(ray); });
+    std::vector<Vec3> inverses;
+    for (const Ray& ray : rays)
+        inverses.emplace_back(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+
+    // The reference only tells hit from miss, so the others write no distance
+    // either. The BVH divides once per ray rather than once per box.
+    std::vector<Variant> variants = {
+        {"hit(ray)", 1, [&](float* output) {
+             for (size_t i = 0; i < rays.size(); i++)
+                 output[i] = box.hit(rays[i]) ? 0.0f : MISS;
+         }},
+        {"hit(ray, inverse) as in BVH", 1, [&](float* output) {
+             for (size_t i = 0; i < rays.size(); i++) {
+                 float tEntry;
+                 output[i] = box.hit(rays[i], inverses[i], MISS, tEntry) ? 0.0f : MISS;
+             }
+         }},
+        {"HitAABB packet", 1, [&](float* output) {
+             for (size_t i = 0; i < rays.size(); i += PACKET_SIZE) {
+                 RayPacket packet(*reinterpret_cast<const Ray(*)[PACKET_SIZE]>(&rays[i]));
+                 Vec3x4 inverse(Float4(1.0f) / packet.direction.x, Float4(1.0f) / packet.direction.y,
+                                Float4(1.0f) / packet.direction.z);
+                 Float4 tEntry;
+                 int bits = HitAABB(box, packet, inverse, Float4(MISS), tEntry).bits();
+                 for (int lane = 0; lane < PACKET_SIZE; lane++)
+                     output[i + lane] = bits & (1 << lane) ? 0.0f : MISS;
+             }
+         }}};
+    Measure(options, "box", rays.size(), variants, true, rows);
+}
+
+static void CubeKernels(const Options& options, std::mt19937& random, std::vector<Row>& rows, bool rotated) {
+    Cube cube(Vec3(-1.0f, -1.0f, -1.0f), Vec3(1.0f, 1.0f, 1.0f));
+    if (rotated) {
+        cube.getRotation() = Vec3(20.0f, 35.0f, -10.0f);
+        cube.getScale() = 1.2f;
+        cube.update();
+    }
+    auto hits = [&](const Ray& ray) { Hit hit; return cube.hit(ray, hit); };
+    std::vector<Ray> rays = AimRays(random, cube.bounds(), options.rays, options.hitRate, hits);
+    Measure(options, rotated ? "cube-rotated" : "cube", rays.size(), ObjectVariants(cube, rays), true, rows);
+}
+
+// One ray against the four triangles of a leaf: one at a time, as a packed
+// block, and four rays at a time against each triangle as packets do.
+static void TriangleKernels(const Options& options, std::mt19937& random, std::vector<Row>& rows, int triangles) {
+    std::uniform_real_distribution<float> position(-1.0f, 1.0f);
+    struct Triangle {
+        Vec3 A, edge1, edge2;
+    };
+    std::vector<Triangle> faces;
+    AABB bounds = AABB::empty();
+    TriangleBlock block = {};
+    for (int i = 0; i < 4; i++) {
+        block.face[i] = -1;
+        if (i >= triangles)
+            continue;
+        Vec3 A(position(random), position(random), position(random));
+        Vec3 B = A + Vec3(position(random), position(random), position(random));
+        Vec3 C = A + Vec3(position(random), position(random), position(random));
+        faces.push_back({A, B - A, C - A});
+        bounds.extend(A);
+        bounds.extend(B);
+        bounds.extend(C);
+        for (int axis = 0; axis < 3; axis++) {
+            block.v0[axis][i] = A[axis];
+            block.e1[axis][i] = (B - A)[axis];
+            block.e2[axis][i] = (C - A)[axis];
+        }
+        block.face[i] = i;
+    }
+
+    auto closest = [&faces](const Ray& ray) {
+        float best = MISS;
+        for (const Triangle& face : faces) {
+            float t;
+            if (IntersectTriangle(face.A, face.edge1, face.edge2, ray, t))
+                best = std::min(best, t);
+        }
+        return best;
+    };
+    // Triangles are single-sided: rays that see their back miss.
+    std::vector<Ray> rays = AimRays(random, bounds, options.rays, options.hitRate,
+                                    [&](const Ray& ray) { return closest(ray) != MISS; });
+
+    int tests = static_cast<int>(faces.size());
+    std::vector<Variant> variants = {
+        {"Moller-Trumbore", tests, [&](float* output) {
+             for (size_t i = 0; i < rays.size(); i++)
+                 output[i] = closest(rays[i]);
+         }},
+        {std::string("block x4, ") + SimdLevelName(BuildSimdLevel()), tests, [&](float* output) {
+             alignas(16) float t[4];
+             for (size_t i = 0; i < rays.size(); i++) {
+                 Float4 distances;
+                 int bits = IntersectTriangles(block, rays[i], MISS, distances).bits();
+                 distances.store(t);
+                 float best = MISS;
+                 for (int lane = 0; lane < 4; lane++)
+                     if (bits & (1 << lane))
+                         best = std::min(best, t[lane]);
+                 output[i] = best;
+             }
+         }},
+        {"packet", tests, [&](float* output) {
+             for (size_t i = 0; i < rays.size(); i += PACKET_SIZE) {
+                 RayPacket packet(*reinterpret_cast<const Ray(*)[PACKET_SIZE]>(&rays[i]));
+                 PacketHit hits;
+                 for (size_t face = 0; face < faces.size(); face++)
+                     IntersectTriangle(faces[face].A, faces[face].edge1, faces[face].edge2,
+                                       static_cast<uint32_t>(face), packet, Mask4(true), hits);
+                 StoreLanes(hits, output + i);
+             }
+         }}};
+    Measure(options, triangles == 1 ? "triangle" : "triangles4", rays.size(), variants, true, rows);
+}
+
+// Directions leaving ice at random angles, so that some reflect totally.
+static void BounceKernels(const Options& options, std::mt19937& random, std::vector<Row>& rows) {
+    const float refractive = 1.31f;
+    std::vector<Vec3> directions, normals;
+    for (size_t i = 0; i < options.rays; i++) {
+        directions.push_back(RandomUnit(random));
+        normals.push_back(RandomUnit(random));
+    }
+
+    auto reflect = [&](float* output) {
+        for (size_t i = 0; i < directions.size(); i++) {
+            Vec3 r = Reflect(directions[i], normals[i]);
+            output[i] = r.x + r.y + r.z;
+        }
+    };
+    // A miss stands for total internal reflection.
+    auto refract = [&](float* output) {
+        for (size_t i = 0; i < directions.size(); i++) {
+            std::optional<Vec3> r = Refract(directions[i], normals[i], refractive);
+            output[i] = r ? r->x + r->y + r->z : MISS;
+        }
+    };
+    if (std::find(options.kernels.begin(), options.kernels.end(), "reflect") != options.kernels.end())
+        Measure(options, "reflect", directions.size(), {{"Reflect", 1, reflect}}, false, rows);
+    if (std::find(options.kernels.begin(), options.kernels.end(), "refract") != options.kernels.end())
+        Measure(options, "refract", directions.size(), {{"Refract", 1, refract}}, true, rows);
+}
+
+// The approximate reciprocals of packet.h against exact division, on values
+// whose results lie in [1, 1000] so that the error column is relative.
+static void ReciprocalKernels(const Options& options, std::mt19937& random, std::vector<Row>& rows, bool root) {
+    std::uniform_real_distribution<float> exponent(root ? -6.0f : -3.0f, 0.0f);
+    std::vector<Float4> values(options.rays / PACKET_SIZE);
+    for (Float4& value : values) {
+        alignas(16) float lanes[PACKET_SIZE];
+        for (float& lane : lanes)
+            lane = std::pow(10.0f, exponent(random));
+        value = Float4::load(lanes);
+    }
+
+    auto lanewise = [&](auto&& function) {
+        return [&values, function](float* output) {
+            alignas(16) float lanes[PACKET_SIZE];
+            for (size_t i = 0; i < values.size(); i++) {
+                function(values[i]).store(lanes);
+                std::copy_n(lanes, PACKET_SIZE, output + i * PACKET_SIZE);
+            }
+        };
+    };
+    auto scalar = [&](float* output) {
+        for (size_t i = 0; i < values.size(); i++)
+            for (int lane = 0; lane < PACKET_SIZE; lane++) {
+                float x = values[i][lane];
+                output[i * PACKET_SIZE + lane] = root ? 1.0f / std::sqrt(x) : 1.0f / x;
+            }
+    };
+    std::vector<Variant> variants;
+    if (root) {
+        variants = {{"1 / sqrt(x)", 1, scalar},
+                    {"Float4 1 / Sqrt(x)", 1, lanewise([](const Float4& x) { return Float4(1.0f) / Sqrt(x); })},
+                    {"Rsqrt", 1, lanewise([](const Float4& x) { return Rsqrt(x); })}};
+    } else {
+        variants = {{"1 / x", 1, scalar},
+                    {"Float4 1 / x", 1, lanewise([](const Float4& x) { return Float4(1.0f) / x; })},
+                    {"Rcp", 1, lanewise([](const Float4& x) { return Rcp(x); })}};
+    }
+    Measure(options, root ? "rsqrt" : "rcp", values.size() * PACKET_SIZE, variants, false, rows);
+}
+
+// The light loop of shading at the primary hits of a reference scene.
+static void LightKernels(const Options& options, std::vector<Row>& rows, bool shadows) {
+    Scene scene;
+    LoadReferenceScene(scene, options.scene, options.seed);
+    scene.commit();
+    Camera camera = DefaultCamera(2.0f);
+
+    std::vector<HitRecord> records;
+    std::vector<Vec3> directions;
+    std::vector<float> shininess;
+    int side = 1;
+    while (records.size() < options.rays && side < 8192) {
+        side *= 2;
+        records.clear();
+        directions.clear();
+        shininess.clear();
+        for (int y = 0; y < side && records.size() < options.rays; y++) {
+            for (int x = 0; x < side * 2 && records.size() < options.rays; x++) {
+                Ray ray = camera.generateRay((x + 0.5f) / (side * 2), (y + 0.5f) / side);
+                Hit hit;
+                if (!scene.hit(ray, hit))
+                    continue;
+                records.push_back(scene.record(ray, hit));
+                directions.push_back(ray.direction);
+                shininess.push_back(scene.material(records.back().material).shininess);
+            }
+        }
+    }
+    if (records.empty())
+        throw std::runtime_error("Nothing to shade in scene " + options.scene);
+
+    uint64_t shadowRays = 0;
+    auto illuminate = [&](float* output) {
+        for (size_t i = 0; i < records.size(); i++) {
+            Lighting lighting = Illuminate(scene, records[i], directions[i], shininess[i], shadows, shadowRays);
+            output[i] = lighting.diffuse + lighting.specular;
+        }
+    };
+    int lights = static_cast<int>(scene.lights().size());
+    Measure(options, shadows ? "shadows" : "lights", records.size(),
+            {{shadows ? "Illuminate, shadows" : "Illuminate", lights, illuminate}}, false, rows);
+}
+
+static void PrintRow(const Row& row) {
+    std::cout << std::left << std::setw(14) << row.kernel << std::setw(30) << row.variant << std::right
+              << std::fixed << std::setprecision(2) << std::setw(10) << row.nsPerCall
+              << std::setw(12) << 1e3 / row.nsPerCall << std::setprecision(1) << std::setw(10);
+#ifdef RAYTRACING_TSC
+    std::cout << row.cyclesPerCall;
+#else
+    std::cout << "-";
+#endif
+    std::cout << std::setprecision(2) << std::setw(10) << row.nsPerCall / row.tests << std::setw(8);
+    if (row.hitRate >= 0.0)
+        std::cout << std::setprecision(1) << 100.0 * row.hitRate;
+    else
+        std::cout << "-";
+    std::cout << std::setw(12);
+    if (row.mismatches >= 0)
+        std::cout << row.mismatches;
+    else
+        std::cout << "reference";
+    std::cout << std::setw(12);
+    if (row.maxError >= 0.0)
+        std::cout << std::scientific << std::setprecision(1) << row.maxError << std::fixed;
+    else
+        std::cout << "-";
+    std::cout << "\n";
+}
+
+int main(int argc, char** argv) {
+    try {
+        Options options = ParseOptions(argc, argv);
+#ifndef NDEBUG
+        std::cerr << "warning: benchmark built without NDEBUG, timings include assertions\n";
+#endif
+        std::cout << "SIMD: " << SimdLevelName(BuildSimdLevel()) << " build, "
+                  << SimdLevelName(ActiveKernels().level) << " kernels; " << options.rays << " rays, seed "
+                  << options.seed << "\n";
+        std::cout << std::left << std::setw(14) << "kernel" << std::setw(30) << "variant" << std::right
+                  << std::setw(10) << "ns/call" << std::setw(12) << "Mcalls/s" << std::setw(10) << "cycles"
+                  << std::setw(10) << "ns/test" << std::setw(8) << "hit %" << std::setw(12) << "mismatches" << std::setw(12) << "max error" << "\n";
+
+        std::vector<Row> rows;
+        bool bounced = false;
+        for (const std::string& kernel : options.kernels) {
+            // Each kernel gets its own stream, so that a subset reproduces the full run.
+            std::mt19937 random(options.seed ^ static_cast<unsigned>(std::hash<std::string>()(kernel)));
+            size_t first = rows.size();
+            if (kernel == "sphere") {
+                SphereKernels(options, random, rows);
+            } else if (kernel == "spheres8") {
+                SpheresKernels(options, random, rows);
+            } else if (kernel == "box") {
+                BoxKernels(options, random, rows);
+            } else if (kernel == "cube" || kernel == "cube-rotated") {
+                CubeKernels(options, random, rows, kernel == "cube-rotated");
+            } else if (kernel == "triangle" || kernel == "triangles4") {
+                TriangleKernels(options, random, rows, kernel == "triangle" ? 1 : 4);
+            } else if (kernel == "reflect" || kernel == "refract") {
+                if (!bounced) {
+                    std::mt19937 bounce(options.seed ^ static_cast<unsigned>(std::hash<std::string>()("bounce")));
+                    BounceKernels(options, bounce, rows);
+                }
+                bounced = true;
+            } else if (kernel == "rcp" || kernel == "rsqrt") {
+                ReciprocalKernels(options, random, rows, kernel == "rsqrt");
+            } else if (kernel == "lights" || kernel == "shadows") {
+                LightKernels(options, rows, kernel == "shadows");
+            } else {
+                throw std::runtime_error("Unknown kernel " + kernel);
+            }
+            for (size_t i = first; i < rows.size(); i++)
+                PrintRow(rows[i]);
+        }
+
+        if (!options.csv.empty()) {
+            std::ofstream csv(options.csv);
+            csv << "kernel,variant,tests_per_call,ns_per_call,mcalls_per_s,cycles_per_call,ns_per_test,hit_rate,mismatches,max_error\n";
+            for (const Row& row : rows) {
+                csv << row.kernel << ",\"" << row.variant << "\"," << row.tests << "," << row.nsPerCall << ","
+                    << 1e3 / row.nsPerCall << "," << row.cyclesPerCall << "," << row.nsPerCall / row.tests << ","
+                    << row.hitRate << "," << row.mismatches << "," << row.maxError << "\n";
+            }
+        }
+    } catch (const std::exception& error) {
+        std::cerr << error.what() << "\n";
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -1,92 +1,359 @@
 #include "pch.h"
 #include "model.h"
+#include "meshcache.h"
+#include "objloader.h"
+#include <chrono>
 
-static std::optional<HitRecord> intersection(const Vec3& A, const Vec3& B, const Vec3& C, const Ray &ray);
-
-Model::Model(const std::string& filename) {
-    std::ifstream in(filename);
-    if (!in.is_open())
-        throw std::runtime_error("Cannot open model");
-
-    std::string line;
-    while (!in.eof()) {
-        std::getline(in, line);
-        std::istringstream iss(line.c_str());
-        char trash;
-        if (!line.compare(0, 2, "v ")) {
-            Vec3 v;
-            iss >> trash >> v.x >> v.y >> v.z;
-            m_vertices.push_back(v);
-        } else if (!line.compare(0, 2, "f ")) {
-            iss >> trash;
-            int vertex;
-            int count = 0;
-            while (iss >> vertex) {
-                m_faces.push_back(vertex - 1);
-                count++;
+// Packs the triangles of every leaf into blocks of four.
+static void PackBlocks(Mesh& mesh) {
+    auto vertex = [&](int face, int i) { return mesh.vertices[mesh.faces[face * 3 + i]]; };
+    std::span<const BVHNode> nodes = mesh.bvh.nodes();
+    mesh.leafBlockData.assign(nodes.size(), 0);
+    for (uint32_t index = 0; index < nodes.size(); index++) {
+        const BVHNode& node = nodes[index];
+        if (!node.isLeaf())
+            continue;
+
+        mesh.leafBlockData[index] = static_cast<uint32_t>(mesh.blockData.size());
+        for (uint32_t first = node.offset; first < node.offset + node.count; first += 4) {
+            TriangleBlock block = {};
+            for (int lane = 0; lane < 4; lane++) {
+                int face = static_cast<int>(first) + lane;
+                block.face[lane] = -1;
+                if (face >= static_cast<int>(node.offset + node.count))
+                    continue;
+
+                Vec3 A = vertex(face, 0);
+                Vec3 edge1 = vertex(face, 1) - A;
+                Vec3 edge2 = vertex(face, 2) - A;
+                Vec3 normal = Normalize(Cross(edge1, edge2));
+                for (int axis = 0; axis < 3; axis++) {
+                    block.v0[axis][lane] = A[axis];
+                    block.e1[axis][lane] = edge1[axis];
+                    block.e2[axis][lane] = edge2[axis];
+                    block.normal[axis][lane] = normal[axis];
+                }
+                block.face[lane] = face;
             }
-            if (count != 3) throw std::runtime_error("Not triangulated model");
+            mesh.blockData.push_back(block);
         }
     }
+    mesh.blocks = mesh.blockData;
+    mesh.leafBlocks = mesh.leafBlockData;
+}
+
+// Builds the hierarchy of a parsed OBJ file. Blocks are always packed so that
+// the mesh cache serves both layouts.
+static std::shared_ptr<Mesh> BuildMesh(ObjMesh obj) {
+    auto mesh = std::make_shared<Mesh>();
+    mesh->vertexData = std::move(obj.vertices);
+    mesh->aabb = AABB(mesh->vertexData);
+
+    const std::vector<Vec3>& vertices = mesh->vertexData;
+    const std::vector<int>& faces = obj.faces;
+    int count = static_cast<int>(faces.size() / 3);
+    std::vector<AABB> bounds;
+    bounds.reserve(count);
+    for (int face = 0; face < count; face++) {
+        AABB box = AABB::empty();
+        for (int i = 0; i < 3; i++)
+            box.extend(vertices[faces[face * 3 + i]]);
+        bounds.push_back(box);
+    }
+    mesh->bvh.build(bounds);
+
+    // Store faces in leaf order so that a leaf slot is a face index.
+    mesh->faceData.reserve(faces.size());
+    for (uint32_t face : mesh->bvh.indices())
+        mesh->faceData.insert(mesh->faceData.end(), faces.begin() + face * 3, faces.begin() + face * 3 + 3);
+    mesh->vertices = mesh->vertexData;
+    mesh->faces = mesh->faceData;
+    PackBlocks(*mesh);
+    return mesh;
+}
+
+bool Mesh::valid() const {
+    if (layout != MeshLayout::Indexed && layout != MeshLayout::Packed)
+        return false;
+    if (faces.size() % 3 != 0 || bvh.indices().size() != faces.size() / 3 || !bvh.valid(faces.size() / 3))
+        return false;
+    for (int index : faces)
+        if (index < 0 || static_cast<size_t>(index) >= vertices.size())
+            return false;
+
+    std::span<const BVHNode> nodes = bvh.nodes();
+    if (leafBlocks.empty())
+        return layout == MeshLayout::Indexed;
+    if (leafBlocks.size() != nodes.size())
+        return false;
+    for (size_t index = 0; index < nodes.size(); index++)
+        if (nodes[index].isLeaf() && static_cast<uint64_t>(leafBlocks[index]) + (nodes[index].count + 3) / 4 > blocks.size())
+            return false;
+    return true;
+}
+
+Model::Model(const std::string& filename, MeshLayout layout) {
+    auto start = std::chrono::steady_clock::now();
+    MappedFile source(filename);
+    uint64_t hash = HashBytes(source.data(), source.size());
+    std::string cache = MeshCachePath(filename);
+    std::shared_ptr<Mesh> mesh = LoadMeshCache(cache, hash);
+    bool cached = mesh != nullptr;
+    if (!cached) {
+        mesh = BuildMesh(ParseObj(source.data(), source.size(), filename));
+        SaveMeshCache(cache, hash, *mesh);
+    }
+    auto end = std::chrono::steady_clock::now();
+    m_loadMs = std::chrono::duration<double, std::milli>(end - start).count();
+    m_cached = cached;
+
+    mesh->layout = layout;
+    if (layout == MeshLayout::Indexed) {
+        mesh->blocks = {};
+        mesh->leafBlocks = {};
+        mesh->blockData = {};
+        mesh->leafBlockData = {};
+    }
+    m_mesh = mesh;
+    m_center = (mesh->aabb.min() + mesh->aabb.max()) / 2.0f;
+}
+
+Model::Model(std::shared_ptr<const Mesh> mesh)
+    : m_mesh(std::move(mesh)), m_center((m_mesh->aabb.min() + m_mesh->aabb.max()) / 2.0f) {}
+
+ModelStats Model::stats() const {
+    ModelStats stats;
+    stats.triangles = m_mesh->faces.size() / 3;
+    stats.loadMs = m_loadMs;
+    stats.cached = m_cached;
+    stats.bvh = m_mesh->bvh.stats();
+    stats.layout = m_mesh->layout;
+    stats.bytes = m_mesh->vertices.size_bytes() + m_mesh->faces.size_bytes() + m_mesh->blocks.size_bytes() +
+                  m_mesh->leafBlocks.size_bytes();
+    return stats;
+}
+
+std::ostream& operator<<(std::ostream& out, const ModelStats& stats) {
+    return out << stats.triangles << " triangles loaded in " << stats.loadMs << " ms"
+               << (stats.cached ? " from the mesh cache" : "") << ", BVH of " << stats.bvh.nodes << " nodes, "
+               << stats.bvh.leaves << " leaves, depth " << stats.bvh.depth << ", " << stats.bvh.buildMs << " ms, "
+               << (stats.layout == MeshLayout::Packed ? "packed" : "indexed") << " triangles "
+               << stats.bytes / 1024 << " KiB";
+}
+
+bool Model::hit(const Ray& worldRay, Hit& hit) const {
+    bool found = false;
+    Ray ray = m_instance.rayToObject(worldRay);
+
+    if (m_mesh->layout == MeshLayout::Packed) {
+        const BVHNode* nodes = m_mesh->bvh.nodes().data();
+        m_mesh->bvh.traverseLeaves(ray, hit.t, [&](const BVHNode& leaf, float& tMax) {
+            CountTests(TraceStats::Primitive::Triangle, (leaf.count + 3) / 4 * 4);
+            uint32_t first = m_mesh->leafBlocks[&leaf - nodes];
+            for (uint32_t i = 0; i < leaf.count; i += 4) {
+                uint32_t index = first + i / 4;
+                Float4 t;
+                Mask4 valid = IntersectTriangles(m_mesh->blocks[index], ray, tMax, t);
+                // Lowest lane on ties, like the indexed layout.
+                for (int lane = 0; valid.any() && lane < 4; lane++) {
+                    if (valid[lane] && t[lane] < tMax) {
+                        tMax = t[lane];
+                        hit.primitive = index * 4 + lane;
+                        found = true;
+                    }
+                }
+            }
+        });
+    } else {
+        m_mesh->bvh.traverse(ray, hit.t, [&](uint32_t face, float& tMax) {
+            CountTests(TraceStats::Primitive::Triangle);
+            Vec3 A = vertex(face, 0);
+            float t;
+            if (IntersectTriangle(A, vertex(face, 1) - A, vertex(face, 2) - A, ray, t) && t < tMax) {
+                tMax = t;
+                hit.primitive = face;
+                found = true;
+            }
+        });
+    }
+    return found;
+}
 
-    m_aabb = AABB(m_vertices);
-    m_center = (m_aabb.min() + m_aabb.max()) / 2.0f;
+Vec3 Model::normal(const Vec3&, uint32_t primitive) const {
+    if (m_mesh->layout == MeshLayout::Packed) {
+        const TriangleBlock& block = m_mesh->blocks[primitive / 4];
+        int lane = primitive % 4;
+        return m_instance.normalToWorld(Vec3(block.normal[0][lane], block.normal[1][lane], block.normal[2][lane]));
+    }
+    Vec3 A = vertex(primitive, 0);
+    return m_instance.normalToWorld(Normalize(Cross(vertex(primitive, 1) - A, vertex(primitive, 2) - A)));
 }
 
-std::optional<HitRecord> Model::hit(const Ray& ray) const {
-    if (!m_aabb.hit(ray))
-        return std::nullopt;
+bool Model::occluded(const Ray& worldRay, float tMax) const {
+    Ray ray = m_instance.rayToObject(worldRay);
+    if (m_mesh->layout == MeshLayout::Packed) {
+        const BVHNode* nodes = m_mesh->bvh.nodes().data();
+        return m_mesh->bvh.anyHitLeaves(ray, tMax, [&](const BVHNode& leaf) {
+            const TriangleBlock* block = &m_mesh->blocks[m_mesh->leafBlocks[&leaf - nodes]];
+            for (uint32_t i = 0; i < leaf.count; i += 4, block++) {
+                CountTests(TraceStats::Primitive::Triangle, 4);
+                Float4 t;
+                if (IntersectTriangles(*block, ray, tMax, t).any())
+                    return true;
+            }
+            return false;
+        });
+    }
 
-    std::optional<HitRecord> hitRecord = std::nullopt;
-    float minT = std::numeric_limits<float>::max();
+    return m_mesh->bvh.anyHit(ray, tMax, [&](uint32_t face) {
+        CountTests(TraceStats::Primitive::Triangle);
+        Vec3 A = vertex(face, 0);
+        float t;
+        return IntersectTriangle(A, vertex(face, 1) - A, vertex(face, 2) - A, ray, t) && t < tMax;
+    });
+}
+
+Mask4 Model::occluded(const RayPacket& worldPacket, Mask4 active, const Float4& tMax) const {
+    RayPacket transformed;
+    const RayPacket& packet = m_instance.identity() ? worldPacket : (transformed = PacketToObject(m_instance, worldPacket));
+    // Lanes blocked so far end up with a hit closer than their tMax.
+    PacketHit hits;
+    hits.parameter = tMax;
+    auto blocked = [&] { return hits.parameter < tMax; };
+    if (m_mesh->layout == MeshLayout::Packed) {
+        const BVHNode* nodes = m_mesh->bvh.nodes().data();
+        return m_mesh->bvh.anyHitLeaves(packet, active, tMax, [&](const BVHNode& leaf, Mask4 lanes) {
+            CountTests(TraceStats::Primitive::Triangle, leaf.count * lanes.count());
+            uint32_t first = m_mesh->leafBlocks[&leaf - nodes];
+            for (uint32_t i = 0; i < leaf.count; i += 4) {
+                uint32_t index = first + i / 4;
+                const TriangleBlock& block = m_mesh->blocks[index];
+                for (int lane = 0; lane < 4 && block.face[lane] >= 0; lane++) {
+                    auto get = [&](const float (&values)[3][4]) {
+                        return Vec3(values[0][lane], values[1][lane], values[2][lane]);
+                    };
+                    IntersectTriangle(get(block.v0), get(block.e1), get(block.e2), index * 4 + lane, packet,
+                                      lanes & !blocked(), hits);
+                }
+            }
+            return lanes & blocked();
+        });
+    }
 
-    for (int face = 0; face < m_faces.size() / 3; face++) {
+    return m_mesh->bvh.anyHit(packet, active, tMax, [&](uint32_t face, Mask4 lanes) {
+        CountTests(TraceStats::Primitive::Triangle, lanes.count());
         Vec3 A = vertex(face, 0);
-        Vec3 B = vertex(face, 1);
-        Vec3 C = vertex(face, 2);
-        auto record = intersection(A, B, C, ray);
-        if (record && record->parameter < minT) {
-            hitRecord = record;
-            hitRecord->material = m_material;
-            minT = record->parameter;
-        }
+        IntersectTriangle(A, vertex(face, 1) - A, vertex(face, 2) - A, face, packet, lanes, hits);
+        return lanes & blocked();
+    });
+}
+
+void Model::hit(const RayPacket& worldPacket, Mask4 active, PacketHit& hits) const {
+    RayPacket transformed;
+    const RayPacket& packet = m_instance.identity() ? worldPacket : (transformed = PacketToObject(m_instance, worldPacket));
+    if (m_mesh->layout == MeshLayout::Packed) {
+        const BVHNode* nodes = m_mesh->bvh.nodes().data();
+        m_mesh->bvh.traverseLeaves(packet, active, hits.parameter, [&](const BVHNode& leaf, Mask4 lanes) {
+            CountTests(TraceStats::Primitive::Triangle, leaf.count * lanes.count());
+            uint32_t first = m_mesh->leafBlocks[&leaf - nodes];
+            for (uint32_t i = 0; i < leaf.count; i += 4) {
+                uint32_t index = first + i / 4;
+                const TriangleBlock& block = m_mesh->blocks[index];
+                for (int lane = 0; lane < 4 && block.face[lane] >= 0; lane++) {
+                    auto get = [&](const float (&values)[3][4]) {
+                        return Vec3(values[0][lane], values[1][lane], values[2][lane]);
+                    };
+                    IntersectTriangle(get(block.v0), get(block.e1), get(block.e2), index * 4 + lane, packet, lanes, hits);
+                }
+            }
+        });
+        return;
     }
-    return hitRecord;
+
+    m_mesh->bvh.traverse(packet, active, hits.parameter, [&](uint32_t face, Mask4 lanes) {
+        CountTests(TraceStats::Primitive::Triangle, lanes.count());
+        Vec3 A = vertex(face, 0);
+        IntersectTriangle(A, vertex(face, 1) - A, vertex(face, 2) - A, face, packet, lanes, hits);
+    });
 }
 
 void Model::update() {
-
+    m_instance.place(m_center, m_rotation, m_scale, (m_mesh->aabb.min() + m_mesh->aabb.max()) / 2.0f);
 }
 
 Vec3 Model::vertex(int face, int vertex) const {
-    assert(face >= 0 && face < m_faces.size() / 3);
+    assert(face >= 0 && face < m_mesh->faces.size() / 3);
     assert(vertex >= 0 && vertex < 3);
-    int index = m_faces[face * 3 + vertex];
-    return m_vertices[index];
+    int index = m_mesh->faces[face * 3 + vertex];
+    return m_mesh->vertices[index];
 }
 
-static std::optional<HitRecord> intersection(const Vec3& A, const Vec3& B, const Vec3& C, const Ray &ray) {
-    Vec3 edge1 = B - A;
-    Vec3 edge2 = C - A;
+bool IntersectTriangle(const Vec3& A, const Vec3& edge1, const Vec3& edge2, const Ray& ray, float& t) {
     Vec3 pvec = Cross(ray.direction, edge2);
 
     float det = Dot(edge1, pvec);
-    if (det < EPSILON) return std::nullopt;
+    if (det < EPSILON) return false;
 
     Vec3 tvec = ray.origin - A;
     float u = Dot(tvec, pvec);
-    if (u < 0 || u > det) return std::nullopt;
+    if (u < 0 || u > det) return false;
 
     Vec3 qvec = Cross(tvec, edge1);
     float v = Dot(ray.direction, qvec);
-    if (v < 0 || u + v > det) return std::nullopt;
+    if (v < 0 || u + v > det) return false;
+
+    t = Dot(edge2, qvec) * (1.0f / det);
+    return t >= EPSILON;
+}
+
+Mask4 IntersectTriangles(const TriangleBlock& block, const Ray& ray, float tMax, Float4& t) {
+    Vec3x4 v0(Float4::load(block.v0[0]), Float4::load(block.v0[1]), Float4::load(block.v0[2]));
+    Vec3x4 e1(Float4::load(block.e1[0]), Float4::load(block.e1[1]), Float4::load(block.e1[2]));
+    Vec3x4 e2(Float4::load(block.e2[0]), Float4::load(block.e2[1]), Float4::load(block.e2[2]));
+    Vec3x4 direction(ray.direction);
+
+    Vec3x4 pvec = Cross(direction, e2);
+    Float4 det = Dot(e1, pvec);
+    Mask4 valid = det >= Float4(EPSILON);
+    if (valid.none()) return valid;
+
+    Vec3x4 tvec = Vec3x4(ray.origin) - v0;
+    Float4 u = Dot(tvec, pvec);
+    valid = valid & (u >= Float4(0.0f)) & (u <= det);
+    if (valid.none()) return valid;
+
+    Vec3x4 qvec = Cross(tvec, e1);
+    Float4 v = Dot(direction, qvec);
+    valid = valid & (v >= Float4(0.0f)) & (u + v <= det);
+    if (valid.none()) return valid;
+
+    t = Dot(e2, qvec) * (Float4(1.0f) / det);
+    return valid & (t >= Float4(EPSILON)) & (t < Float4(tMax));
+}
+
+void IntersectTriangle(const Vec3& A, const Vec3& edge1, const Vec3& edge2, uint32_t primitive,
+                       const RayPacket& packet, Mask4 lanes, PacketHit& hits) {
+    Vec3x4 e1(edge1);
+    Vec3x4 e2(edge2);
+
+    Vec3x4 pvec = Cross(packet.direction, e2);
+    Float4 det = Dot(e1, pvec);
+    Mask4 valid = lanes & (det >= Float4(EPSILON));
+    if (valid.none()) return;
+
+    Vec3x4 tvec = packet.origin - Vec3x4(A);
+    Float4 u = Dot(tvec, pvec);
+    valid = valid & (u >= Float4(0.0f)) & (u <= det);
+    if (valid.none()) return;
+
+    Vec3x4 qvec = Cross(tvec, e1);
+    Float4 v = Dot(packet.direction, qvec);
+    valid = valid & (v >= Float4(0.0f)) & (u + v <= det);
+    if (valid.none()) return;
 
-    float t = Dot(edge2, qvec) * (1.0f / det);
-    if (t < EPSILON) return std::nullopt;
+    Float4 t = Dot(e2, qvec) * (Float4(1.0f) / det);
+    valid = valid & (t >= Float4(EPSILON)) & (t < hits.parameter);
+    if (valid.none()) return;
 
-    HitRecord record;
-    record.position = ray.at(t);
-    record.normal = Normalize(Cross(edge1, edge2));
-    record.parameter = t;
-    return record;
+    hits.record(valid, t, primitive);
 }
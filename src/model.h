@@ -1,30 +1,110 @@
 #pragma once
 
 #include <vector>
+#include <span>
 #include <string>
-#include <optional>
+#include <memory>
+#include <ostream>
 #include "geometry.h"
 #include "renderer.h"
+#include "bvh.h"
+#include "mappedfile.h"
 
-class Model : public IObject {
+enum class MeshLayout {
+    Packed,  // triangles also baked into blocks of four for SIMD tests
+    Indexed, // vertices and face indices only, for when memory is tight
+};
+
+// Four triangles of one BVH leaf, one per lane, holding everything the
+// Moller-Trumbore test needs. Unused lanes are degenerate and never hit.
+struct alignas(16) TriangleBlock {
+    float   v0[3][4];
+    float   e1[3][4];
+    float   e2[3][4];
+    float   normal[3][4];
+    int32_t face[4];
+};
+
+// Moller-Trumbore tests of triangle A, A + edge1, A + edge2, front faces only.
+// One ray: returns whether it hits at a distance of at least EPSILON, in t.
+bool IntersectTriangle(const Vec3& A, const Vec3& edge1, const Vec3& edge2, const Ray& ray, float& t);
+// One ray against the four triangles of a block; returns the lanes hit
+// before tMax.
+Mask4 IntersectTriangles(const TriangleBlock& block, const Ray& ray, float tMax, Float4& t);
+// One triangle against the active lanes of a packet; records closer hits.
+void IntersectTriangle(const Vec3& A, const Vec3& edge1, const Vec3& edge2, uint32_t primitive,
+                       const RayPacket& packet, Mask4 lanes, PacketHit& hits);
+
+// Triangle data and its hierarchy, shared by every copy of a Model. The
+// spans point either into the owned arrays below, for a mesh built from an
+// OBJ file, or straight into a mapped mesh cache.
+struct Mesh {
+    std::span<const Vec3>          vertices;
+    std::span<const int>           faces;
+    AABB                           aabb;
+    BVH                            bvh;
+    MeshLayout                     layout = MeshLayout::Indexed;
+    std::span<const TriangleBlock> blocks;     // Packed: blocks of all leaves in leaf order
+    std::span<const uint32_t>      leafBlocks; // Packed: first block of a leaf, by node index
+
+    std::vector<Vec3>              vertexData;
+    std::vector<int>               faceData;
+    std::vector<TriangleBlock>     blockData;
+    std::vector<uint32_t>          leafBlockData;
+    MappedFile                     file;
+
+    // Whether arrays read from a file or received from another process are
+    // consistent enough to trace: faces index existing vertices, the BVH is
+    // valid over the faces and every leaf's blocks exist.
+    bool valid() const;
+};
+
+// How a model was loaded and the size of its mesh.
+struct ModelStats {
+    size_t     triangles = 0;
+    double     loadMs = 0.0;   // reading, and parsing and building without a cache; 0 for a mesh built elsewhere
+    bool       cached = false; // mapped from the mesh cache
+    BVHStats   bvh;
+    MeshLayout layout = MeshLayout::Indexed;
+    size_t     bytes = 0;      // vertices, faces and triangle blocks
+};
+
+// "N triangles loaded in T ms [from the mesh cache], BVH of N nodes, L leaves,
+// depth D, T ms, packed|indexed triangles K KiB".
+std::ostream& operator<<(std::ostream& out, const ModelStats& stats);
+
+// An instance of a mesh. The mesh stays in object space and is shared by
+// every copy; each instance places it with its own position (of the mesh
+// center), rotation and uniform scale.
+class Model final : public IObject {
 public:
-    explicit Model(const std::string& filename);
-    std::optional<HitRecord> hit(const Ray& ray) const override;
-    Material& getMaterial() override { return m_material; }
+    explicit Model(const std::string& filename, MeshLayout layout = MeshLayout::Packed);
+    explicit Model(std::shared_ptr<const Mesh> mesh);
+    // The primitive of a hit is block * 4 + lane in the packed layout and the
+    // face index in the indexed one.
+    bool hit(const Ray& ray, Hit& hit) const override;
+    void hit(const RayPacket& packet, Mask4 active, PacketHit& hits) const override;
+    bool occluded(const Ray& ray, float tMax) const override;
+    Mask4 occluded(const RayPacket& packet, Mask4 active, const Float4& tMax) const override;
+    Vec3 normal(const Vec3& position, uint32_t primitive) const override;
+    AABB bounds() const override { return m_instance.boundsToWorld(m_mesh->aabb); }
+    std::shared_ptr<IObject> clone() const override { return std::make_shared<Model>(*this); }
     Vec3& getPosition() override { return m_center; }
     Vec3& getRotation() override { return m_rotation; }
     float& getScale() override { return m_scale; }
     void update() override;
+    const std::shared_ptr<const Mesh>& mesh() const { return m_mesh; }
+    ModelStats stats() const;
 
 private:
     Vec3 vertex(int face, int vertex) const;
 
 private:
-    std::vector<Vec3> m_vertices;
-    std::vector<int>  m_faces;
-    AABB              m_aabb;
-    Material m_material;
+    std::shared_ptr<const Mesh> m_mesh;
     Vec3     m_center;
     Vec3     m_rotation;
-    float    m_scale;
+    float    m_scale = 1.0f;
+    InstanceTransform m_instance;
+    double   m_loadMs = 0.0;
+    bool     m_cached = false;
 };
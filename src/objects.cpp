@@ -5,7 +5,8 @@ Sphere::Sphere() : Sphere(Vec3(0, 0, 0), 1) {}
 
 Sphere::Sphere(const Vec3 &c, float r) : center(c), radius(r) {}
 
-std::optional<HitRecord> Sphere::hit(const Ray &ray) const
+// Nearer root of the ray-sphere equation, or a negative value on a miss.
+static float SphereRoot(const Ray &ray, const Vec3 &center, float radius)
 {
     Vec3 oc = ray.origin - center;
     float a = Dot(ray.direction, ray.direction);
@@ -14,27 +15,71 @@ std::optional<HitRecord> Sphere::hit(const Ray &ray) const
 
     float discriminant = h * h - a * c;
     if (discriminant < 0)
-        return std::nullopt;
-
-    float root = (-h - std::sqrt(discriminant)) / a;
-    if (root < 0.001f)
-        return std::nullopt;
-
-    HitRecord record;
-    record.position = ray.at(root);
-    record.normal = (record.position - center) / radius;
-    record.parameter = root;
-    record.material = material;
-    return record;
+        return -1.0f;
+    return (-h - std::sqrt(discriminant)) / a;
+}
+
+bool Sphere::hit(const Ray &ray, Hit &hit) const
+{
+    CountTests(TraceStats::Primitive::Sphere);
+    float root = SphereRoot(ray, center, radius);
+    if (root < 0.001f || !(root < hit.t))
+        return false;
+
+    hit.t = root;
+    hit.primitive = 0;
+    return true;
+}
+
+void Sphere::hit(const RayPacket &packet, Mask4 active, PacketHit &hits) const
+{
+    CountTests(TraceStats::Primitive::Sphere, active.count());
+    Vec3x4 oc = packet.origin - Vec3x4(center);
+    Float4 a = Dot(packet.direction, packet.direction);
+    Float4 h = Dot(oc, packet.direction);
+    Float4 c = Dot(oc, oc) - Float4(radius * radius);
+
+    Float4 discriminant = h * h - a * c;
+    Mask4 valid = active & (discriminant >= Float4(0.0f));
+    if (valid.none())
+        return;
+
+    Float4 root = (-h - Sqrt(Max(discriminant, Float4(0.0f)))) / a;
+    valid = valid & (root >= Float4(0.001f)) & (root < hits.parameter);
+    if (valid.none())
+        return;
+
+    hits.record(valid, root, 0);
+}
+
+Vec3 Sphere::normal(const Vec3 &position, uint32_t) const
+{
+    return (position - center) / radius;
+}
+
+bool Sphere::occluded(const Ray &ray, float tMax) const
+{
+    CountTests(TraceStats::Primitive::Sphere);
+    float root = SphereRoot(ray, center, radius);
+    return root >= 0.001f && root < tMax;
+}
+
+AABB Sphere::bounds() const
+{
+    // Bubbles are modelled as spheres with a negative radius (inward normals).
+    float extent = std::abs(radius);
+    return {center - extent, center + extent};
 }
 
 Cube::Cube() : Cube(Vec3(-3.0f, -3.0f, -3.0f), Vec3(3.0f, 3.0f, 3.0f)) {}
 
-Cube::Cube(const Vec3 &min, const Vec3 &max) : min(min), max(max), center((min + max) / 2.0f) {}
+Cube::Cube(const Vec3 &min, const Vec3 &max) : min(min), max(max), center((min + max) / 2.0f), position(center) {}
 
-std::optional<HitRecord> Cube::hit(const Ray &ray) const
+// Entry distance into the box and the axis of the entered face, or a
+// negative distance on a miss.
+static float CubeEntry(const Ray &ray, const Vec3 &min, const Vec3 &max, int &normalAxis)
 {
-    int normalAxis = 0;
+    normalAxis = 0;
     float tMin = std::numeric_limits<float>::min();
     float tMax = std::numeric_limits<float>::max();
     for (int axis = 0; axis < 3; axis++)
@@ -52,22 +97,73 @@ std::optional<HitRecord> Cube::hit(const Ray &ray) const
         tMax = std::min(tMax, t1);
     }
     if (tMin >= tMax)
-        return std::nullopt;
-    if (tMin < 0.001f)
-        return std::nullopt;
+        return -1.0f;
+    return tMin;
+}
+
+bool Cube::hit(const Ray &ray, Hit &hit) const
+{
+    CountTests(TraceStats::Primitive::Box);
+    int normalAxis;
+    float tMin = CubeEntry(instance.rayToObject(ray), min, max, normalAxis);
+    if (tMin < 0.001f || !(tMin < hit.t))
+        return false;
+
+    hit.t = tMin;
+    hit.primitive = static_cast<uint32_t>(normalAxis);
+    return true;
+}
+
+bool Cube::occluded(const Ray &ray, float tMax) const
+{
+    CountTests(TraceStats::Primitive::Box);
+    int normalAxis;
+    float tMin = CubeEntry(instance.rayToObject(ray), min, max, normalAxis);
+    return tMin >= 0.001f && tMin < tMax;
+}
+
+void Cube::hit(const RayPacket &worldPacket, Mask4 active, PacketHit &hits) const
+{
+    CountTests(TraceStats::Primitive::Box, active.count());
+    RayPacket transformed;
+    const RayPacket &packet = instance.identity() ? worldPacket : (transformed = PacketToObject(instance, worldPacket));
+    const Float4 *origin[3] = {&packet.origin.x, &packet.origin.y, &packet.origin.z};
+    const Float4 *direction[3] = {&packet.direction.x, &packet.direction.y, &packet.direction.z};
+
+    Float4 normalAxis(0.0f);
+    Float4 tMin(std::numeric_limits<float>::min());
+    Float4 tMax(std::numeric_limits<float>::max());
+    for (int axis = 0; axis < 3; axis++)
+    {
+        Float4 invD = Float4(1.0f) / *direction[axis];
+        Float4 t0 = (Float4(min[axis]) - *origin[axis]) * invD;
+        Float4 t1 = (Float4(max[axis]) - *origin[axis]) * invD;
+        Mask4 negative = invD < Float4(0.0f);
+        Float4 lower = Select(negative, t1, t0);
+        Float4 upper = Select(negative, t0, t1);
+        Mask4 further = lower > tMin;
+        tMin = Select(further, lower, tMin);
+        normalAxis = Select(further, Float4(static_cast<float>(axis)), normalAxis);
+        tMax = Min(tMax, upper);
+    }
 
-    Vec3 point = ray.at(tMin);
+    Mask4 valid = active & (tMin < tMax) & (tMin >= Float4(0.001f)) & (tMin < hits.parameter);
+    if (valid.none())
+        return;
+
+    hits.record(valid, tMin, 0);
+    for (int lane = 0; lane < PACKET_SIZE; lane++)
+        if (valid[lane]) hits.primitive[lane] = static_cast<uint32_t>(normalAxis[lane]);
+}
+
+Vec3 Cube::normal(const Vec3 &position, uint32_t primitive) const
+{
     Vec3 normal;
-    normal[normalAxis] = Sign((point - center)[normalAxis]);
-
-    HitRecord record;
-    record.parameter = tMin;
-    record.position = point;
-    record.normal = normal;
-    record.material = material;
-    return record;
+    normal[primitive] = Sign((instance.pointToObject(position) - center)[primitive]);
+    return instance.normalToWorld(normal);
 }
 
 void Cube::update()
 {
+    instance.place(position, rotation, scale, center);
 }
\ No newline at end of file
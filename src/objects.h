@@ -1,14 +1,23 @@
 #pragma once
 
-#include <optional>
 #include "renderer.h"
 
-class Sphere : public IObject {
+// A uniformly scaled sphere is still a sphere, so spheres need no instance
+// transform: the position and scale are the center and radius themselves,
+// and a rotation has no visible effect.
+class Sphere final : public IObject {
 public:
     Sphere();
     Sphere(const Vec3& c, float r);
-    std::optional<HitRecord> hit(const Ray& ray) const override;
-    Material& getMaterial() override { return material; }
+    bool hit(const Ray& ray, Hit& hit) const override;
+    void hit(const RayPacket& packet, Mask4 active, PacketHit& hits) const override;
+    bool occluded(const Ray& ray, float tMax) const override;
+    using IObject::occluded;
+    Vec3 normal(const Vec3& position, uint32_t primitive) const override;
+    AABB bounds() const override;
+    std::shared_ptr<IObject> clone() const override { return std::make_shared<Sphere>(*this); }
+    const Vec3& getCenter() const { return center; }
+    float getRadius() const       { return radius; }
     Vec3& getPosition() override { return center; }
     Vec3& getRotation() override { return rotation; }
     float& getScale() override { return radius; }
@@ -18,24 +27,35 @@ private:
     Vec3     center;
     Vec3     rotation;
     float    radius;
-    Material material;
 };
 
-class Cube : public IObject {
+// An axis-aligned box in object space, placed in the world by a position
+// (of its center), a rotation and a uniform scale.
+class Cube final : public IObject {
 public:
     Cube();
     Cube(const Vec3& min, const Vec3& max);
-    std::optional<HitRecord> hit(const Ray& ray) const override;
-    Material& getMaterial() override { return material; }
-    Vec3& getPosition() override { return min; }
-    Vec3& getRotation() override { return min; }
-    float& getScale() override { return radius; }
+    // The primitive of a hit is the object-space axis of the face that was entered.
+    bool hit(const Ray& ray, Hit& hit) const override;
+    void hit(const RayPacket& packet, Mask4 active, PacketHit& hits) const override;
+    bool occluded(const Ray& ray, float tMax) const override;
+    using IObject::occluded;
+    Vec3 normal(const Vec3& position, uint32_t primitive) const override;
+    AABB bounds() const override { return instance.boundsToWorld({min, max}); }
+    std::shared_ptr<IObject> clone() const override { return std::make_shared<Cube>(*this); }
+    const Vec3& getMin() const { return min; }
+    const Vec3& getMax() const { return max; }
+    Vec3& getPosition() override { return position; }
+    Vec3& getRotation() override { return rotation; }
+    float& getScale() override { return scale; }
     void update() override;
 
 private:
     Vec3 min;
     Vec3 max;
     Vec3 center;
-    float radius;
-    Material material;
+    Vec3 position;
+    Vec3 rotation;
+    float scale = 1.0f;
+    InstanceTransform instance;
 };
\ No newline at end of file
@@ -0,0 +1,219 @@
+#include "pch.h"
+#include "objloader.h"
+#include "mappedfile.h"
+#include <charconv>
+#include <thread>
+
+constexpr size_t MIN_CHUNK_SIZE = 4 << 20;
+
+namespace {
+
+// Result of one chunk. Negative indices refer to the vertices defined before
+// the face; they are stored relative to the start of the chunk and fixed up
+// once the number of vertices in the preceding chunks is known.
+struct Chunk {
+    std::vector<Vec3>     vertices;
+    std::vector<int>      faces;
+    std::vector<uint32_t> relative; // positions in faces holding chunk-relative indices
+    size_t                line = 0; // first line with an error, 0 if none
+    std::string           error;
+};
+
+class ChunkParser {
+public:
+    ChunkParser(const char* begin, const char* end, Chunk& chunk) : m_cursor(begin), m_end(end), m_chunk(chunk) {}
+
+    void parse() {
+        size_t line = 1;
+        while (m_cursor < m_end && m_chunk.error.empty()) {
+            const char* lineEnd = static_cast<const char*>(std::memchr(m_cursor, '\n', m_end - m_cursor));
+            if (!lineEnd)
+                lineEnd = m_end;
+            m_lineEnd = lineEnd;
+            parseLine();
+            if (!m_chunk.error.empty())
+                m_chunk.line = line;
+            m_cursor = lineEnd + 1;
+            line++;
+        }
+    }
+
+private:
+    void parseLine() {
+        skipSpaces();
+        if (m_cursor >= m_lineEnd)
+            return;
+        if (m_cursor[0] == 'v' && m_cursor + 1 < m_lineEnd && isSpace(m_cursor[1])) {
+            m_cursor++;
+            Vec3 vertex;
+            for (int axis = 0; axis < 3; axis++)
+                if (!readFloat(vertex[axis]))
+                    return fail("bad vertex");
+            m_chunk.vertices.push_back(vertex);
+        } else if (m_cursor[0] == 'f' && m_cursor + 1 < m_lineEnd && isSpace(m_cursor[1])) {
+            m_cursor++;
+            parseFace();
+        }
+        // vt, vn, groups, materials and comments carry nothing we render.
+    }
+
+    void parseFace() {
+        int first = 0, previous = 0, count = 0;
+        bool firstRelative = false, previousRelative = false;
+        while (true) {
+            skipSpaces();
+            if (m_cursor >= m_lineEnd || *m_cursor == '\r' || *m_cursor == '#')
+                break;
+
+            int index;
+            auto result = std::from_chars(m_cursor, m_lineEnd, index);
+            if (result.ec != std::errc() || index == 0)
+                return fail("bad face index");
+            m_cursor = result.ptr;
+            // Texture and normal indices are not used.
+            while (m_cursor < m_lineEnd && !isSpace(*m_cursor))
+                m_cursor++;
+
+            bool relative = index < 0;
+            index = relative ? static_cast<int>(m_chunk.vertices.size()) + index : index - 1;
+            if (count == 0) {
+                first = index;
+                firstRelative = relative;
+            } else if (count >= 2) {
+                push(first, firstRelative);
+                push(previous, previousRelative);
+                push(index, relative);
+            }
+            previous = index;
+            previousRelative = relative;
+            count++;
+        }
+        if (count < 3)
+            fail("face with fewer than three vertices");
+    }
+
+    void push(int index, bool relative) {
+        if (relative)
+            m_chunk.relative.push_back(static_cast<uint32_t>(m_chunk.faces.size()));
+        m_chunk.faces.push_back(index);
+    }
+
+    bool readFloat(float& value) {
+        skipSpaces();
+        // from_chars rejects an explicit plus sign.
+        if (m_cursor < m_lineEnd && *m_cursor == '+')
+            m_cursor++;
+        auto result = std::from_chars(m_cursor, m_lineEnd, value);
+        if (result.ec != std::errc())
+            return false;
+        m_cursor = result.ptr;
+        return true;
+    }
+
+    static bool isSpace(char c) { return c == ' ' || c == '\t'; }
+
+    void skipSpaces() {
+        while (m_cursor < m_lineEnd && isSpace(*m_cursor))
+            m_cursor++;
+    }
+
+    void fail(const char* message) { m_chunk.error = message; }
+
+private:
+    const char* m_cursor;
+    const char* m_lineEnd = nullptr;
+    const char* m_end;
+    Chunk&      m_chunk;
+};
+
+} // namespace
+
+ObjMesh LoadObj(const std::string& filename, int threads) {
+    MappedFile file(filename);
+    return ParseObj(file.data(), file.size(), filename, threads);
+}
+
+ObjMesh ParseObj(const char* data, size_t size, const std::string& filename, int threads) {
+    const char* begin = data;
+    const char* end = begin + size;
+
+    if (threads <= 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t count = std::clamp<size_t>(size / MIN_CHUNK_SIZE, 1, threads);
+
+    // Chunk boundaries are moved forward to the next line start.
+    std::vector<const char*> bounds = {begin};
+    for (size_t i = 1; i < count; i++) {
+        const char* split = std::max(bounds.back(), begin + size * i / count);
+        const char* newline = static_cast<const char*>(std::memchr(split, '\n', end - split));
+        bounds.push_back(newline ? newline + 1 : end);
+    }
+    bounds.push_back(end);
+
+    std::vector<Chunk> chunks(count);
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < count; i++)
+        workers.emplace_back([&, i]() { ChunkParser(bounds[i], bounds[i + 1], chunks[i]).parse(); });
+    ChunkParser(bounds[0], bounds[1], chunks[0]).parse();
+    for (auto& worker : workers)
+        worker.join();
+
+    for (size_t i = 0; i < count; i++) {
+        if (!chunks[i].error.empty()) {
+            size_t line = chunks[i].line + std::count(begin, bounds[i], '\n');
+            throw std::runtime_error(filename + ":" + std::to_string(line) + ": " + chunks[i].error);
+        }
+    }
+
+    ObjMesh mesh;
+    size_t vertices = 0, faces = 0;
+    for (const Chunk& chunk : chunks) {
+        vertices += chunk.vertices.size();
+        faces += chunk.faces.size();
+    }
+    mesh.vertices.reserve(vertices);
+    mesh.faces.reserve(faces);
+    for (Chunk& chunk : chunks) {
+        int base = static_cast<int>(mesh.vertices.size());
+        size_t offset = mesh.faces.size();
+        mesh.vertices.insert(mesh.vertices.end(), chunk.vertices.begin(), chunk.vertices.end());
+        mesh.faces.insert(mesh.faces.end(), chunk.faces.begin(), chunk.faces.end());
+        for (uint32_t position : chunk.relative)
+            mesh.faces[offset + position] += base;
+        chunk = Chunk();
+    }
+
+    for (int index : mesh.faces)
+        if (index < 0 || index >= static_cast<int>(mesh.vertices.size()))
+            throw std::runtime_error(filename + ": vertex index out of range");
+    return mesh;
+}
+
+ObjMesh LoadObjLegacy(const std::string& filename) {
+    std::ifstream in(filename);
+    if (!in.is_open())
+        throw std::runtime_error("Cannot open model");
+
+    ObjMesh mesh;
+    std::string line;
+    while (!in.eof()) {
+        std::getline(in, line);
+        std::istringstream iss(line.c_str());
+        char trash;
+        if (!line.compare(0, 2, "v ")) {
+            Vec3 v;
+            iss >> trash >> v.x >> v.y >> v.z;
+            mesh.vertices.push_back(v);
+        } else if (!line.compare(0, 2, "f ")) {
+            iss >> trash;
+            int vertex;
+            int count = 0;
+            while (iss >> vertex) {
+                mesh.faces.push_back(vertex - 1);
+                count++;
+            }
+            if (count != 3) throw std::runtime_error("Not triangulated model");
+        }
+    }
+    return mesh;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "geometry.h"
+
+// Vertex positions and triangles of a Wavefront OBJ file. Texture coordinates
+// and normals are skipped, polygons are split into triangle fans.
+struct ObjMesh {
+    std::vector<Vec3> vertices;
+    std::vector<int>  faces; // three zero-based vertex indices per triangle
+};
+
+// Memory-maps the file and parses it with std::from_chars. Files larger than
+// a few megabytes are split at line boundaries and parsed on several threads
+// (0 = all hardware threads). Accepts v, v/vt, v//vn and v/vt/vn face
+// vertices and negative (relative) indices.
+ObjMesh LoadObj(const std::string& filename, int threads = 0);
+
+// Parses OBJ text that is already in memory; filename only labels errors.
+ObjMesh ParseObj(const char* data, size_t size, const std::string& filename, int threads = 0);
+
+// The original getline/istringstream parser, kept as a reference for
+// benchmarks. Only understands triangles with plain vertex indices.
+ObjMesh LoadObjLegacy(const std::string& filename);
@@ -0,0 +1,272 @@
+#pragma once
+
+#include <bit>
+#include <cmath>
+#include <limits>
+#include "geometry.h"
+
+// The backend follows the instruction set of the build (RAYTRACING_SIMD in
+// CMakeLists.txt): plain arrays, SSE2, or SSE2 with the SSE4.1 blend. AVX2
+// builds use the SSE4.1 path here; their 8-wide kernels live in wide.h.
+#if !defined(RAYTRACING_NO_SIMD) && \
+    (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define RAYTRACING_SSE 1
+#include <emmintrin.h>
+#ifdef __SSE4_1__
+#include <smmintrin.h>
+#endif
+#endif
+
+constexpr int PACKET_SIZE = 4;
+
+struct Mask4;
+
+// Four float lanes: SSE registers when the target has them, plain arrays
+// otherwise. Both variants round exactly like the scalar code.
+struct Float4 {
+#ifdef RAYTRACING_SSE
+    __m128 v;
+
+    Float4() : v(_mm_setzero_ps()) {}
+    explicit Float4(float value) : v(_mm_set1_ps(value)) {}
+    Float4(float a, float b, float c, float d) : v(_mm_setr_ps(a, b, c, d)) {}
+    explicit Float4(__m128 value) : v(value) {}
+
+    static Float4 load(const float* aligned) { return Float4(_mm_load_ps(aligned)); }
+    void store(float* aligned) const { _mm_store_ps(aligned, v); }
+
+    float operator[](int i) const {
+        alignas(16) float lanes[4];
+        _mm_store_ps(lanes, v);
+        return lanes[i];
+    }
+#else
+    float v[4];
+
+    Float4() : v{0.0f, 0.0f, 0.0f, 0.0f} {}
+    explicit Float4(float value) : v{value, value, value, value} {}
+    Float4(float a, float b, float c, float d) : v{a, b, c, d} {}
+
+    static Float4 load(const float* aligned) { return Float4(aligned[0], aligned[1], aligned[2], aligned[3]); }
+    void store(float* aligned) const { for (int i = 0; i < 4; i++) aligned[i] = v[i]; }
+
+    float operator[](int i) const { return v[i]; }
+#endif
+};
+
+struct Mask4 {
+#ifdef RAYTRACING_SSE
+    __m128 v;
+
+    explicit Mask4(bool value = false) : v(_mm_castsi128_ps(_mm_set1_epi32(value ? -1 : 0))) {}
+    Mask4(bool a, bool b, bool c, bool d)
+        : v(_mm_castsi128_ps(_mm_setr_epi32(a ? -1 : 0, b ? -1 : 0, c ? -1 : 0, d ? -1 : 0))) {}
+    explicit Mask4(__m128 value) : v(value) {}
+
+    int bits() const { return _mm_movemask_ps(v); }
+#else
+    bool v[4];
+
+    explicit Mask4(bool value = false) : v{value, value, value, value} {}
+    Mask4(bool a, bool b, bool c, bool d) : v{a, b, c, d} {}
+
+    int bits() const { return v[0] | (v[1] << 1) | (v[2] << 2) | (v[3] << 3); }
+#endif
+
+    bool operator[](int i) const { return (bits() >> i) & 1; }
+    bool any() const { return bits() != 0; }
+    bool all() const { return bits() == 0xf; }
+    bool none() const { return bits() == 0; }
+    int count() const { return std::popcount(static_cast<unsigned>(bits())); }
+};
+
+#ifdef RAYTRACING_SSE
+
+inline Float4 operator+(const Float4& a, const Float4& b) { return Float4(_mm_add_ps(a.v, b.v)); }
+inline Float4 operator-(const Float4& a, const Float4& b) { return Float4(_mm_sub_ps(a.v, b.v)); }
+inline Float4 operator*(const Float4& a, const Float4& b) { return Float4(_mm_mul_ps(a.v, b.v)); }
+inline Float4 operator/(const Float4& a, const Float4& b) { return Float4(_mm_div_ps(a.v, b.v)); }
+inline Float4 operator-(const Float4& a) { return Float4(_mm_xor_ps(a.v, _mm_set1_ps(-0.0f))); }
+inline Float4 Sqrt(const Float4& a) { return Float4(_mm_sqrt_ps(a.v)); }
+inline Float4 Abs(const Float4& a) { return Float4(_mm_andnot_ps(_mm_set1_ps(-0.0f), a.v)); }
+
+inline Mask4 operator<(const Float4& a, const Float4& b)  { return Mask4(_mm_cmplt_ps(a.v, b.v)); }
+inline Mask4 operator<=(const Float4& a, const Float4& b) { return Mask4(_mm_cmple_ps(a.v, b.v)); }
+inline Mask4 operator>(const Float4& a, const Float4& b)  { return Mask4(_mm_cmpgt_ps(a.v, b.v)); }
+inline Mask4 operator>=(const Float4& a, const Float4& b) { return Mask4(_mm_cmpge_ps(a.v, b.v)); }
+inline Mask4 operator==(const Float4& a, const Float4& b) { return Mask4(_mm_cmpeq_ps(a.v, b.v)); }
+
+inline Mask4 operator&(const Mask4& a, const Mask4& b) { return Mask4(_mm_and_ps(a.v, b.v)); }
+inline Mask4 operator|(const Mask4& a, const Mask4& b) { return Mask4(_mm_or_ps(a.v, b.v)); }
+inline Mask4 operator!(const Mask4& a) { return Mask4(_mm_xor_ps(a.v, _mm_castsi128_ps(_mm_set1_epi32(-1)))); }
+
+// mask ? a : b, lane by lane.
+inline Float4 Select(const Mask4& mask, const Float4& a, const Float4& b) {
+#ifdef __SSE4_1__
+    return Float4(_mm_blendv_ps(b.v, a.v, mask.v));
+#else
+    return Float4(_mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v)));
+#endif
+}
+
+// minps and maxps return their second operand in unordered lanes, so NaN
+// lanes behave like std::min/std::max with the same argument order.
+inline Float4 Min(const Float4& a, const Float4& b) { return Float4(_mm_min_ps(b.v, a.v)); }
+inline Float4 Max(const Float4& a, const Float4& b) { return Float4(_mm_max_ps(b.v, a.v)); }
+
+// Approximate 1 / a and 1 / sqrt(a): the 12-bit hardware estimate refined by
+// one Newton-Raphson step to about 22 bits. Not bit-exact with division, so
+// intersection code keeps using the exact operations; the rcp and rsqrt
+// kernels of raytrace-microbench measure their error and speed.
+inline Float4 Rcp(const Float4& a) {
+    __m128 estimate = _mm_rcp_ps(a.v);
+    return Float4(_mm_sub_ps(_mm_add_ps(estimate, estimate), _mm_mul_ps(_mm_mul_ps(estimate, estimate), a.v)));
+}
+
+inline Float4 Rsqrt(const Float4& a) {
+    __m128 estimate = _mm_rsqrt_ps(a.v);
+    __m128 square = _mm_mul_ps(_mm_mul_ps(a.v, estimate), estimate);
+    return Float4(_mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), estimate), _mm_sub_ps(_mm_set1_ps(3.0f), square)));
+}
+
+#else
+
+#define RAYTRACING_LANEWISE(expression) \
+    Float4 result;                      \
+    for (int i = 0; i < 4; i++)         \
+        result.v[i] = expression;       \
+    return result
+
+#define RAYTRACING_MASKWISE(expression) \
+    Mask4 result;                       \
+    for (int i = 0; i < 4; i++)         \
+        result.v[i] = expression;       \
+    return result
+
+inline Float4 operator+(const Float4& a, const Float4& b) { RAYTRACING_LANEWISE(a.v[i] + b.v[i]); }
+inline Float4 operator-(const Float4& a, const Float4& b) { RAYTRACING_LANEWISE(a.v[i] - b.v[i]); }
+inline Float4 operator*(const Float4& a, const Float4& b) { RAYTRACING_LANEWISE(a.v[i] * b.v[i]); }
+inline Float4 operator/(const Float4& a, const Float4& b) { RAYTRACING_LANEWISE(a.v[i] / b.v[i]); }
+inline Float4 operator-(const Float4& a) { RAYTRACING_LANEWISE(-a.v[i]); }
+inline Float4 Sqrt(const Float4& a) { RAYTRACING_LANEWISE(std::sqrt(a.v[i])); }
+inline Float4 Abs(const Float4& a) { RAYTRACING_LANEWISE(std::abs(a.v[i])); }
+
+inline Mask4 operator<(const Float4& a, const Float4& b)  { RAYTRACING_MASKWISE(a.v[i] < b.v[i]); }
+inline Mask4 operator<=(const Float4& a, const Float4& b) { RAYTRACING_MASKWISE(a.v[i] <= b.v[i]); }
+inline Mask4 operator>(const Float4& a, const Float4& b)  { RAYTRACING_MASKWISE(a.v[i] > b.v[i]); }
+inline Mask4 operator>=(const Float4& a, const Float4& b) { RAYTRACING_MASKWISE(a.v[i] >= b.v[i]); }
+inline Mask4 operator==(const Float4& a, const Float4& b) { RAYTRACING_MASKWISE(a.v[i] == b.v[i]); }
+
+inline Mask4 operator&(const Mask4& a, const Mask4& b) { RAYTRACING_MASKWISE(a.v[i] && b.v[i]); }
+inline Mask4 operator|(const Mask4& a, const Mask4& b) { RAYTRACING_MASKWISE(a.v[i] || b.v[i]); }
+inline Mask4 operator!(const Mask4& a) { RAYTRACING_MASKWISE(!a.v[i]); }
+
+inline Float4 Select(const Mask4& mask, const Float4& a, const Float4& b) {
+    RAYTRACING_LANEWISE(mask.v[i] ? a.v[i] : b.v[i]);
+}
+
+// Same NaN behaviour as std::min/std::max with the same argument order.
+inline Float4 Min(const Float4& a, const Float4& b) { RAYTRACING_LANEWISE(b.v[i] < a.v[i] ? b.v[i] : a.v[i]); }
+inline Float4 Max(const Float4& a, const Float4& b) { RAYTRACING_LANEWISE(a.v[i] < b.v[i] ? b.v[i] : a.v[i]); }
+
+// Exact here: the portable build has no estimate to refine.
+inline Float4 Rcp(const Float4& a) { RAYTRACING_LANEWISE(1.0f / a.v[i]); }
+inline Float4 Rsqrt(const Float4& a) { RAYTRACING_LANEWISE(1.0f / std::sqrt(a.v[i])); }
+
+#undef RAYTRACING_LANEWISE
+#undef RAYTRACING_MASKWISE
+
+#endif
+
+inline Float4 Sign(const Float4& a) {
+    return Select(a < Float4(0.0f), Float4(-1.0f), Select(a > Float4(0.0f), Float4(1.0f), Float4(0.0f)));
+}
+
+struct Vec3x4 {
+    Float4 x;
+    Float4 y;
+    Float4 z;
+
+    Vec3x4() = default;
+    Vec3x4(const Float4& X, const Float4& Y, const Float4& Z) : x(X), y(Y), z(Z) {}
+    explicit Vec3x4(const Vec3& v) : x(v.x), y(v.y), z(v.z) {}
+};
+
+inline Vec3x4 operator+(const Vec3x4& a, const Vec3x4& b) { return {a.x + b.x, a.y + b.y, a.z + b.z}; }
+inline Vec3x4 operator-(const Vec3x4& a, const Vec3x4& b) { return {a.x - b.x, a.y - b.y, a.z - b.z}; }
+inline Vec3x4 operator*(const Float4& t, const Vec3x4& a) { return {t * a.x, t * a.y, t * a.z}; }
+
+inline Float4 Dot(const Vec3x4& a, const Vec3x4& b) {
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+inline Vec3x4 Cross(const Vec3x4& a, const Vec3x4& b) {
+    return {a.y * b.z - a.z * b.y,
+            a.z * b.x - a.x * b.z,
+            a.x * b.y - a.y * b.x};
+}
+
+inline Vec3x4 Select(const Mask4& mask, const Vec3x4& a, const Vec3x4& b) {
+    return {Select(mask, a.x, b.x), Select(mask, a.y, b.y), Select(mask, a.z, b.z)};
+}
+
+// Up to four rays in structure-of-arrays form. Lanes outside the active mask
+// passed along with the packet carry a copy of a valid ray.
+struct RayPacket {
+    Vec3x4 origin;
+    Vec3x4 direction;
+
+    RayPacket() = default;
+    explicit RayPacket(const Ray (&rays)[PACKET_SIZE]);
+
+    Ray ray(int lane) const {
+        return {Vec3(origin.x[lane], origin.y[lane], origin.z[lane]),
+                Vec3(direction.x[lane], direction.y[lane], direction.z[lane])};
+    }
+    Vec3x4 at(const Float4& t) const { return origin + t * direction; }
+};
+
+inline RayPacket::RayPacket(const Ray (&rays)[PACKET_SIZE]) {
+    origin = {Float4(rays[0].origin.x, rays[1].origin.x, rays[2].origin.x, rays[3].origin.x),
+              Float4(rays[0].origin.y, rays[1].origin.y, rays[2].origin.y, rays[3].origin.y),
+              Float4(rays[0].origin.z, rays[1].origin.z, rays[2].origin.z, rays[3].origin.z)};
+    direction = {Float4(rays[0].direction.x, rays[1].direction.x, rays[2].direction.x, rays[3].direction.x),
+                 Float4(rays[0].direction.y, rays[1].direction.y, rays[2].direction.y, rays[3].direction.y),
+                 Float4(rays[0].direction.z, rays[1].direction.z, rays[2].direction.z, rays[3].direction.z)};
+}
+
+// The packet in the object space of an instance, like InstanceTransform::rayToObject.
+inline RayPacket PacketToObject(const InstanceTransform& instance, const RayPacket& packet) {
+    const Transform& m = instance.toObject();
+    auto linear = [&](const Vec3x4& v, int row) {
+        return Float4(m(row, 0)) * v.x + Float4(m(row, 1)) * v.y + Float4(m(row, 2)) * v.z;
+    };
+    RayPacket result;
+    result.origin = {linear(packet.origin, 0) + Float4(m(0, 3)), linear(packet.origin, 1) + Float4(m(1, 3)),
+                     linear(packet.origin, 2) + Float4(m(2, 3))};
+    result.direction = {linear(packet.direction, 0), linear(packet.direction, 1), linear(packet.direction, 2)};
+    return result;
+}
+
+// Slab test of four rays against one box; tEntry receives the entry distances.
+inline Mask4 HitAABB(const AABB& box, const RayPacket& packet, const Vec3x4& invDirection,
+                     const Float4& tMax, Float4& tEntry) {
+    Float4 tNear(0.0f);
+    Float4 tFar = tMax;
+    const Float4 boxMin[3] = {Float4(box.min().x), Float4(box.min().y), Float4(box.min().z)};
+    const Float4 boxMax[3] = {Float4(box.max().x), Float4(box.max().y), Float4(box.max().z)};
+    const Float4* origin[3] = {&packet.origin.x, &packet.origin.y, &packet.origin.z};
+    const Float4* inverse[3] = {&invDirection.x, &invDirection.y, &invDirection.z};
+    for (int axis = 0; axis < 3; axis++) {
+        Float4 t0 = (boxMin[axis] - *origin[axis]) * *inverse[axis];
+        Float4 t1 = (boxMax[axis] - *origin[axis]) * *inverse[axis];
+        Mask4 negative = *inverse[axis] < Float4(0.0f);
+        Float4 lower = Select(negative, t1, t0);
+        Float4 upper = Select(negative, t0, t1);
+        // Same NaN handling as AABB::hit: a NaN slab leaves the interval alone.
+        tNear = Select(lower > tNear, lower, tNear);
+        tFar = Select(upper < tFar, upper, tFar);
+    }
+    tEntry = tNear;
+    return !(tFar < tNear);
+}
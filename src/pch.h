@@ -10,9 +10,7 @@
 #include <optional>
 #include <memory>
 #include <cstring>
-
-#include <glad/glad.h>
-#include <GLFW/glfw3.h>
-#include <imgui.h>
-#include <backends/imgui_impl_glfw.h>
-#include <backends/imgui_impl_opengl3.h>
+#include <cassert>
+#include <string>
+#include <stdexcept>
+#include <algorithm>
@@ -0,0 +1,97 @@
+#include "pch.h"
+#include "progressive.h"
+#include <chrono>
+#include <utility>
+
+struct Pass {
+    int stride;
+    int depth;
+};
+
+ProgressiveRenderer::ProgressiveRenderer(int width, int height, int threads)
+    : m_scheduler(threads), m_back(width, height), m_front(width, height) {
+    m_thread = std::thread(&ProgressiveRenderer::threadLoop, this);
+}
+
+ProgressiveRenderer::~ProgressiveRenderer() noexcept {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+        m_cancel = true;
+    }
+    m_wake.notify_all();
+    m_thread.join();
+}
+
+void ProgressiveRenderer::start(Scene scene, const Camera& camera, const RenderSettings& settings) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_pending = Job{std::move(scene), camera, settings};
+        m_cancel = true;
+        m_busy = true;
+    }
+    m_wake.notify_all();
+}
+
+bool ProgressiveRenderer::present(Framebuffer& display) {
+    std::lock_guard<std::mutex> lock(m_frontMutex);
+    if (!m_frontChanged)
+        return false;
+    display.copyRegion(m_front, 0, 0, m_front.width(), m_front.height());
+    m_frontChanged = false;
+    return true;
+}
+
+std::optional<ProgressiveRenderer::FrameStats> ProgressiveRenderer::takeFrameStats() {
+    std::lock_guard<std::mutex> lock(m_frontMutex);
+    return std::exchange(m_frameStats, std::nullopt);
+}
+
+void ProgressiveRenderer::threadLoop() {
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wake.wait(lock, [this]() { return m_stop || m_pending; });
+            if (m_stop)
+                return;
+            job = std::move(*m_pending);
+            m_pending.reset();
+            m_cancel = false;
+        }
+
+        render(job);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_pending)
+            m_busy = false;
+    }
+}
+
+void ProgressiveRenderer::render(const Job& job) {
+    const Pass passes[] = {{8, 1}, {4, job.settings.depth}, {1, job.settings.depth}};
+
+    RenderStats stats;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (const Pass& pass : passes) {
+        RenderSettings settings = job.settings;
+        settings.stride = pass.stride;
+        settings.depth = std::min(pass.depth, job.settings.depth);
+        settings.cancel = &m_cancel;
+        settings.gbuffer = &m_gbuffer;
+        settings.onTile = [this](const Tile& tile) {
+            std::lock_guard<std::mutex> lock(m_frontMutex);
+            m_front.copyRegion(m_back, tile.x0, tile.y0, tile.x1, tile.y1);
+            m_frontChanged = true;
+        };
+
+        start = std::chrono::high_resolution_clock::now();
+        stats = Render(m_scheduler, &m_back, job.camera, job.scene, settings);
+        if (m_cancel)
+            return;
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    std::lock_guard<std::mutex> lock(m_frontMutex);
+    m_frameStats = FrameStats{stats, std::chrono::duration<double, std::milli>(end - start).count()};
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include "framebuffer.h"
+#include "renderer.h"
+#include "scene.h"
+#include "scheduler.h"
+
+// Renders on a background thread from coarse to fine: a 1/8 resolution
+// preview at depth 1, then 1/4 resolution and finally every pixel, both at
+// the requested depth. Tiles are published as soon as they finish, and a
+// newer start() abandons the frame in progress at tile granularity. Primary
+// hits are kept between frames, so edits that leave the camera and the
+// geometry alone skip primary intersection.
+class ProgressiveRenderer {
+public:
+    // The full-resolution pass of a finished frame, comparable to a blocking
+    // Render() of the same settings.
+    struct FrameStats {
+        RenderStats stats;
+        double      milliseconds = 0.0;
+    };
+
+    ProgressiveRenderer(int width, int height, int threads = 0);
+    ProgressiveRenderer(const ProgressiveRenderer& other) = delete;
+    ProgressiveRenderer& operator=(const ProgressiveRenderer& other) = delete;
+    ~ProgressiveRenderer() noexcept;
+
+    // The scene must not be shared with the caller, see Scene::snapshot().
+    void start(Scene scene, const Camera& camera, const RenderSettings& settings);
+
+    // Copies the published linear image into display if it changed since the
+    // last call; the caller resolves it for display.
+    bool present(Framebuffer& display);
+
+    // Statistics of the last frame finished since the previous call.
+    std::optional<FrameStats> takeFrameStats();
+
+    bool busy() const { return m_busy; }
+
+private:
+    struct Job {
+        Scene          scene;
+        Camera         camera;
+        RenderSettings settings;
+    };
+
+    void threadLoop();
+    void render(const Job& job);
+
+private:
+    TileScheduler           m_scheduler;
+    GBuffer                 m_gbuffer; // only touched by the render thread
+    Framebuffer             m_back;
+    Framebuffer             m_front;
+    std::mutex              m_frontMutex;
+    bool                    m_frontChanged = false;
+    std::optional<FrameStats> m_frameStats; // guarded by m_frontMutex
+    std::mutex              m_mutex;
+    std::condition_variable m_wake;
+    std::optional<Job>      m_pending;
+    std::atomic<bool>       m_cancel{false};
+    std::atomic<bool>       m_busy{false};
+    bool                    m_stop = false;
+    std::thread             m_thread;
+};
@@ -1,6 +1,8 @@
 #include "pch.h"
 #include "renderer.h"
+#include "scene.h"
 #include "geometry.h"
+#include "scheduler.h"
 
 Camera::Camera(const Vec3 &eye, const Vec3 &lookat, float fov, float aspect)
 {
@@ -17,6 +19,13 @@ Ray Camera::generateRay(float s, float t) const
     return {m_eye, point - m_eye};
 }
 
+bool Camera::operator==(const Camera &other) const
+{
+    auto same = [](const Vec3 &a, const Vec3 &b) { return a.x == b.x && a.y == b.y && a.z == b.z; };
+    return same(m_eye, other.m_eye) && same(m_corner, other.m_corner) &&
+           same(m_horizontal, other.m_horizontal) && same(m_vertical, other.m_vertical);
+}
+
 void Camera::update()
 {
     Vec3 n = Normalize(m_eye - m_lookAt);
@@ -32,38 +41,55 @@ void Camera::update()
     m_corner = m_eye - m_horizontal / 2.f - m_vertical / 2.f - n;
 }
 
-std::optional<HitRecord> Scene::hit(const Ray &ray) const
+void IObject::hit(const RayPacket &packet, Mask4 active, PacketHit &hits) const
 {
-    std::optional<HitRecord> result = std::nullopt;
-    float minT = std::numeric_limits<float>::max();
-
-    if (m_showPlane && std::abs(ray.direction.y) > 0.001f)
+    for (int lane = 0; lane < PACKET_SIZE; lane++)
     {
-        float t = -(ray.origin.y + 3.0f) / ray.direction.y;
-        Vec3 p = ray.origin + ray.direction * t;
-        if (t > 0.001f && t < minT)
+        if (!active[lane])
+            continue;
+        Hit laneHit;
+        laneHit.t = hits.parameter[lane];
+        if (hit(packet.ray(lane), laneHit))
         {
-            HitRecord record;
-            record.position = p;
-            record.normal = Vec3(0.0f, 1.0f, 0.0f);
-            record.parameter = t;
-            record.material.diffuseAlbedo = 1.0f;
-            record.material.diffuse = Vec3(0.8, 0.8, 0.8);
-            result = record;
-            minT = t;
+            Mask4 only(lane == 0, lane == 1, lane == 2, lane == 3);
+            hits.record(only, Float4(laneHit.t), laneHit.primitive);
         }
     }
+}
 
-    for (const auto &object : m_objects)
-    {
-        auto record = object->hit(ray);
-        if (record && record->parameter < minT)
-        {
-            minT = record->parameter;
-            result = record;
-        }
-    }
-    return result;
+bool IObject::occluded(const Ray &ray, float tMax) const
+{
+    Hit closest;
+    closest.t = tMax;
+    return hit(ray, closest);
+}
+
+Mask4 IObject::occluded(const RayPacket &packet, Mask4 active, const Float4 &tMax) const
+{
+    bool blocked[PACKET_SIZE] = {};
+    for (int lane = 0; lane < PACKET_SIZE; lane++)
+        blocked[lane] = active[lane] && occluded(packet.ray(lane), tMax[lane]);
+    return Mask4(blocked[0], blocked[1], blocked[2], blocked[3]);
+}
+
+void GBuffer::prepare(int width, int height, const Camera &camera, uint64_t geometryVersion)
+{
+    if (width == m_width && height == m_height && camera == m_camera && geometryVersion == m_geometryVersion)
+        return;
+
+    m_width = width;
+    m_height = height;
+    m_camera = camera;
+    m_geometryVersion = geometryVersion;
+    m_records.resize(static_cast<size_t>(width) * height);
+    m_state.assign(static_cast<size_t>(width) * height, State::Unknown);
+}
+
+void IFramebuffer::writeTile(const Tile &tile, const float *rgb)
+{
+    for (int y = tile.y0; y < tile.y1; y++)
+        for (int x = tile.x0; x < tile.x1; x++, rgb += 3)
+            setPixel(x, y, Vec3(rgb[0], rgb[1], rgb[2]));
 }
 
 static Vec3 background(const Ray &ray)
@@ -73,51 +99,507 @@ static Vec3 background(const Ray &ray)
     return (1.f - t) * Vec3(1.f, 1.f, 1.f) + t * Vec3(0.5f, 0.7f, 1.f);
 }
 
-static Vec3 castRay(const Ray &ray, const Scene &scene, int depth)
+static Vec3 miss(const Ray &ray, const Scene &scene)
 {
+    return std::min(1.0f, 2 * scene.getAmbient()) * background(ray);
+}
+
+Lighting Illuminate(const Scene &scene, const HitRecord &record, const Vec3 &direction, float shininess,
+                    bool shadows, uint64_t &shadowRays, const uint64_t *hidden)
+{
+    float diffuse = scene.getAmbient();
+    float specular = 0.0f;
+    for (size_t i = 0; i < scene.lights().size(); i++)
+    {
+        const Vec3 &light = scene.lights()[i];
+        Vec3 source = Normalize(light - record.position);
+        if (shadows && hidden && i < SHADOW_PACKET_LIGHTS)
+        {
+            if ((*hidden >> i) & 1)
+                continue;
+        }
+        else if (shadows)
+        {
+            shadowRays++;
+            CountRay(TraceStats::RayKind::Shadow, 0);
+            if (scene.occluded(Ray(record.position, source), Length(light - record.position)))
+                continue;
+        }
+        diffuse += std::max(0.0f, Dot(source, record.normal));
+        Vec3 r = -Reflect(-source, record.normal);
+        specular += std::pow(std::max(0.0f, Dot(r, Normalize(direction))), shininess);
+    }
+    return {std::min(1.0f, diffuse), std::min(1.0f, specular)};
+}
+
+struct TraceContext
+{
+    const Scene &scene;
+    float minContribution;
+    bool shadows;
+    int depth; // of the frame, to tell the bounce of a ray from the depth left
+    RenderStats &stats;
+};
+
+static Vec3 castRay(const Ray &ray, const TraceContext &context, int depth, float weight, TraceStats::RayKind kind);
+
+// weight is the share of the pixel color carried by ray, so a secondary ray
+// adds at most weight * albedo to the pixel.
+static Vec3 shade(const Ray &ray, const HitRecord &record, const TraceContext &context, int depth, float weight,
+                  const uint64_t *hidden = nullptr)
+{
+    const Scene &scene = context.scene;
+    const Material &material = scene.material(record.material);
+    float reflectAlbedo = material.reflectAlbedo;
+    float refractAlbedo = material.refractAlbedo;
+    std::optional<Vec3> refractDir = Refract(ray.direction, record.normal, material.refractive);
+    if (!refractDir)
+    {
+        // Total internal reflection: the transmitted energy is reflected.
+        reflectAlbedo += refractAlbedo;
+        refractAlbedo = 0.0f;
+        context.stats.pruned++;
+    }
+
+    auto trace = [&](const Vec3 &direction, float albedo, TraceStats::RayKind kind) {
+        if (albedo <= 0.0f || weight * albedo < context.minContribution)
+        {
+            context.stats.pruned++;
+            return Vec3();
+        }
+        return castRay(Ray(record.position, direction), context, depth - 1, weight * albedo, kind);
+    };
+    Vec3 reflected = trace(Reflect(ray.direction, record.normal), reflectAlbedo, TraceStats::RayKind::Reflect);
+    Vec3 refracted = refractAlbedo > 0.0f ? trace(*refractDir, refractAlbedo, TraceStats::RayKind::Refract) : Vec3();
+
+    Lighting lighting = Illuminate(scene, record, ray.direction, material.shininess, context.shadows,
+                                   context.stats.shadowRays, hidden);
+    return material.diffuseAlbedo * material.diffuse * lighting.diffuse +
+           material.specularAlbedo * material.specular * lighting.specular +
+           reflectAlbedo * reflected +
+           refractAlbedo * refracted;
+}
+
+static Vec3 castRay(const Ray &ray, const TraceContext &context, int depth, float weight, TraceStats::RayKind kind)
+{
+    context.stats.rays++;
+    CountRay(kind, context.depth - depth);
     if (depth <= 0)
-        return std::min(1.0f, 2 * scene.getAmbient()) * background(ray);
+        return miss(ray, context.scene);
+
+    Hit hit;
+    if (context.scene.hit(ray, hit))
+        return shade(ray, context.scene.record(ray, hit), context, depth, weight);
+    return miss(ray, context.scene);
+}
+
+// Colors of the primary rays of a packet, from their first hits; lanes
+// without a record missed. The shadow rays of all lanes go out together, one
+// packet per light.
+static void shadePacket(const Ray (&rays)[PACKET_SIZE], const HitRecord *const (&records)[PACKET_SIZE],
+                        const TraceContext &context, int depth, Vec3 (&colors)[PACKET_SIZE])
+{
+    const Scene &scene = context.scene;
+    bool lit[PACKET_SIZE];
+    int first = -1;
+    for (int lane = 0; lane < PACKET_SIZE; lane++)
+    {
+        lit[lane] = records[lane] != nullptr;
+        if (lit[lane] && first < 0)
+            first = lane;
+    }
 
-    if (std::optional<HitRecord> record = scene.hit(ray))
+    uint64_t hidden[PACKET_SIZE] = {};
+    size_t lights = std::min(scene.lights().size(), SHADOW_PACKET_LIGHTS);
+    if (context.shadows && first >= 0)
     {
-        Material &material = record->material;
-        Vec3 reflectDir = Reflect(ray.direction, record->normal);
-        Vec3 refractDir = Refract(ray.direction, record->normal, material.refractive);
-        Vec3 reflected = castRay(Ray(record->position, reflectDir), scene, depth - 1);
-        Vec3 refracted = castRay(Ray(record->position, refractDir), scene, depth - 1);
-
-        float diffuse = scene.getAmbient();
-        float specular = 0.0f;
-        for (const Vec3 &light : scene.lights())
+        Mask4 active(lit[0], lit[1], lit[2], lit[3]);
+        for (size_t i = 0; i < lights; i++)
         {
-            Vec3 source = Normalize(light - record->position);
-            diffuse += std::max(0.0f, Dot(source, record->normal));
-            Vec3 r = -Reflect(-source, record->normal);
-            specular += std::pow(std::max(0.0f, Dot(r, Normalize(ray.direction))), material.shininess);
+            // Lanes without a hit repeat the ray of the first lane with one.
+            auto shadowRay = [&](int lane) {
+                const HitRecord &record = *records[lit[lane] ? lane : first];
+                return Ray(record.position, Normalize(scene.lights()[i] - record.position));
+            };
+            auto distance = [&](int lane) {
+                return Length(scene.lights()[i] - records[lit[lane] ? lane : first]->position);
+            };
+            Ray shadowRays[PACKET_SIZE] = {shadowRay(0), shadowRay(1), shadowRay(2), shadowRay(3)};
+            Float4 tMax(distance(0), distance(1), distance(2), distance(3));
+            for (int lane = 0; lane < PACKET_SIZE; lane++)
+            {
+                if (!lit[lane])
+                    continue;
+                context.stats.shadowRays++;
+                CountRay(TraceStats::RayKind::Shadow, 0);
+            }
+            Mask4 blocked = scene.occluded(RayPacket(shadowRays), active, tMax);
+            for (int lane = 0; lane < PACKET_SIZE; lane++)
+                if (blocked[lane])
+                    hidden[lane] |= uint64_t(1) << i;
         }
-        return material.diffuseAlbedo * material.diffuse * std::min(1.0f, diffuse) +
-               material.specularAlbedo * material.specular * std::min(1.0f, specular) +
-               material.reflectAlbedo * reflected +
-               material.refractAlbedo * refracted;
     }
-    return std::min(1.0f, 2 * scene.getAmbient()) * background(ray);
+
+    for (int lane = 0; lane < PACKET_SIZE; lane++)
+        colors[lane] = lit[lane] ? shade(rays[lane], *records[lane], context, depth, 1.0f, &hidden[lane])
+                                 : miss(rays[lane], scene);
+}
+
+// Colors of count primary rays added up, traced as packets of four when
+// enabled; the rays of one supersampled pixel stay coherent.
+static Vec3 traceSamples(const Ray *rays, int count, const TraceContext &context, int depth, bool packets)
+{
+    Vec3 sum;
+    if (!packets || depth <= 0)
+    {
+        for (int i = 0; i < count; i++)
+            sum += castRay(rays[i], context, depth, 1.0f, TraceStats::RayKind::Primary);
+        return sum;
+    }
+
+    for (int first = 0; first < count; first += PACKET_SIZE)
+    {
+        int lanes = std::min(PACKET_SIZE, count - first);
+        Ray laneRays[PACKET_SIZE] = {rays[first], rays[first], rays[first], rays[first]};
+        for (int lane = 1; lane < lanes; lane++)
+            laneRays[lane] = rays[first + lane];
+
+        RayPacket packet(laneRays);
+        PacketHit hits;
+        context.scene.hit(packet, Mask4(true, lanes > 1, lanes > 2, lanes > 3), hits);
+        HitRecord records[PACKET_SIZE];
+        const HitRecord *found[PACKET_SIZE] = {};
+        for (int lane = 0; lane < lanes; lane++)
+        {
+            context.stats.rays++;
+            CountRay(TraceStats::RayKind::Primary, 0);
+            Hit hit = hits.lane(lane);
+            if (hit.object != Hit::NONE)
+            {
+                records[lane] = context.scene.record(laneRays[lane], hit);
+                found[lane] = &records[lane];
+            }
+        }
+        Vec3 colors[PACKET_SIZE];
+        shadePacket(laneRays, found, context, depth, colors);
+        for (int lane = 0; lane < lanes; lane++)
+            sum += colors[lane];
+    }
+    return sum;
 }
 
-void Render(IFramebuffer *framebuffer, const Camera &camera, const Scene &scene, int depth)
+// Reproducible jitter in [0, 1) for a sample of a pixel.
+static float sampleJitter(uint32_t x, uint32_t y, uint32_t sample)
+{
+    uint32_t hash = x * 0x8da6b343u ^ y * 0xd8163841u ^ sample * 0xcb1ab31fu;
+    hash ^= hash >> 16;
+    hash *= 0x7feb352du;
+    hash ^= hash >> 15;
+    hash *= 0x846ca68bu;
+    hash ^= hash >> 16;
+    return (hash >> 8) * (1.0f / 16777216.0f);
+}
+
+struct alignas(64) WorkerStats
+{
+    RenderStats stats;
+};
+
+// Second pass of adaptive anti-aliasing over the base samples of a finished
+// frame: measures the contrast of every pixel to its neighbours, picks the
+// pixels to refine within the budget and re-traces them with a jittered
+// grid of samples.
+static void supersample(TileScheduler &scheduler, IFramebuffer *framebuffer, const Camera &camera,
+                        const Scene &scene, const RenderSettings &settings, const std::vector<Tile> &tiles,
+                        const std::vector<float> &base, std::vector<WorkerStats> &counters)
 {
     int width = framebuffer->width();
     int height = framebuffer->height();
+    int grid = static_cast<int>(std::sqrt(static_cast<float>(settings.maxSamples)));
+    int samples = grid * grid;
 
-#pragma omp parallel for num_threads(12)
-    for (int y = 0; y < height; y++)
+    // Differences are taken on colors clamped like the display clamps them.
+    std::vector<float> contrast(static_cast<size_t>(width) * height);
+    scheduler.run(static_cast<int>(tiles.size()), [&](int index, int) {
+        const Tile &tile = tiles[index];
+        auto difference = [&](size_t a, size_t b) {
+            float result = 0.0f;
+            for (int channel = 0; channel < 3; channel++)
+                result = std::max(result, std::abs(std::min(1.0f, base[a * 3 + channel]) -
+                                                   std::min(1.0f, base[b * 3 + channel])));
+            return result;
+        };
+        for (int y = tile.y0; y < tile.y1; y++)
+        {
+            for (int x = tile.x0; x < tile.x1; x++)
+            {
+                size_t pixel = static_cast<size_t>(y) * width + x;
+                float result = 0.0f;
+                if (x > 0)
+                    result = std::max(result, difference(pixel, pixel - 1));
+                if (x + 1 < width)
+                    result = std::max(result, difference(pixel, pixel + 1));
+                if (y > 0)
+                    result = std::max(result, difference(pixel, pixel - width));
+                if (y + 1 < height)
+                    result = std::max(result, difference(pixel, pixel + width));
+                contrast[pixel] = result;
+            }
+        }
+    });
+
+    std::vector<float> candidates;
+    for (float value : contrast)
+        if (value > settings.aaThreshold)
+            candidates.push_back(value);
+    size_t limit = static_cast<size_t>(std::max(0.0f, settings.aaBudget - 1.0f) * contrast.size() / samples);
+    float cutoff = settings.aaThreshold;
+    if (candidates.size() > limit)
     {
-        for (int x = 0; x < width; x++)
+        // Refine only the pixels above the (limit + 1)-th highest contrast.
+        auto nth = candidates.end() - limit - 1;
+        std::nth_element(candidates.begin(), nth, candidates.end());
+        cutoff = *nth;
+    }
+    if (candidates.empty() || limit == 0)
+        return;
+
+    std::vector<std::vector<float>> tileColors(scheduler.threads());
+    scheduler.run(static_cast<int>(tiles.size()), [&](int index, int worker) {
+        if (settings.cancel && settings.cancel->load(std::memory_order_relaxed))
+            return;
+
+        const Tile &tile = tiles[index];
+        bool refine = false;
+        for (int y = tile.y0; y < tile.y1 && !refine; y++)
+            for (int x = tile.x0; x < tile.x1 && !refine; x++)
+                refine = contrast[static_cast<size_t>(y) * width + x] > cutoff;
+        if (!refine)
+            return;
+
+        RenderStats stats;
+        TraceContext context{scene, settings.minContribution, settings.shadows, settings.depth, stats};
+        ThreadTraceStats() = {};
+        int tileWidth = tile.x1 - tile.x0;
+        std::vector<float> &colors = tileColors[worker];
+        colors.resize(static_cast<size_t>(tileWidth) * (tile.y1 - tile.y0) * 3);
+        std::vector<Ray> rays;
+        rays.reserve(samples);
+        for (int y = tile.y0; y < tile.y1; y++)
         {
+            for (int x = tile.x0; x < tile.x1; x++)
+            {
+                size_t pixel = static_cast<size_t>(y) * width + x;
+                float *color = &colors[((y - tile.y0) * tileWidth + x - tile.x0) * 3];
+                std::copy_n(&base[pixel * 3], 3, color);
+                if (contrast[pixel] <= cutoff)
+                    continue;
+
+                // One jittered sample per cell of a grid x grid subdivision
+                // of the pixel around its base sample.
+                rays.clear();
+                for (int sample = 0; sample < samples; sample++)
+                {
+                    float dx = (sample % grid + sampleJitter(x, y, 2 * sample)) / grid - 0.5f;
+                    float dy = (sample / grid + sampleJitter(x, y, 2 * sample + 1)) / grid - 0.5f;
+                    rays.push_back(camera.generateRay((x + dx) / (width - 1), (y + dy) / (height - 1)));
+                }
+                Vec3 sum = traceSamples(rays.data(), samples, context, settings.depth, settings.packets);
+                stats.samples += samples;
+                color[0] = sum.x / samples;
+                color[1] = sum.y / samples;
+                color[2] = sum.z / samples;
+            }
+        }
+        framebuffer->writeTile(tile, colors.data());
+        stats.trace += ThreadTraceStats();
+        counters[worker].stats += stats;
+        if (settings.onTile)
+            settings.onTile(tile);
+    });
+}
+
+RenderStats Render(TileScheduler &scheduler, IFramebuffer *framebuffer, const Camera &camera,
+                   const Scene &scene, const RenderSettings &settings)
+{
+    int width = framebuffer->width();
+    int height = framebuffer->height();
+    std::vector<Tile> tiles = MakeTiles(width, height, settings.tileSize);
+    bool partial = settings.lastTile >= 0;
+    if (partial)
+    {
+        int last = std::min(settings.lastTile, static_cast<int>(tiles.size()));
+        int first = std::clamp(settings.firstTile, 0, last);
+        tiles = std::vector<Tile>(tiles.begin() + first, tiles.begin() + last);
+    }
+
+    std::vector<WorkerStats> counters(scheduler.threads());
+    std::vector<std::vector<float>> tileColors(scheduler.threads());
+
+    // Base samples of the whole frame, kept when the frame is supersampled.
+    int stride = std::max(1, settings.stride);
+    bool adaptive = settings.maxSamples >= 4 && stride == 1 && !partial;
+    std::vector<float> base(adaptive ? static_cast<size_t>(width) * height * 3 : 0);
+
+    // Rays of depth 0 never intersect anything, so there is nothing to cache.
+    GBuffer *gbuffer = settings.depth > 0 ? settings.gbuffer : nullptr;
+    if (gbuffer)
+        gbuffer->prepare(width, height, camera, scene.geometryVersion());
+
+    scheduler.run(static_cast<int>(tiles.size()), [&](int index, int worker) {
+        if (settings.cancel && settings.cancel->load(std::memory_order_relaxed))
+            return;
+
+        const Tile &tile = tiles[index];
+        RenderStats stats;
+        TraceContext context{scene, settings.minContribution, settings.shadows, settings.depth, stats};
+        ThreadTraceStats() = {};
+        int tileWidth = tile.x1 - tile.x0;
+        std::vector<float> &colors = tileColors[worker];
+        colors.resize(static_cast<size_t>(tileWidth) * (tile.y1 - tile.y0) * 3);
+        auto fill = [&](int x, int y, const Vec3 &color) {
+            stats.samples++;
+            for (int blockY = y; blockY < std::min(y + stride, tile.y1); blockY++)
+            {
+                for (int blockX = x; blockX < std::min(x + stride, tile.x1); blockX++)
+                {
+                    float *pixel = &colors[((blockY - tile.y0) * tileWidth + blockX - tile.x0) * 3];
+                    pixel[0] = color.x;
+                    pixel[1] = color.y;
+                    pixel[2] = color.z;
+                }
+            }
+        };
+        auto primaryRay = [&](int x, int y) {
             float s = (float)x / (width - 1);
             float t = (float)y / (height - 1);
+            return camera.generateRay(s, t);
+        };
 
-            Ray ray = camera.generateRay(s, t);
-            framebuffer->setPixel(x, y, castRay(ray, scene, depth));
+        auto shadeStored = [&](int x, int y, const Ray &ray) {
+            const HitRecord *record = gbuffer->lookup(x, y);
+            return record ? shade(ray, *record, context, settings.depth, 1.0f) : miss(ray, scene);
+        };
+
+        if (!settings.packets || settings.depth <= 0)
+        {
+            for (int y = tile.y0; y < tile.y1; y += stride)
+            {
+                for (int x = tile.x0; x < tile.x1; x += stride)
+                {
+                    Ray ray = primaryRay(x, y);
+                    if (!gbuffer)
+                    {
+                        fill(x, y, castRay(ray, context, settings.depth, 1.0f, TraceStats::RayKind::Primary));
+                        continue;
+                    }
+                    if (gbuffer->known(x, y))
+                    {
+                        stats.cached++;
+                    }
+                    else
+                    {
+                        stats.rays++;
+                        CountRay(TraceStats::RayKind::Primary, 0);
+                        Hit hit;
+                        if (scene.hit(ray, hit))
+                            gbuffer->storeHit(x, y, scene.record(ray, hit));
+                        else
+                            gbuffer->storeMiss(x, y);
+                    }
+                    fill(x, y, shadeStored(x, y, ray));
+                }
+            }
         }
-    }
+        else
+        {
+            // 2x2 quads of primary rays and of their shadow rays; the
+            // secondary rays of every lane are traced one by one since they
+            // no longer stay coherent.
+            for (int y = tile.y0; y < tile.y1; y += 2 * stride)
+            {
+                for (int x = tile.x0; x < tile.x1; x += 2 * stride)
+                {
+                    int laneX[PACKET_SIZE], laneY[PACKET_SIZE];
+                    bool inside[PACKET_SIZE];
+                    Ray laneRays[PACKET_SIZE] = {primaryRay(x, y), primaryRay(x, y), primaryRay(x, y), primaryRay(x, y)};
+                    for (int lane = 0; lane < PACKET_SIZE; lane++)
+                    {
+                        laneX[lane] = x + (lane & 1) * stride;
+                        laneY[lane] = y + (lane >> 1) * stride;
+                        inside[lane] = laneX[lane] < tile.x1 && laneY[lane] < tile.y1;
+                        if (inside[lane] && lane > 0)
+                            laneRays[lane] = primaryRay(laneX[lane], laneY[lane]);
+                    }
+
+                    bool cached = gbuffer != nullptr;
+                    for (int lane = 0; lane < PACKET_SIZE && cached; lane++)
+                        cached = !inside[lane] || gbuffer->known(laneX[lane], laneY[lane]);
+
+                    HitRecord records[PACKET_SIZE];
+                    const HitRecord *found[PACKET_SIZE] = {};
+                    if (cached)
+                    {
+                        for (int lane = 0; lane < PACKET_SIZE; lane++)
+                        {
+                            if (!inside[lane])
+                                continue;
+                            stats.cached++;
+                            found[lane] = gbuffer->lookup(laneX[lane], laneY[lane]);
+                        }
+                    }
+                    else
+                    {
+                        RayPacket packet(laneRays);
+                        PacketHit hits;
+                        scene.hit(packet, Mask4(inside[0], inside[1], inside[2], inside[3]), hits);
+                        for (int lane = 0; lane < PACKET_SIZE; lane++)
+                        {
+                            if (!inside[lane])
+                                continue;
+                            stats.rays++;
+                            CountRay(TraceStats::RayKind::Primary, 0);
+                            Hit hit = hits.lane(lane);
+                            if (hit.object != Hit::NONE)
+                            {
+                                records[lane] = scene.record(laneRays[lane], hit);
+                                found[lane] = &records[lane];
+                                if (gbuffer)
+                                    gbuffer->storeHit(laneX[lane], laneY[lane], records[lane]);
+                            }
+                            else if (gbuffer)
+                            {
+                                gbuffer->storeMiss(laneX[lane], laneY[lane]);
+                            }
+                        }
+                    }
+
+                    Vec3 colors[PACKET_SIZE];
+                    shadePacket(laneRays, found, context, settings.depth, colors);
+                    for (int lane = 0; lane < PACKET_SIZE; lane++)
+                        if (inside[lane])
+                            fill(laneX[lane], laneY[lane], colors[lane]);
+                }
+            }
+        }
+        framebuffer->writeTile(tile, colors.data());
+        if (adaptive)
+        {
+            for (int y = tile.y0; y < tile.y1; y++)
+                std::copy_n(&colors[(y - tile.y0) * tileWidth * 3], tileWidth * 3,
+                            &base[(static_cast<size_t>(y) * width + tile.x0) * 3]);
+        }
+        stats.trace += ThreadTraceStats();
+        counters[worker].stats += stats;
+        if (settings.onTile)
+            settings.onTile(tile);
+    });
+
+    if (adaptive && !(settings.cancel && settings.cancel->load(std::memory_order_relaxed)))
+        supersample(scheduler, framebuffer, camera, scene, settings, tiles, base, counters);
+
+    RenderStats stats;
+    for (const WorkerStats &counter : counters)
+        stats += counter.stats;
+    return stats;
 }
@@ -1,8 +1,16 @@
 #pragma once
 
 #include <cmath>
+#include <cstdint>
 #include <vector>
+#include <memory>
+#include <optional>
+#include <atomic>
+#include <functional>
 #include "geometry.h"
+#include "bvh.h"
+#include "packet.h"
+#include "tracestats.h"
 
 struct Material {
     Material() = default;
@@ -16,27 +24,76 @@ struct Material {
     float refractive = 4.0f;
 };
 
+// Full description of the closest hit, built once per ray for shading.
 struct HitRecord {
     Vec3     position;
     Vec3     normal;
     float    parameter;
-    Material material;
+    uint32_t material;
+};
+
+// What a closest-hit query keeps per candidate: the distance and enough to
+// rebuild the surface once the winner is known, see Scene::record().
+struct Hit {
+    static constexpr uint32_t NONE = 0xffffffff;
+    static constexpr uint32_t PLANE = 0xfffffffe;
+
+    float    t = std::numeric_limits<float>::max();
+    uint32_t object = NONE; // Scene object ID
+    uint32_t primitive = 0; // defined by the object, passed back to IObject::normal()
+    uint32_t material = 0;
+};
+
+// Closest hits of a ray packet. Lanes without a hit keep the parameter they
+// started with.
+struct PacketHit {
+    Float4   parameter = Float4(std::numeric_limits<float>::max());
+    uint32_t object[PACKET_SIZE] = {Hit::NONE, Hit::NONE, Hit::NONE, Hit::NONE};
+    uint32_t primitive[PACKET_SIZE] = {};
+    uint32_t material[PACKET_SIZE] = {};
+
+    void record(const Mask4& lanes, const Float4& t, uint32_t hitPrimitive) {
+        parameter = Select(lanes, t, parameter);
+        for (int lane = 0; lane < PACKET_SIZE; lane++)
+            if (lanes[lane]) primitive[lane] = hitPrimitive;
+    }
+
+    Hit lane(int i) const { return {parameter[i], object[i], primitive[i], material[i]}; }
 };
 
 struct IObject {
-    virtual std::optional<HitRecord> hit(const Ray& ray) const = 0;
-    virtual Material& getMaterial() = 0;
+    // Stores the hit in hit if it is closer than hit.t. Only t and primitive
+    // are filled in; the scene sets the object and material.
+    virtual bool hit(const Ray& ray, Hit& hit) const = 0;
+    // Keeps the hits of the active lanes that are closer than hits.parameter.
+    // The default implementation traces the lanes one by one.
+    virtual void hit(const RayPacket& packet, Mask4 active, PacketHit& hits) const;
+    // Whether the ray hits the object before tMax. The default implementation
+    // falls back to hit(); overrides stop at the first hit found.
+    virtual bool occluded(const Ray& ray, float tMax) const;
+    // The active lanes that hit the object before their tMax. The default
+    // implementation tests the lanes one by one.
+    virtual Mask4 occluded(const RayPacket& packet, Mask4 active, const Float4& tMax) const;
+    // Surface normal at a hit point of the given primitive.
+    virtual Vec3 normal(const Vec3& position, uint32_t primitive) const = 0;
+    virtual AABB bounds() const = 0;
+    virtual std::shared_ptr<IObject> clone() const = 0;
     virtual Vec3& getPosition() = 0;
     virtual Vec3& getRotation() = 0;
     virtual float& getScale() = 0;
     virtual void update() = 0;
 };
 
+struct Tile;
+
 struct IFramebuffer {
     virtual int width() const = 0;
     virtual int height() const = 0;
     virtual void clear() = 0;
     virtual void setPixel(int x, int y, const Vec3& color) = 0;
+    // Receives a finished tile of linear RGB, three floats per pixel, in rows
+    // of tile.x1 - tile.x0 pixels. The default forwards every pixel to setPixel.
+    virtual void writeTile(const Tile& tile, const float* rgb);
 };
 
 class Camera {
@@ -45,6 +102,8 @@ public:
     Camera(const Vec3& eye, const Vec3& lookat, float fov, float aspect);
     Ray generateRay(float s, float t) const;
     void update();
+    // Whether both cameras generate the same rays.
+    bool operator==(const Camera& other) const;
 
     Vec3&  eye()    { return m_eye; }
     Vec3&  lookAt() { return m_lookAt; }
@@ -60,32 +119,111 @@ private:
     Vec3  m_corner;
 };
 
-class Scene {
-public:
-    typedef std::shared_ptr<IObject> ObjectRef;
+class Scene;
 
-    Scene() = default;
-    std::optional<HitRecord> hit(const Ray& ray) const;
+// First hit of every primary ray, filled in by Render(). While the camera and
+// the scene geometry stay the same, Render() restarts shading from the stored
+// hits instead of intersecting the primary rays again, so lighting and
+// material edits only pay for shading and secondary rays.
+class GBuffer {
+public:
+    // Forgets every pixel unless the size, camera and geometry version match
+    // those of the previous call.
+    void prepare(int width, int height, const Camera& camera, uint64_t geometryVersion);
 
-    void addObject(const ObjectRef& object)       { m_objects.push_back(object); }
-    ObjectRef objectAt(int index)                 { return m_objects[index]; }
-    std::vector<ObjectRef>& objects()             { return m_objects; }
-    const std::vector<ObjectRef>& objects() const { return m_objects; }
+    bool known(int x, int y) const { return m_state[index(x, y)] != State::Unknown; }
+    // The first hit of a known pixel, nullptr if its primary ray missed.
+    const HitRecord* lookup(int x, int y) const {
+        size_t i = index(x, y);
+        return m_state[i] == State::Hit ? &m_records[i] : nullptr;
+    }
+    // Tiles store disjoint pixels, so workers need no synchronization.
+    void storeHit(int x, int y, const HitRecord& record) {
+        size_t i = index(x, y);
+        m_records[i] = record;
+        m_state[i] = State::Hit;
+    }
+    void storeMiss(int x, int y) { m_state[index(x, y)] = State::Miss; }
 
-    void addLight(const Vec3& light)        { m_lights.push_back(light); }
-    Vec3& lightAt(int index)                { return m_lights[index]; }
-    std::vector<Vec3>& lights()             { return m_lights; }
-    const std::vector<Vec3>& lights() const { return m_lights; }
+private:
+    enum class State : uint8_t { Unknown, Miss, Hit };
 
-    void showPlane(bool show) { m_showPlane = show; }
-    float& getAmbient()       { return m_ambient; }
-    float  getAmbient() const { return m_ambient; }
+    size_t index(int x, int y) const { return static_cast<size_t>(y) * m_width + x; }
 
 private:
-    std::vector<ObjectRef> m_objects;
-    std::vector<Vec3> m_lights;
-    bool  m_showPlane = false;
-    float m_ambient = 0.0f;
+    int                    m_width = 0;
+    int                    m_height = 0;
+    Camera                 m_camera;
+    uint64_t               m_geometryVersion = 0;
+    std::vector<HitRecord> m_records;
+    std::vector<State>     m_state;
+};
+
+struct RenderSettings {
+    int depth = 3;
+    int tileSize = 16;
+    int stride = 1; // trace one pixel per stride x stride block and fill the block
+    bool packets = true; // trace primary rays as 2x2 packets
+    // Reflected and refracted rays whose share of the pixel (the product of
+    // albedos along the path) falls below this are not traced.
+    float minContribution = 1.0f / 512.0f;
+    bool shadows = false; // test every light with a shadow ray
+    // Adaptive anti-aliasing of full-resolution frames: a pixel whose color
+    // differs from a neighbour by more than aaThreshold in any channel is
+    // re-traced with maxSamples stratified samples (rounded down to 4, 9,
+    // 16, ...). When too many pixels qualify, only the highest contrasts are
+    // refined so that the frame stays within aaBudget samples per pixel.
+    int maxSamples = 1;
+    float aaThreshold = 0.1f;
+    float aaBudget = 2.0f;
+    // Only tiles [firstTile, lastTile) of MakeTiles() are rendered, all of
+    // them while lastTile is negative. Adaptive anti-aliasing needs the whole
+    // frame and is skipped for a part of it.
+    int firstTile = 0;
+    int lastTile = -1;
+    const std::atomic<bool>* cancel = nullptr; // checked before every tile
+    GBuffer* gbuffer = nullptr;                 // primary hits kept between frames
+    std::function<void(const Tile&)> onTile;   // called from workers as tiles finish
+};
+
+struct RenderStats {
+    uint64_t rays = 0;    // primary and secondary rays traced
+    uint64_t pruned = 0;  // secondary rays skipped: no albedo, total internal reflection or below minContribution
+    uint64_t shadowRays = 0;
+    uint64_t cached = 0;  // primary rays answered by the G-buffer, not counted in rays
+    uint64_t samples = 0; // primary samples including supersamples, samples / pixels is the average spp
+    TraceStats trace;     // breakdown by ray kind, primitive and bounce
+
+    RenderStats& operator+=(const RenderStats& other) {
+        rays += other.rays;
+        pruned += other.pruned;
+        shadowRays += other.shadowRays;
+        cached += other.cached;
+        samples += other.samples;
+        trace += other.trace;
+        return *this;
+    }
+};
+
+class TileScheduler;
+
+// Lights of which primary hits trace their shadow rays as packets; Render()
+// tests any further ones one ray at a time.
+constexpr size_t SHADOW_PACKET_LIGHTS = 64;
+
+RenderStats Render(TileScheduler& scheduler, IFramebuffer* framebuffer, const Camera& camera,
+                   const Scene& scene, const RenderSettings& settings);
+
+// Light reaching a surface point before its material is applied: the
+// ambient and diffuse terms of the lights in sight, and their specular
+// highlights for a ray along direction, each capped at 1. Counts the shadow
+// rays it traces when shadows are on. hidden, when given, has bit i set for
+// each of the first SHADOW_PACKET_LIGHTS lights already found occluded by a
+// packet of shadow rays; those lights are not traced again.
+struct Lighting {
+    float diffuse;
+    float specular;
 };
 
-void Render(IFramebuffer* framebuffer, const Camera& camera, const Scene& scene, int depth);
+Lighting Illuminate(const Scene& scene, const HitRecord& record, const Vec3& direction, float shininess,
+                    bool shadows, uint64_t& shadowRays, const uint64_t* hidden = nullptr);
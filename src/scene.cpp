@@ -0,0 +1,595 @@
+#include "pch.h"
+#include "scene.h"
+#include "dispatch.h"
+#include <cstddef>
+#include <thread>
+
+Scene::Scene()
+{
+    Material plane;
+    plane.diffuseAlbedo = 1.0f;
+    plane.diffuse = Vec3(0.8, 0.8, 0.8);
+    m_materials.push_back(plane);
+    m_materialUsers.push_back(0);
+}
+
+uint32_t Scene::addMaterial(const Material &material)
+{
+    if (!m_freeMaterials.empty())
+    {
+        uint32_t id = m_freeMaterials.back();
+        m_freeMaterials.pop_back();
+        m_materials[id] = material;
+        return id;
+    }
+    m_materials.push_back(material);
+    m_materialUsers.push_back(0);
+    return static_cast<uint32_t>(m_materials.size() - 1);
+}
+
+template <typename Objects>
+Scene::ObjectId Scene::insert(Objects &objects, std::vector<ObjectId> &ids, ObjectType type,
+                              const typename Objects::value_type &object, uint32_t material)
+{
+    assert(material < m_materials.size());
+    ObjectId id = static_cast<ObjectId>(m_slots.size());
+    m_slots.push_back({type, static_cast<uint32_t>(objects.size()), material});
+    m_materialUsers[material]++;
+    objects.push_back(object);
+    ids.push_back(id);
+    m_order.push_back(id);
+    m_dirty = true;
+    return id;
+}
+
+// Swaps the last object into the hole so that the arrays stay dense.
+template <typename Objects>
+void Scene::erase(Objects &objects, std::vector<ObjectId> &ids, uint32_t index)
+{
+    if (index + 1 != objects.size())
+    {
+        std::swap(objects[index], objects.back());
+        ids[index] = ids.back();
+        m_slots[ids[index]].index = index;
+    }
+    objects.pop_back();
+    ids.pop_back();
+}
+
+Scene::ObjectId Scene::addObject(const Sphere &sphere, uint32_t material)
+{
+    return insert(m_spheres, m_sphereIds, ObjectType::Sphere, sphere, material);
+}
+
+Scene::ObjectId Scene::addObject(const Cube &box, uint32_t material)
+{
+    return insert(m_boxes, m_boxIds, ObjectType::Box, box, material);
+}
+
+Scene::ObjectId Scene::addObject(const Model &mesh, uint32_t material)
+{
+    return insert(m_meshes, m_meshIds, ObjectType::Mesh, mesh, material);
+}
+
+Scene::ObjectId Scene::addObject(const ObjectRef &object, uint32_t material)
+{
+    return insert(m_custom, m_customIds, ObjectType::Custom, object, material);
+}
+
+void Scene::removeObject(ObjectId id)
+{
+    assert(id < m_slots.size() && m_slots[id].type != ObjectType::None);
+    ObjectSlot &slot = m_slots[id];
+    switch (slot.type)
+    {
+    case ObjectType::Sphere: erase(m_spheres, m_sphereIds, slot.index); break;
+    case ObjectType::Box:    erase(m_boxes, m_boxIds, slot.index); break;
+    case ObjectType::Mesh:   erase(m_meshes, m_meshIds, slot.index); break;
+    case ObjectType::Custom: erase(m_custom, m_customIds, slot.index); break;
+    case ObjectType::None:   break;
+    }
+    if (--m_materialUsers[slot.material] == 0 && slot.material != PLANE_MATERIAL)
+        m_freeMaterials.push_back(slot.material);
+    slot = ObjectSlot();
+    m_order.erase(std::find(m_order.begin(), m_order.end(), id));
+    m_dirty = true;
+}
+
+Material &Scene::ownMaterial(ObjectId id)
+{
+    assert(id < m_slots.size() && m_slots[id].type != ObjectType::None);
+    ObjectSlot &slot = m_slots[id];
+    if (m_materialUsers[slot.material] > 1 || slot.material == PLANE_MATERIAL)
+    {
+        // A copy: adding may move the table.
+        uint32_t copy = addMaterial(Material(m_materials[slot.material]));
+        m_materialUsers[slot.material]--;
+        m_materialUsers[copy]++;
+        slot.material = copy;
+        m_geometryVersion++;
+    }
+    return m_materials[slot.material];
+}
+
+template <typename Visitor>
+decltype(auto) Scene::visit(ObjectId id, Visitor &&visitor) const
+{
+    const ObjectSlot &slot = m_slots[id];
+    switch (slot.type)
+    {
+    case ObjectType::Sphere: return visitor(m_spheres[slot.index]);
+    case ObjectType::Box:    return visitor(m_boxes[slot.index]);
+    case ObjectType::Mesh:   return visitor(m_meshes[slot.index]);
+    default:
+        assert(slot.type == ObjectType::Custom);
+        return visitor(static_cast<const IObject &>(*m_custom[slot.index]));
+    }
+}
+
+IObject &Scene::object(ObjectId id)
+{
+    return const_cast<IObject &>(static_cast<const Scene &>(*this).object(id));
+}
+
+const IObject &Scene::object(ObjectId id) const
+{
+    return visit(id, [](const auto &object) -> const IObject & { return object; });
+}
+
+constexpr int SPHERE_LEAF_SIZE = 8;
+constexpr int OBJECT_LEAF_SIZE = 2;
+
+void Scene::commit(Rebuild rebuild)
+{
+    if (m_dirty)
+    {
+        buildSpheres();
+        buildObjects();
+        m_moved.clear();
+        m_dirty = false;
+        m_geometryVersion++;
+        return;
+    }
+
+    // Rebuilt trees hold the same objects, so swapping one in does not
+    // change the image.
+    if (adopt(m_sphereBVH, m_sphereRefit))
+        packSpheres();
+    if (adopt(m_bvh, m_bvhRefit))
+        mapObjects();
+    if (m_moved.empty())
+        return;
+
+    if (!refitMoved(rebuild))
+    {
+        m_dirty = true;
+        commit(rebuild);
+        return;
+    }
+    m_moved.clear();
+    m_geometryVersion++;
+}
+
+void Scene::build(BVH &bvh, Refit &state, int leafSize)
+{
+    bvh.build(state.bounds, leafSize);
+    state.builtCost = bvh.stats().sahCost;
+    state.rebuild = {};
+}
+
+bool Scene::refit(BVH &bvh, Refit &state, std::span<const uint32_t> changed, int leafSize, Rebuild rebuild)
+{
+    bvh.refit(state.bounds, changed);
+    if (!(bvh.stats().sahCost > REBUILD_COST_GROWTH * state.builtCost))
+        return false;
+
+    if (rebuild == Rebuild::Immediate)
+    {
+        build(bvh, state, leafSize);
+        return true;
+    }
+    // One rebuild at a time; objects that move meanwhile are refitted into
+    // the new tree when it is adopted.
+    if (!state.rebuild.valid())
+    {
+        std::packaged_task<BVH()> task([bounds = state.bounds, leafSize]() {
+            BVH tree;
+            tree.build(bounds, leafSize);
+            return tree;
+        });
+        state.rebuild = task.get_future();
+        std::thread(std::move(task)).detach();
+    }
+    return false;
+}
+
+bool Scene::adopt(BVH &bvh, Refit &state)
+{
+    if (!state.rebuild.valid() || state.rebuild.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        return false;
+
+    BVH tree = state.rebuild.get();
+    state.rebuild = {};
+    // Objects that moved during the build are refitted in. Growth is still
+    // measured against the fresh tree, so a stale one soon gets replaced too.
+    state.builtCost = tree.stats().sahCost;
+    tree.refit(state.bounds);
+    bvh = std::move(tree);
+    return true;
+}
+
+bool Scene::refitMoved(Rebuild rebuild)
+{
+    std::vector<uint32_t> spheres;
+    std::vector<uint32_t> objects;
+    for (ObjectId id : m_moved)
+    {
+        if (!hasObject(id))
+            continue;
+        const ObjectSlot &slot = m_slots[id];
+        if (slot.type == ObjectType::Sphere)
+        {
+            m_sphereRefit.bounds[slot.index] = m_spheres[slot.index].bounds();
+            spheres.push_back(slot.index);
+            continue;
+        }
+
+        AABB box = object(id).bounds();
+        uint32_t primitive = m_bvhPrimitives[id];
+        if ((primitive != Hit::NONE) != std::isfinite(box.area()))
+            return false;
+        if (primitive != Hit::NONE)
+        {
+            m_bvhRefit.bounds[primitive] = box;
+            objects.push_back(primitive);
+        }
+    }
+
+    if (!spheres.empty())
+    {
+        if (refit(m_sphereBVH, m_sphereRefit, spheres, SPHERE_LEAF_SIZE, rebuild))
+            packSpheres();
+        else
+            for (uint32_t index : spheres)
+            {
+                SphereBlock &block = m_sphereBlocks[m_sphereLanes[index] / 4];
+                int lane = m_sphereLanes[index] % 4;
+                for (int axis = 0; axis < 3; axis++)
+                    block.center[axis][lane] = m_spheres[index].getCenter()[axis];
+                block.radius[lane] = m_spheres[index].getRadius();
+            }
+    }
+    if (!objects.empty() && refit(m_bvh, m_bvhRefit, objects, OBJECT_LEAF_SIZE, rebuild))
+        mapObjects();
+    return true;
+}
+
+void Scene::buildObjects()
+{
+    // Objects without finite bounds cannot be placed in the hierarchy and are
+    // tested on every ray, like the ground plane.
+    m_bvhRefit.bounds.clear();
+    m_bvhBounded.clear();
+    m_bvhPrimitives.assign(m_slots.size(), Hit::NONE);
+    m_unbounded.clear();
+    auto add = [&](ObjectId id, const AABB &box) {
+        if (std::isfinite(box.area()))
+        {
+            m_bvhPrimitives[id] = static_cast<uint32_t>(m_bvhBounded.size());
+            m_bvhRefit.bounds.push_back(box);
+            m_bvhBounded.push_back(id);
+        }
+        else
+            m_unbounded.push_back(id);
+    };
+    for (size_t i = 0; i < m_boxes.size(); i++)
+        add(m_boxIds[i], m_boxes[i].bounds());
+    for (size_t i = 0; i < m_meshes.size(); i++)
+        add(m_meshIds[i], m_meshes[i].bounds());
+    for (size_t i = 0; i < m_custom.size(); i++)
+        add(m_customIds[i], m_custom[i]->bounds());
+
+    build(m_bvh, m_bvhRefit, OBJECT_LEAF_SIZE);
+    mapObjects();
+}
+
+void Scene::mapObjects()
+{
+    m_bvhObjects.clear();
+    for (uint32_t primitive : m_bvh.indices())
+        m_bvhObjects.push_back(m_bvhBounded[primitive]);
+}
+
+void Scene::buildSpheres()
+{
+    m_sphereRefit.bounds.clear();
+    m_sphereRefit.bounds.reserve(m_spheres.size());
+    for (const Sphere &sphere : m_spheres)
+        m_sphereRefit.bounds.push_back(sphere.bounds());
+    build(m_sphereBVH, m_sphereRefit, SPHERE_LEAF_SIZE);
+    packSpheres();
+}
+
+void Scene::packSpheres()
+{
+    std::span<const BVHNode> nodes = m_sphereBVH.nodes();
+    m_sphereBlocks.clear();
+    m_sphereLeafBlocks.assign(nodes.size(), 0);
+    m_sphereLanes.assign(m_spheres.size(), 0);
+    for (uint32_t index = 0; index < nodes.size(); index++)
+    {
+        const BVHNode &node = nodes[index];
+        if (!node.isLeaf())
+            continue;
+
+        m_sphereLeafBlocks[index] = static_cast<uint32_t>(m_sphereBlocks.size());
+        for (uint32_t first = node.offset; first < node.offset + node.count; first += 4)
+        {
+            SphereBlock block;
+            for (int lane = 0; lane < 4; lane++)
+            {
+                uint32_t slot = first + lane;
+                Vec3 center(std::numeric_limits<float>::quiet_NaN());
+                float radius = 0.0f;
+                ObjectId id = Hit::NONE;
+                if (slot < node.offset + node.count)
+                {
+                    uint32_t sphere = m_sphereBVH.indices()[slot];
+                    center = m_spheres[sphere].getCenter();
+                    radius = m_spheres[sphere].getRadius();
+                    id = m_sphereIds[sphere];
+                    m_sphereLanes[sphere] = static_cast<uint32_t>(m_sphereBlocks.size()) * 4 + lane;
+                }
+                for (int axis = 0; axis < 3; axis++)
+                    block.center[axis][lane] = center[axis];
+                block.radius[lane] = radius;
+                block.id[lane] = id;
+            }
+            m_sphereBlocks.push_back(block);
+        }
+    }
+}
+
+Scene Scene::snapshot() const
+{
+    Scene copy = *this;
+    for (auto &object : copy.m_custom)
+        object = object->clone();
+    return copy;
+}
+
+Mask4 Scene::hitBlock(const SphereBlock &block, const Ray &ray, float tMax, Float4 &t)
+{
+    // Same arithmetic as Sphere::hit, four spheres at a time.
+    Vec3x4 center(Float4::load(block.center[0]), Float4::load(block.center[1]), Float4::load(block.center[2]));
+    Float4 radius = Float4::load(block.radius);
+    Vec3x4 direction(ray.direction);
+
+    Vec3x4 oc = Vec3x4(ray.origin) - center;
+    Float4 a(Dot(ray.direction, ray.direction));
+    Float4 h = Dot(oc, direction);
+    Float4 c = Dot(oc, oc) - radius * radius;
+
+    Float4 discriminant = h * h - a * c;
+    Mask4 valid = discriminant >= Float4(0.0f);
+    if (valid.none())
+        return valid;
+
+    t = (-h - Sqrt(Max(discriminant, Float4(0.0f)))) / a;
+    return valid & (t >= Float4(0.001f)) & (t < Float4(tMax));
+}
+
+bool Scene::hit(const Ray &ray, Hit &hit) const
+{
+    assert(!m_dirty && m_moved.empty());
+    bool found = false;
+
+    if (m_showPlane && std::abs(ray.direction.y) > 0.001f)
+    {
+        CountTests(TraceStats::Primitive::Plane);
+        float t = -(ray.origin.y + 3.0f) / ray.direction.y;
+        if (t > 0.001f && t < hit.t)
+        {
+            hit.t = t;
+            hit.object = Hit::PLANE;
+            hit.primitive = 0;
+            hit.material = PLANE_MATERIAL;
+            found = true;
+        }
+    }
+
+    const BVHNode *sphereNodes = m_sphereBVH.nodes().data();
+    m_sphereBVH.traverseLeaves(ray, hit.t, [&](const BVHNode &leaf, float &tMax) {
+        const SphereBlock *block = &m_sphereBlocks[m_sphereLeafBlocks[&leaf - sphereNodes]];
+        uint32_t count = (leaf.count + 3) / 4;
+        for (uint32_t i = 0, blocks; i < count; i += blocks, block += blocks)
+        {
+            alignas(32) float distances[8];
+            int valid = hitBlocks(block, count - i, ray, tMax, distances, blocks);
+            for (int lane = 0; valid >> lane; lane++)
+            {
+                if ((valid >> lane) & 1 && distances[lane] < tMax)
+                {
+                    tMax = distances[lane];
+                    hit.object = block[lane / 4].id[lane % 4];
+                    hit.primitive = 0;
+                    hit.material = m_slots[hit.object].material;
+                    found = true;
+                }
+            }
+        }
+    });
+
+    auto test = [&](ObjectId id) {
+        if (visit(id, [&](const auto &object) { return object.hit(ray, hit); }))
+        {
+            hit.object = id;
+            hit.material = m_slots[id].material;
+            found = true;
+        }
+    };
+    for (ObjectId id : m_unbounded)
+        test(id);
+
+    m_bvh.traverse(ray, hit.t, [&](uint32_t slot, float &) { test(m_bvhObjects[slot]); });
+    return found;
+}
+
+void Scene::assign(const Mask4 &lanes, ObjectId id, PacketHit &hits) const
+{
+    uint32_t material = id == Hit::PLANE ? PLANE_MATERIAL : m_slots[id].material;
+    for (int lane = 0; lane < PACKET_SIZE; lane++)
+    {
+        if (lanes[lane])
+        {
+            hits.object[lane] = id;
+            hits.material[lane] = material;
+        }
+    }
+}
+
+void Scene::hit(const RayPacket &packet, Mask4 active, PacketHit &hits) const
+{
+    assert(!m_dirty && m_moved.empty());
+    if (m_showPlane)
+    {
+        CountTests(TraceStats::Primitive::Plane, active.count());
+        Float4 t = -(packet.origin.y + Float4(3.0f)) / packet.direction.y;
+        Mask4 valid = active & (Abs(packet.direction.y) > Float4(0.001f)) &
+                      (t > Float4(0.001f)) & (t < hits.parameter);
+        if (valid.any())
+        {
+            hits.record(valid, t, 0);
+            assign(valid, Hit::PLANE, hits);
+        }
+    }
+
+    // Objects only report distances; the lanes they moved closer are theirs.
+    auto test = [&](ObjectId id, Mask4 lanes) {
+        Float4 before = hits.parameter;
+        visit(id, [&](const auto &object) { object.hit(packet, lanes, hits); });
+        Mask4 closer = hits.parameter < before;
+        if (closer.any())
+            assign(closer, id, hits);
+    };
+
+    const BVHNode *sphereNodes = m_sphereBVH.nodes().data();
+    m_sphereBVH.traverseLeaves(packet, active, hits.parameter, [&](const BVHNode &leaf, Mask4 lanes) {
+        const SphereBlock *block = &m_sphereBlocks[m_sphereLeafBlocks[&leaf - sphereNodes]];
+        for (uint32_t i = 0; i < leaf.count; i += 4, block++)
+            for (int lane = 0; lane < 4 && block->id[lane] != Hit::NONE; lane++)
+                test(block->id[lane], lanes);
+    });
+
+    for (ObjectId id : m_unbounded)
+        test(id, active);
+
+    m_bvh.traverse(packet, active, hits.parameter, [&](uint32_t slot, Mask4 lanes) {
+        test(m_bvhObjects[slot], lanes);
+    });
+}
+
+HitRecord Scene::record(const Ray &ray, const Hit &hit) const
+{
+    assert(hit.object != Hit::NONE);
+    HitRecord record;
+    record.position = ray.at(hit.t);
+    record.normal = hit.object == Hit::PLANE
+                        ? Vec3(0.0f, 1.0f, 0.0f)
+                        : visit(hit.object, [&](const auto &object) { return object.normal(record.position, hit.primitive); });
+    record.parameter = hit.t;
+    record.material = hit.material;
+    return record;
+}
+
+bool Scene::occluded(const Ray &ray, float tMax) const
+{
+    assert(!m_dirty && m_moved.empty());
+    if (m_showPlane && std::abs(ray.direction.y) > 0.001f)
+    {
+        CountTests(TraceStats::Primitive::Plane);
+        float t = -(ray.origin.y + 3.0f) / ray.direction.y;
+        if (t > 0.001f && t < tMax)
+            return true;
+    }
+
+    bool spheres = m_sphereBVH.anyHitLeaves(ray, tMax, [&](const BVHNode &leaf) {
+        return occludedSpheres(leaf, ray, tMax);
+    });
+    if (spheres)
+        return true;
+
+    auto test = [&](ObjectId id) {
+        return visit(id, [&](const auto &object) { return object.occluded(ray, tMax); });
+    };
+    for (ObjectId id : m_unbounded)
+        if (test(id))
+            return true;
+
+    return m_bvh.anyHit(ray, tMax, [&](uint32_t slot) { return test(m_bvhObjects[slot]); });
+}
+
+Mask4 Scene::occluded(const RayPacket &packet, Mask4 active, const Float4 &tMax) const
+{
+    assert(!m_dirty && m_moved.empty());
+    Mask4 blocked;
+    if (m_showPlane)
+    {
+        CountTests(TraceStats::Primitive::Plane, active.count());
+        Float4 t = -(packet.origin.y + Float4(3.0f)) / packet.direction.y;
+        blocked = active & (Abs(packet.direction.y) > Float4(0.001f)) & (t > Float4(0.001f)) & (t < tMax);
+    }
+
+    // Spheres are tested one lane at a time against the blocks of a leaf.
+    blocked = blocked | m_sphereBVH.anyHitLeaves(packet, active & !blocked, tMax, [&](const BVHNode &leaf, Mask4 lanes) {
+        bool hit[PACKET_SIZE] = {};
+        for (int lane = 0; lane < PACKET_SIZE; lane++)
+            hit[lane] = lanes[lane] && occludedSpheres(leaf, packet.ray(lane), tMax[lane]);
+        return Mask4(hit[0], hit[1], hit[2], hit[3]);
+    });
+
+    auto test = [&](ObjectId id, Mask4 lanes) {
+        return visit(id, [&](const auto &object) { return object.occluded(packet, lanes, tMax); });
+    };
+    for (ObjectId id : m_unbounded)
+        if ((active & !blocked).any())
+            blocked = blocked | test(id, active & !blocked);
+
+    return blocked | m_bvh.anyHit(packet, active & !blocked, tMax, [&](uint32_t slot, Mask4 lanes) {
+        return test(m_bvhObjects[slot], lanes);
+    });
+}
+
+bool Scene::occludedSpheres(const BVHNode &leaf, const Ray &ray, float tMax) const
+{
+    const SphereBlock *block = &m_sphereBlocks[m_sphereLeafBlocks[&leaf - m_sphereBVH.nodes().data()]];
+    uint32_t count = (leaf.count + 3) / 4;
+    for (uint32_t i = 0, blocks; i < count; i += blocks, block += blocks)
+    {
+        alignas(32) float distances[8];
+        if (hitBlocks(block, count - i, ray, tMax, distances, blocks))
+            return true;
+    }
+    return false;
+}
+
+int Scene::hitBlocks(const SphereBlock *block, uint32_t remaining, const Ray &ray, float tMax, float *t, uint32_t &blocks)
+{
+    static_assert(offsetof(SphereBlock, radius) == 12 * sizeof(float), "layout expected by Kernels::hitSpheres8");
+    static const auto hitSpheres8 = ActiveKernels().hitSpheres8;
+    if (remaining >= 2 && hitSpheres8)
+    {
+        CountTests(TraceStats::Primitive::Sphere, 8);
+        blocks = 2;
+        const float values[6] = {ray.origin.x, ray.origin.y, ray.origin.z, ray.direction.x, ray.direction.y, ray.direction.z};
+        return hitSpheres8(block[0].center[0], block[1].center[0], values, tMax, t);
+    }
+
+    CountTests(TraceStats::Primitive::Sphere, 4);
+    blocks = 1;
+    Float4 distances;
+    Mask4 valid = hitBlock(*block, ray, tMax, distances);
+    if (valid.any())
+        distances.store(t);
+    return valid.bits();
+}
@@ -0,0 +1,208 @@
+#pragma once
+
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <span>
+#include <vector>
+#include "renderer.h"
+#include "objects.h"
+#include "model.h"
+
+// Objects are stored by value in one contiguous array per type and are
+// intersected without virtual calls; other IObject implementations can still
+// be added and are traced through the interface. Every object is addressed by
+// an ObjectId that stays valid until the object is removed.
+class Scene {
+public:
+    typedef std::shared_ptr<IObject> ObjectRef;
+    typedef uint32_t ObjectId;
+
+    // Material of the ground plane, always the first entry of the table.
+    static constexpr uint32_t PLANE_MATERIAL = 0;
+
+    Scene();
+    // Closest hit nearer than hit.t; returns whether hit was updated.
+    bool hit(const Ray& ray, Hit& hit) const;
+    void hit(const RayPacket& packet, Mask4 active, PacketHit& hits) const;
+    // Rebuilds position and normal of a hit found by hit().
+    HitRecord record(const Ray& ray, const Hit& hit) const;
+    // Any hit closer than tMax, for shadow rays.
+    bool occluded(const Ray& ray, float tMax) const;
+    // The active lanes with a hit closer than their tMax.
+    Mask4 occluded(const RayPacket& packet, Mask4 active, const Float4& tMax) const;
+
+    // Objects reference an entry of the material table; several objects may
+    // share one. An entry is freed when removeObject() takes away the last
+    // object referencing it, and addMaterial() hands freed entries out again.
+    uint32_t addMaterial(const Material& material);
+    Material& material(uint32_t id)             { return m_materials[id]; }
+    const Material& material(uint32_t id) const { return m_materials[id]; }
+
+    ObjectId addObject(const Sphere& sphere, uint32_t material);
+    ObjectId addObject(const Cube& box, uint32_t material);
+    ObjectId addObject(const Model& mesh, uint32_t material);
+    ObjectId addObject(const ObjectRef& object, uint32_t material);
+    template <typename Object>
+    ObjectId addObject(const Object& object, const Material& material = Material()) {
+        return addObject(object, addMaterial(material));
+    }
+    void removeObject(ObjectId id);
+
+    // Live objects in the order they were added.
+    const std::vector<ObjectId>& objectIds() const { return m_order; }
+    bool hasObject(ObjectId id) const { return id < m_slots.size() && m_slots[id].type != ObjectType::None; }
+    IObject& object(ObjectId id);
+    const IObject& object(ObjectId id) const;
+    Material& objectMaterial(ObjectId id) { return m_materials[m_slots[id].material]; }
+    // The material of the object alone: an object sharing its entry with
+    // others, or with the plane, is first moved to a copy. Primary hits keep
+    // material entries, so moving one changes the geometry version.
+    Material& ownMaterial(ObjectId id);
+    uint32_t materialOf(ObjectId id) const { return m_slots[id].material; }
+    size_t materialCount() const           { return m_materials.size(); } // including freed entries
+
+    enum class Rebuild : uint8_t {
+        Background, // keep rendering with the refitted trees until a rebuilt one is ready
+        Immediate,  // rebuild inside commit(), for callers already off the interactive thread
+    };
+
+    // Refitting stretches nodes over moved objects; past this growth of the
+    // SAH cost since the last build, the tree is rebuilt.
+    static constexpr float REBUILD_COST_GROWTH = 1.3f;
+
+    // Object bounds are cached in BVHs: call invalidate(id) after moving or
+    // resizing an object, or invalidate() after any other change, and commit()
+    // before rendering. Moved objects only refit the nodes above them; a
+    // finished background rebuild is swapped in by the next commit().
+    void invalidate() { m_dirty = true; }
+    void invalidate(ObjectId id) { m_moved.push_back(id); }
+    void commit(Rebuild rebuild = Rebuild::Background);
+    // Changes whenever commit() picks up an edit or the plane is toggled, so
+    // that primary hits cached for one version can be reused until the next.
+    uint64_t geometryVersion() const { return m_geometryVersion; }
+
+    // Deep copy that background renders can read while the original is edited.
+    Scene snapshot() const;
+
+    void addLight(const Vec3& light)        { m_lights.push_back(light); }
+    Vec3& lightAt(int index)                { return m_lights[index]; }
+    std::vector<Vec3>& lights()             { return m_lights; }
+    const std::vector<Vec3>& lights() const { return m_lights; }
+
+    void showPlane(bool show) {
+        if (show != m_showPlane)
+            m_geometryVersion++;
+        m_showPlane = show;
+    }
+    bool planeShown() const   { return m_showPlane; }
+    float& getAmbient()       { return m_ambient; }
+    float  getAmbient() const { return m_ambient; }
+
+    // Four spheres of one leaf of the sphere BVH. Unused lanes have a NaN
+    // center and never hit. Public, with the kernels below, for the
+    // micro-benchmarks.
+    struct alignas(16) SphereBlock {
+        float    center[3][4];
+        float    radius[4];
+        ObjectId id[4];
+    };
+
+    // One ray against the four spheres of a block; returns the lanes hit
+    // before tMax and their distances in t.
+    static Mask4 hitBlock(const SphereBlock& block, const Ray& ray, float tMax, Float4& t);
+    // Same for the next blocks of a leaf, of which remaining are left: two at
+    // once when an 8-wide kernel is available. Sets blocks to the number
+    // tested and returns the lanes hit, four bits per block, with their
+    // distances in t, which must be 32-byte aligned.
+    static int hitBlocks(const SphereBlock* block, uint32_t remaining, const Ray& ray, float tMax, float* t,
+                         uint32_t& blocks);
+
+private:
+    enum class ObjectType : uint8_t { None, Sphere, Box, Mesh, Custom };
+
+    struct ObjectSlot {
+        ObjectType type = ObjectType::None;
+        uint32_t   index = 0; // into the array of the type
+        uint32_t   material = 0;
+    };
+
+    // Bounds behind a BVH that is refitted as objects move.
+    struct Refit {
+        std::vector<AABB> bounds;           // by BVH primitive
+        float             builtCost = 0.0f; // SAH cost right after the last build
+        // Of the bounds as they were when it started, on a detached thread:
+        // unlike one from std::async, dropping the future never waits.
+        std::future<BVH>  rebuild;
+
+        Refit() = default;
+        // Copies, such as those of snapshots, leave a pending rebuild behind.
+        Refit(const Refit& other) : bounds(other.bounds), builtCost(other.builtCost) {}
+        Refit& operator=(const Refit& other) {
+            bounds = other.bounds;
+            builtCost = other.builtCost;
+            rebuild = {};
+            return *this;
+        }
+        Refit(Refit&&) = default;
+        Refit& operator=(Refit&&) = default;
+    };
+
+    template <typename Objects>
+    ObjectId insert(Objects& objects, std::vector<ObjectId>& ids, ObjectType type,
+                    const typename Objects::value_type& object, uint32_t material);
+    template <typename Objects>
+    void erase(Objects& objects, std::vector<ObjectId>& ids, uint32_t index);
+    // Calls visitor with the concrete object behind id.
+    template <typename Visitor>
+    decltype(auto) visit(ObjectId id, Visitor&& visitor) const;
+    static void build(BVH& bvh, Refit& state, int leafSize);
+    // Refits bvh over the changed primitives, or replaces it by a rebuilt
+    // tree once it has degraded too far. Both return whether the tree was
+    // replaced, which moves primitives to other slots.
+    static bool refit(BVH& bvh, Refit& state, std::span<const uint32_t> changed, int leafSize, Rebuild rebuild);
+    static bool adopt(BVH& bvh, Refit& state);
+    void buildSpheres();
+    void packSpheres();
+    void buildObjects();
+    void mapObjects();
+    // Refits after objects moved; false if one became bounded or unbounded.
+    bool refitMoved(Rebuild rebuild);
+    void assign(const Mask4& lanes, ObjectId id, PacketHit& hits) const;
+    // Whether a sphere of the leaf of the sphere BVH is hit before tMax.
+    bool occludedSpheres(const BVHNode& leaf, const Ray& ray, float tMax) const;
+
+private:
+    std::vector<Sphere>     m_spheres;
+    std::vector<ObjectId>   m_sphereIds;
+    std::vector<Cube>       m_boxes;
+    std::vector<ObjectId>   m_boxIds;
+    std::vector<Model>      m_meshes;
+    std::vector<ObjectId>   m_meshIds;
+    std::vector<ObjectRef>  m_custom;
+    std::vector<ObjectId>   m_customIds;
+    std::vector<ObjectSlot> m_slots; // by ObjectId
+    std::vector<ObjectId>   m_order;
+    std::vector<Material>   m_materials;
+    std::vector<uint32_t>   m_materialUsers; // objects referencing each material
+    std::vector<uint32_t>   m_freeMaterials;
+
+    BVH                      m_sphereBVH;
+    Refit                    m_sphereRefit;
+    std::vector<SphereBlock> m_sphereBlocks;     // blocks of all leaves in leaf order
+    std::vector<uint32_t>    m_sphereLeafBlocks; // first block of a leaf, by node index
+    std::vector<uint32_t>    m_sphereLanes;      // block * 4 + lane, by sphere index
+    BVH                      m_bvh;              // boxes, meshes and bounded custom objects
+    Refit                    m_bvhRefit;
+    std::vector<ObjectId>    m_bvhBounded;       // by BVH primitive
+    std::vector<uint32_t>    m_bvhPrimitives;    // by ObjectId, Hit::NONE if unbounded
+    std::vector<ObjectId>    m_bvhObjects;       // by BVH slot
+    std::vector<ObjectId>    m_unbounded;
+    std::vector<ObjectId>    m_moved;            // since the last commit()
+    bool                     m_dirty = false;
+    uint64_t                 m_geometryVersion = 0;
+
+    std::vector<Vec3> m_lights;
+    bool  m_showPlane = false;
+    float m_ambient = 0.0f;
+};
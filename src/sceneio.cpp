@@ -0,0 +1,260 @@
+#include "pch.h"
+#include "sceneio.h"
+#include "bubblecloud.h"
+#include <unordered_map>
+
+constexpr char SCENE_MAGIC[8] = "ICESCN";
+constexpr uint32_t SCENE_VERSION = 2;
+constexpr uint32_t SCENE_ENDIANNESS = 0x01020304;
+
+namespace {
+
+struct Header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t endianness;
+    uint32_t vec3Size;
+    uint32_t materialSize;
+    uint32_t nodeSize;
+    uint32_t blockSize;
+};
+
+enum class ObjectKind : uint8_t { Sphere, Box, Mesh, Bubbles };
+
+// Node and slot arrays of a received mesh BVH, kept alive by the view.
+struct TreeData {
+    std::vector<BVHNode>  nodes;
+    std::vector<uint32_t> indices;
+};
+
+Header CurrentHeader() {
+    Header header = {};
+    std::memcpy(header.magic, SCENE_MAGIC, sizeof(header.magic));
+    header.version = SCENE_VERSION;
+    header.endianness = SCENE_ENDIANNESS;
+    header.vec3Size = sizeof(Vec3);
+    header.materialSize = sizeof(Material);
+    header.nodeSize = sizeof(BVHNode);
+    header.blockSize = sizeof(TriangleBlock);
+    return header;
+}
+
+template <typename T>
+std::span<const T> View(const std::vector<T>& values) {
+    return values;
+}
+
+// Placement of objects with an instance transform.
+void WritePlacement(ByteWriter& writer, IObject& object) {
+    writer.value(object.getPosition());
+    writer.value(object.getRotation());
+    writer.value(object.getScale());
+}
+
+void ReadPlacement(ByteReader& reader, IObject& object) {
+    object.getPosition() = reader.value<Vec3>();
+    object.getRotation() = reader.value<Vec3>();
+    object.getScale() = reader.value<float>();
+    object.update();
+}
+
+void WriteMesh(ByteWriter& writer, const Mesh& mesh) {
+    writer.value(mesh.layout);
+    writer.value(mesh.aabb);
+    writer.array(mesh.vertices);
+    writer.array(mesh.faces);
+    writer.array(mesh.blocks);
+    writer.array(mesh.leafBlocks);
+    writer.array(mesh.bvh.nodes());
+    writer.array(mesh.bvh.indices());
+    writer.value(mesh.bvh.stats());
+}
+
+std::shared_ptr<const Mesh> ReadMesh(ByteReader& reader) {
+    auto mesh = std::make_shared<Mesh>();
+    mesh->layout = reader.value<MeshLayout>();
+    mesh->aabb = reader.value<AABB>();
+    mesh->vertexData = reader.array<Vec3>();
+    mesh->faceData = reader.array<int>();
+    mesh->blockData = reader.array<TriangleBlock>();
+    mesh->leafBlockData = reader.array<uint32_t>();
+    auto tree = std::make_shared<TreeData>();
+    tree->nodes = reader.array<BVHNode>();
+    tree->indices = reader.array<uint32_t>();
+    BVHStats stats = reader.value<BVHStats>();
+    mesh->bvh = BVH::view(tree->nodes, tree->indices, stats, tree);
+    mesh->vertices = mesh->vertexData;
+    mesh->faces = mesh->faceData;
+    mesh->blocks = mesh->blockData;
+    mesh->leafBlocks = mesh->leafBlockData;
+    if (!mesh->valid())
+        throw std::runtime_error("Invalid mesh in scene");
+    return mesh;
+}
+
+void WriteGrid(ByteWriter& writer, const BubbleGrid& grid) {
+    writer.array(View(grid.x));
+    writer.array(View(grid.y));
+    writer.array(View(grid.z));
+    writer.array(View(grid.radius));
+    writer.array(View(grid.cells));
+    writer.array(View(grid.items));
+    writer.value(grid.bounds);
+    writer.value(grid.dims);
+    writer.value(grid.cellSize);
+}
+
+std::shared_ptr<const BubbleGrid> ReadGrid(ByteReader& reader) {
+    auto grid = std::make_shared<BubbleGrid>();
+    grid->x = reader.array<float>();
+    grid->y = reader.array<float>();
+    grid->z = reader.array<float>();
+    grid->radius = reader.array<float>();
+    grid->cells = reader.array<uint32_t>();
+    grid->items = reader.array<uint32_t>();
+    grid->bounds = reader.value<AABB>();
+    auto dims = reader.value<std::array<int, 3>>();
+    std::copy(dims.begin(), dims.end(), grid->dims);
+    grid->cellSize = reader.value<Vec3>();
+    if (!grid->radius.empty())
+        for (int axis = 0; axis < 3; axis++)
+            grid->invCellSize[axis] = 1.0f / grid->cellSize[axis];
+    if (!grid->valid())
+        throw std::runtime_error("Invalid bubble grid in scene");
+    return grid;
+}
+
+// Writes the index of shared data in the order it was first seen, followed
+// by the data itself the first time.
+template <typename Data, typename Write>
+void WriteShared(ByteWriter& writer, std::unordered_map<const void*, uint32_t>& seen, const Data& data,
+                 Write&& write) {
+    auto [entry, inserted] = seen.try_emplace(&data, static_cast<uint32_t>(seen.size()));
+    writer.value(entry->second);
+    if (inserted)
+        write(writer, data);
+}
+
+template <typename Data, typename Read>
+std::shared_ptr<const Data> ReadShared(ByteReader& reader, std::vector<std::shared_ptr<const Data>>& seen,
+                                       Read&& read) {
+    uint32_t index = reader.value<uint32_t>();
+    if (index == seen.size())
+        seen.push_back(read(reader));
+    if (index >= seen.size())
+        throw std::runtime_error("Invalid shared data index in scene");
+    return seen[index];
+}
+
+} // namespace
+
+std::string SerializeScene(const Scene& original) {
+    // The placement getters of IObject are not const; a snapshot shares the
+    // meshes and grids and only copies the small objects.
+    Scene scene = original.snapshot();
+    std::string out;
+    ByteWriter writer(out);
+    writer.value(CurrentHeader());
+
+    std::vector<Material> materials;
+    for (uint32_t id = 0; id < scene.materialCount(); id++)
+        materials.push_back(scene.material(id));
+    writer.array(View(materials));
+
+    std::unordered_map<const void*, uint32_t> meshes, grids;
+    const std::vector<Scene::ObjectId>& ids = scene.objectIds();
+    writer.value<uint64_t>(ids.size());
+    for (Scene::ObjectId id : ids) {
+        IObject& object = scene.object(id);
+        uint32_t material = scene.materialOf(id);
+        if (auto* sphere = dynamic_cast<Sphere*>(&object)) {
+            writer.value(ObjectKind::Sphere);
+            writer.value(material);
+            writer.value(sphere->getCenter());
+            writer.value(sphere->getRadius());
+        } else if (auto* box = dynamic_cast<Cube*>(&object)) {
+            writer.value(ObjectKind::Box);
+            writer.value(material);
+            writer.value(box->getMin());
+            writer.value(box->getMax());
+            WritePlacement(writer, *box);
+        } else if (auto* model = dynamic_cast<Model*>(&object)) {
+            writer.value(ObjectKind::Mesh);
+            writer.value(material);
+            WriteShared(writer, meshes, *model->mesh(), WriteMesh);
+            WritePlacement(writer, *model);
+        } else if (auto* cloud = dynamic_cast<BubbleCloud*>(&object)) {
+            writer.value(ObjectKind::Bubbles);
+            writer.value(material);
+            WriteShared(writer, grids, *cloud->grid(), WriteGrid);
+            WritePlacement(writer, *cloud);
+        } else {
+            throw std::runtime_error("Cannot serialize object " + std::to_string(id) + " of an unknown type");
+        }
+    }
+
+    writer.array(View(scene.lights()));
+    writer.value<uint8_t>(scene.planeShown());
+    writer.value(scene.getAmbient());
+    return out;
+}
+
+void DeserializeScene(std::string_view data, Scene& scene) {
+    ByteReader reader(data);
+    Header header = reader.value<Header>();
+    Header expected = CurrentHeader();
+    if (std::memcmp(&header, &expected, sizeof(Header)) != 0)
+        throw std::runtime_error("Scene data was written by another version or build");
+
+    std::vector<Material> materials = reader.array<Material>();
+    if (materials.empty())
+        throw std::runtime_error("Scene data has no plane material");
+    scene.material(Scene::PLANE_MATERIAL) = materials[0];
+    for (size_t i = 1; i < materials.size(); i++)
+        scene.addMaterial(materials[i]);
+
+    std::vector<std::shared_ptr<const Mesh>> meshes;
+    std::vector<std::shared_ptr<const BubbleGrid>> grids;
+    uint64_t count = reader.value<uint64_t>();
+    for (uint64_t i = 0; i < count; i++) {
+        auto kind = reader.value<ObjectKind>();
+        uint32_t material = reader.value<uint32_t>();
+        if (material >= materials.size())
+            throw std::runtime_error("Invalid material index in scene");
+        switch (kind) {
+            case ObjectKind::Sphere: {
+                Vec3 center = reader.value<Vec3>();
+                scene.addObject(Sphere(center, reader.value<float>()), material);
+                break;
+            }
+            case ObjectKind::Box: {
+                Vec3 min = reader.value<Vec3>();
+                Cube box(min, reader.value<Vec3>());
+                ReadPlacement(reader, box);
+                scene.addObject(box, material);
+                break;
+            }
+            case ObjectKind::Mesh: {
+                Model model(ReadShared(reader, meshes, ReadMesh));
+                ReadPlacement(reader, model);
+                scene.addObject(model, material);
+                break;
+            }
+            case ObjectKind::Bubbles: {
+                auto cloud = std::make_shared<BubbleCloud>(ReadShared(reader, grids, ReadGrid));
+                ReadPlacement(reader, *cloud);
+                scene.addObject(cloud, material);
+                break;
+            }
+            default:
+                throw std::runtime_error("Unknown object kind in scene");
+        }
+    }
+
+    for (const Vec3& light : reader.array<Vec3>())
+        scene.addLight(light);
+    scene.showPlane(reader.value<uint8_t>() != 0);
+    scene.getAmbient() = reader.value<float>();
+    if (!reader.done())
+        throw std::runtime_error("Unexpected data after the scene");
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstring>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+#include "scene.h"
+
+// Native-layout encoding of trivially copyable values and of arrays of them,
+// shared by the scene format and the messages of distributed rendering.
+class ByteWriter {
+public:
+    explicit ByteWriter(std::string& out) : m_out(out) {}
+
+    template <typename T>
+    void value(const T& value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        m_out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+    // The element count, then the elements.
+    template <typename T>
+    void array(std::span<const T> values) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        value<uint64_t>(values.size());
+        m_out.append(reinterpret_cast<const char*>(values.data()), values.size_bytes());
+    }
+
+private:
+    std::string& m_out;
+};
+
+// Reads what a ByteWriter wrote; throws std::runtime_error past the end.
+class ByteReader {
+public:
+    explicit ByteReader(std::string_view data) : m_data(data) {}
+
+    template <typename T>
+    T value() {
+        static_assert(std::is_trivially_copyable_v<T>);
+        T value;
+        std::memcpy(&value, take(sizeof(T)), sizeof(T));
+        return value;
+    }
+    template <typename T>
+    std::vector<T> array() {
+        static_assert(std::is_trivially_copyable_v<T>);
+        uint64_t count = value<uint64_t>();
+        if (count > m_data.size() / sizeof(T))
+            throw std::runtime_error("Truncated data");
+        std::vector<T> values(count);
+        std::memcpy(values.data(), take(count * sizeof(T)), count * sizeof(T));
+        return values;
+    }
+    bool done() const { return m_data.empty(); }
+
+private:
+    const char* take(size_t size) {
+        if (size > m_data.size())
+            throw std::runtime_error("Truncated data");
+        const char* data = m_data.data();
+        m_data.remove_prefix(size);
+        return data;
+    }
+
+private:
+    std::string_view m_data;
+};
+
+// Scene contents as bytes for another process of the same build: the
+// material table, every object with its placement and material, the lights,
+// the plane and the ambient term. Meshes and bubble clouds travel with their
+// prebuilt hierarchies, once however many objects share them, so the
+// receiver only builds the scene BVHs. Like the mesh cache, everything is in
+// the native layout; a header rejects data from other builds.
+//
+// Throws std::runtime_error for custom objects of types it does not know.
+std::string SerializeScene(const Scene& scene);
+
+// Adds serialized contents to a freshly constructed scene; throws
+// std::runtime_error on malformed data or data from another build. Meshes
+// and bubble grids are checked like mesh caches, so that no index in the
+// data can send a ray outside their arrays.
+void DeserializeScene(std::string_view data, Scene& scene);
@@ -0,0 +1,68 @@
+#include "pch.h"
+#include "scenes.h"
+#include "objects.h"
+#include <random>
+
+static Material BubbleMaterial() {
+    Material material;
+    material.diffuse = Vec3(1, 1, 1);
+    material.diffuseAlbedo = 0.4f;
+    material.refractAlbedo = 1.0f;
+    material.refractive = 1.01f;
+    return material;
+}
+
+void LoadIceScene(Scene& scene, unsigned seed, int bubbles) {
+    scene.addObject(Cube());
+    scene.addLight(Vec3(0, 5, 0));
+
+    std::mt19937 generator(seed);
+    std::uniform_int_distribution<int> cell(-2, 2);
+    for (int i = 0; i < bubbles; i++) {
+        float x = static_cast<float>(cell(generator));
+        float y = static_cast<float>(cell(generator));
+        float z = static_cast<float>(cell(generator));
+        Sphere bubble(Vec3(x, y, z), 0.3f);
+        bubble.getScale() *= -0.3f;
+        bubble.getScale() -= -0.1f * (i % 5);
+        // Every bubble of the editable scene gets its own material.
+        scene.addObject(bubble, BubbleMaterial());
+    }
+}
+
+Scene::ObjectId AddBubbleCloud(Scene& scene, const BubbleSettings& settings) {
+    return scene.addObject(std::make_shared<BubbleCloud>(Cube().bounds(), settings), scene.addMaterial(BubbleMaterial()));
+}
+
+void LoadReferenceScene(Scene& scene, const std::string& name, unsigned seed) {
+    if (name == "ice") {
+        LoadIceScene(scene, seed);
+    } else if (name == "cloud") {
+        LoadIceScene(scene, seed, 0);
+        std::mt19937 generator(seed);
+        std::uniform_real_distribution<float> position(-2.7f, 2.7f);
+        std::uniform_real_distribution<float> radius(0.05f, 0.25f);
+        uint32_t material = scene.addMaterial(BubbleMaterial());
+        for (int i = 0; i < 200; i++) {
+            Vec3 center(position(generator), position(generator), position(generator));
+            scene.addObject(Sphere(center, -radius(generator)), material);
+        }
+        scene.showPlane(true);
+        scene.getAmbient() = 0.3f;
+    } else if (name == "bubbles") {
+        LoadIceScene(scene, seed, 0);
+        BubbleSettings settings;
+        settings.seed = seed;
+        settings.density = 1000.0f;
+        settings.clustering = 0.5f;
+        AddBubbleCloud(scene, settings);
+        scene.showPlane(true);
+        scene.getAmbient() = 0.3f;
+    } else {
+        throw std::runtime_error("Unknown scene " + name);
+    }
+}
+
+Camera DefaultCamera(float aspect) {
+    return Camera(Vec3(0, 4, -7), Vec3(0, 0, 0), 45.f, aspect);
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <string>
+#include "renderer.h"
+#include "scene.h"
+#include "bubblecloud.h"
+
+// The ice cube with refracting air bubbles shown by the application.
+// The same seed always produces the same bubbles.
+void LoadIceScene(Scene& scene, unsigned seed, int bubbles = 5);
+
+// Fills the ice cube with a cloud of bubbles generated from settings.
+Scene::ObjectId AddBubbleCloud(Scene& scene, const BubbleSettings& settings);
+
+// Fixed scenes used for benchmarking: "ice" is the application scene,
+// "cloud" fills the cube with 200 bubbles above the ground plane and
+// "bubbles" with a clustered cloud of about 200 000.
+void LoadReferenceScene(Scene& scene, const std::string& name, unsigned seed);
+Camera DefaultCamera(float aspect);
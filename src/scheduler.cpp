@@ -0,0 +1,140 @@
+#include "pch.h"
+#include "scheduler.h"
+
+static uint32_t SpreadBits(uint32_t value) {
+    value &= 0xffff;
+    value = (value | (value << 8)) & 0x00ff00ff;
+    value = (value | (value << 4)) & 0x0f0f0f0f;
+    value = (value | (value << 2)) & 0x33333333;
+    value = (value | (value << 1)) & 0x55555555;
+    return value;
+}
+
+static uint32_t MortonCode(uint32_t x, uint32_t y) {
+    return SpreadBits(x) | (SpreadBits(y) << 1);
+}
+
+std::vector<Tile> MakeTiles(int width, int height, int tileSize) {
+    assert(tileSize > 0);
+    int columns = (width + tileSize - 1) / tileSize;
+    int rows = (height + tileSize - 1) / tileSize;
+
+    std::vector<std::pair<uint32_t, Tile>> ordered;
+    ordered.reserve(columns * rows);
+    for (int row = 0; row < rows; row++) {
+        for (int column = 0; column < columns; column++) {
+            Tile tile;
+            tile.x0 = column * tileSize;
+            tile.y0 = row * tileSize;
+            tile.x1 = std::min(width, tile.x0 + tileSize);
+            tile.y1 = std::min(height, tile.y0 + tileSize);
+            ordered.emplace_back(MortonCode(column, row), tile);
+        }
+    }
+    std::sort(ordered.begin(), ordered.end(),
+              [](const auto& a, const auto& b) { return a.first < b.first; });
+
+    std::vector<Tile> tiles;
+    tiles.reserve(ordered.size());
+    for (const auto& entry : ordered)
+        tiles.push_back(entry.second);
+    return tiles;
+}
+
+TileScheduler::TileScheduler(int threads) {
+    if (threads <= 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 0; i < threads; i++)
+        m_queues.push_back(std::make_unique<Queue>());
+    for (int i = 1; i < threads; i++)
+        m_workers.emplace_back(&TileScheduler::workerLoop, this, i);
+}
+
+TileScheduler::~TileScheduler() noexcept {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+    for (auto& worker : m_workers)
+        worker.join();
+}
+
+void TileScheduler::run(int count, const std::function<void(int index, int worker)>& task) {
+    if (count <= 0)
+        return;
+
+    // Contiguous ranges keep neighbouring tiles on the same worker.
+    int threads = this->threads();
+    for (int worker = 0; worker < threads; worker++) {
+        std::lock_guard<std::mutex> lock(m_queues[worker]->mutex);
+        int begin = static_cast<int>(static_cast<int64_t>(count) * worker / threads);
+        int end = static_cast<int>(static_cast<int64_t>(count) * (worker + 1) / threads);
+        for (int i = begin; i < end; i++)
+            m_queues[worker]->tasks.push_back(i);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_task = &task;
+        m_active = static_cast<int>(m_workers.size());
+        m_generation++;
+    }
+    m_wake.notify_all();
+
+    process(0);
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done.wait(lock, [this]() { return m_active == 0; });
+    m_task = nullptr;
+}
+
+void TileScheduler::workerLoop(int worker) {
+    uint64_t generation = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wake.wait(lock, [&]() { return m_stop || m_generation != generation; });
+            if (m_stop)
+                return;
+            generation = m_generation;
+        }
+
+        process(worker);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (--m_active == 0)
+            m_done.notify_all();
+    }
+}
+
+void TileScheduler::process(int worker) {
+    // No task creates new tasks, so once every deque is empty the run is over.
+    int task;
+    while (pop(worker, task) || steal(worker, task))
+        (*m_task)(task, worker);
+}
+
+bool TileScheduler::pop(int worker, int& task) {
+    Queue& queue = *m_queues[worker];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty())
+        return false;
+    task = queue.tasks.front();
+    queue.tasks.pop_front();
+    return true;
+}
+
+bool TileScheduler::steal(int worker, int& task) {
+    int threads = this->threads();
+    for (int offset = 1; offset < threads; offset++) {
+        Queue& victim = *m_queues[(worker + offset) % threads];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = victim.tasks.back();
+            victim.tasks.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
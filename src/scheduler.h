@@ -0,0 +1,59 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct Tile {
+    int x0, y0; // inclusive
+    int x1, y1; // exclusive
+};
+
+// Covers the image with tileSize x tileSize tiles listed in Morton (Z-curve)
+// order, so that consecutive tiles are spatially close.
+std::vector<Tile> MakeTiles(int width, int height, int tileSize);
+
+// Persistent pool of workers with one deque per worker. run() deals the tasks
+// out as contiguous ranges, every worker takes from the front of its own deque
+// and, once that is empty, steals from the back of the others.
+class TileScheduler {
+public:
+    // threads <= 0 uses every hardware thread. The calling thread is worker 0.
+    explicit TileScheduler(int threads = 0);
+    TileScheduler(const TileScheduler& other) = delete;
+    TileScheduler& operator=(const TileScheduler& other) = delete;
+    ~TileScheduler() noexcept;
+
+    int threads() const { return static_cast<int>(m_queues.size()); }
+
+    // Calls task(index, worker) for every index in [0, count) and returns once
+    // all of them have finished. Not reentrant.
+    void run(int count, const std::function<void(int index, int worker)>& task);
+
+private:
+    struct Queue {
+        std::mutex      mutex;
+        std::deque<int> tasks;
+    };
+
+    void workerLoop(int worker);
+    void process(int worker);
+    bool pop(int worker, int& task);
+    bool steal(int worker, int& task);
+
+private:
+    std::vector<std::unique_ptr<Queue>> m_queues;
+    std::vector<std::thread>            m_workers;
+    std::mutex                          m_mutex;
+    std::condition_variable             m_wake;
+    std::condition_variable             m_done;
+    const std::function<void(int, int)>* m_task = nullptr;
+    uint64_t                            m_generation = 0;
+    int                                 m_active = 0;
+    bool                                m_stop = false;
+};
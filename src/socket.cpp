@@ -0,0 +1,225 @@
+#include "pch.h"
+#include "socket.h"
+
+#include <cerrno>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+Socket::Socket(Socket&& other) noexcept {
+    *this = std::move(other);
+}
+
+Socket& Socket::operator=(Socket&& other) noexcept {
+    if (this != &other) {
+        close();
+        std::swap(m_handle, other.m_handle);
+        std::swap(m_unlink, other.m_unlink);
+    }
+    return *this;
+}
+
+Socket::~Socket() noexcept {
+    close();
+}
+
+static std::runtime_error SocketError(const std::string& what) {
+    return std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+static const std::string UNIX_PREFIX = "unix:";
+
+// A peer that closes the connection must make send() fail rather than kill
+// the process with SIGPIPE. Linux asks for that per call, the BSDs and macOS
+// per socket.
+#ifdef MSG_NOSIGNAL
+constexpr int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+constexpr int SEND_FLAGS = 0;
+#endif
+
+static void NoSigPipe([[maybe_unused]] int handle) {
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    setsockopt(handle, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+}
+
+// Opens a socket for address and binds (listening) or connects it.
+static int Open(const std::string& address, bool listening) {
+    if (address.rfind(UNIX_PREFIX, 0) == 0) {
+        std::string path = address.substr(UNIX_PREFIX.size());
+        sockaddr_un local = {};
+        local.sun_family = AF_UNIX;
+        if (path.empty() || path.size() >= sizeof(local.sun_path))
+            throw std::runtime_error("Invalid socket path " + path);
+        std::memcpy(local.sun_path, path.c_str(), path.size() + 1);
+        // A socket left behind by an earlier coordinator is replaced; any
+        // other file at the path is not ours to remove.
+        struct stat status;
+        if (listening && ::lstat(path.c_str(), &status) == 0) {
+            if (!S_ISSOCK(status.st_mode))
+                throw std::runtime_error("Cannot listen on " + address + ": path exists and is not a socket");
+            ::unlink(path.c_str());
+        }
+
+        int handle = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (handle < 0)
+            throw SocketError("Cannot create socket");
+        NoSigPipe(handle);
+        int result = listening ? ::bind(handle, reinterpret_cast<sockaddr*>(&local), sizeof(local))
+                               : ::connect(handle, reinterpret_cast<sockaddr*>(&local), sizeof(local));
+        if (result != 0) {
+            int error = errno;
+            ::close(handle);
+            errno = error;
+            throw SocketError((listening ? "Cannot listen on " : "Cannot connect to ") + address);
+        }
+        return handle;
+    }
+
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos)
+        throw std::runtime_error("Expected host:port or unix:/path, got " + address);
+    std::string host = address.substr(0, colon);
+    std::string port = address.substr(colon + 1);
+    if (host == "*")
+        host.clear();
+
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = listening ? AI_PASSIVE : 0;
+    addrinfo* list = nullptr;
+    int status = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &list);
+    if (status != 0)
+        throw std::runtime_error("Cannot resolve " + address + ": " + gai_strerror(status));
+
+    int handle = -1;
+    int error = 0;
+    for (addrinfo* info = list; info && handle < 0; info = info->ai_next) {
+        handle = ::socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+        if (handle < 0) {
+            error = errno;
+            continue;
+        }
+        NoSigPipe(handle);
+        int on = 1;
+        if (listening)
+            setsockopt(handle, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        else
+            setsockopt(handle, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        int result = listening ? ::bind(handle, info->ai_addr, info->ai_addrlen)
+                               : ::connect(handle, info->ai_addr, info->ai_addrlen);
+        if (result != 0) {
+            error = errno;
+            ::close(handle);
+            handle = -1;
+        }
+    }
+    freeaddrinfo(list);
+    if (handle < 0) {
+        errno = error;
+        throw SocketError((listening ? "Cannot listen on " : "Cannot connect to ") + address);
+    }
+    return handle;
+}
+
+Socket Socket::listen(const std::string& address) {
+    Socket socket(Open(address, true));
+    // Bound: from here on closing the socket removes its file.
+    if (address.rfind(UNIX_PREFIX, 0) == 0)
+        socket.m_unlink = address.substr(UNIX_PREFIX.size());
+    if (::listen(socket.m_handle, SOMAXCONN) != 0)
+        throw SocketError("Cannot listen on " + address);
+    return socket;
+}
+
+Socket Socket::connect(const std::string& address, double retrySeconds) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(retrySeconds);
+    while (true) {
+        try {
+            return Socket(Open(address, false));
+        } catch (const std::runtime_error&) {
+            if (std::chrono::steady_clock::now() >= deadline)
+                throw;
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    }
+}
+
+Socket Socket::accept(int timeoutMs) const {
+    pollfd request = {m_handle, POLLIN, 0};
+    int ready = ::poll(&request, 1, timeoutMs);
+    if (ready < 0 && errno != EINTR)
+        throw SocketError("Cannot wait for connections");
+    if (ready <= 0)
+        return {};
+    int handle = ::accept(m_handle, nullptr, nullptr);
+    if (handle < 0)
+        throw SocketError("Cannot accept a connection");
+    NoSigPipe(handle);
+    int on = 1;
+    setsockopt(handle, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)); // fails harmlessly for Unix sockets
+    return Socket(handle);
+}
+
+void Socket::send(const void* data, size_t size) const {
+    const char* bytes = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t sent = ::send(m_handle, bytes, size, SEND_FLAGS);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            throw SocketError("Cannot send");
+        bytes += sent;
+        size -= static_cast<size_t>(sent);
+    }
+}
+
+bool Socket::receive(void* data, size_t size) const {
+    char* bytes = static_cast<char*>(data);
+    size_t received = 0;
+    while (received < size) {
+        ssize_t count = ::recv(m_handle, bytes + received, size - received, 0);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count == 0 && received == 0)
+            return false;
+        if (count == 0)
+            throw std::runtime_error("Connection closed in the middle of a message");
+        if (count < 0)
+            throw SocketError("Cannot receive");
+        received += static_cast<size_t>(count);
+    }
+    return true;
+}
+
+void Socket::setTimeout(int milliseconds) const {
+    timeval timeout = {milliseconds / 1000, (milliseconds % 1000) * 1000};
+    setsockopt(m_handle, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(m_handle, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+void Socket::shutdown() const noexcept {
+    if (m_handle >= 0)
+        ::shutdown(m_handle, SHUT_RDWR);
+}
+
+void Socket::close() noexcept {
+    if (m_handle >= 0)
+        ::close(m_handle);
+    if (!m_unlink.empty())
+        ::unlink(m_unlink.c_str());
+    m_handle = -1;
+    m_unlink.clear();
+}
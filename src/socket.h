@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// Blocking stream socket over TCP or a Unix domain socket. Addresses are
+// "host:port", with an empty host or "*" listening on every interface, or
+// "unix:/path". Errors throw std::runtime_error. POSIX only: the build
+// leaves it out elsewhere, see RAYTRACING_DISTRIBUTED.
+class Socket {
+public:
+    Socket() = default;
+    Socket(Socket&& other) noexcept;
+    Socket& operator=(Socket&& other) noexcept;
+    Socket(const Socket& other) = delete;
+    Socket& operator=(const Socket& other) = delete;
+    ~Socket() noexcept;
+
+    static Socket listen(const std::string& address);
+    // Retries for up to retrySeconds while nothing listens at the address yet.
+    static Socket connect(const std::string& address, double retrySeconds = 0.0);
+    // Waits up to timeoutMs for a connection; returns an empty socket on timeout.
+    Socket accept(int timeoutMs) const;
+
+    // Sends or receives exactly size bytes. receive() returns false when the
+    // peer closed the connection before the first byte; a close in the middle,
+    // an error or a timeout throws.
+    void send(const void* data, size_t size) const;
+    bool receive(void* data, size_t size) const;
+    // Both directions give up after milliseconds without progress, 0 = never.
+    void setTimeout(int milliseconds) const;
+    // Makes blocked send() and receive() calls of other threads return.
+    void shutdown() const noexcept;
+
+    explicit operator bool() const { return m_handle >= 0; }
+
+private:
+    explicit Socket(int handle) : m_handle(handle) {}
+    void close() noexcept;
+
+private:
+    int         m_handle = -1;
+    std::string m_unlink; // path of a listening Unix socket, removed on close
+};
@@ -0,0 +1,65 @@
+#include "pch.h"
+#include "tracestats.h"
+#include "renderer.h"
+
+TraceStats& TraceStats::operator+=(const TraceStats& other) {
+    for (int i = 0; i < static_cast<int>(RayKind::Count); i++)
+        rays[i] += other.rays[i];
+    for (int i = 0; i < static_cast<int>(Primitive::Count); i++)
+        tests[i] += other.tests[i];
+    nodes += other.nodes;
+    for (int i = 0; i < DEPTHS; i++)
+        depths[i] += other.depths[i];
+    return *this;
+}
+
+const char* TraceStats::name(RayKind kind) {
+    switch (kind) {
+        case RayKind::Primary: return "primary";
+        case RayKind::Reflect: return "reflect";
+        case RayKind::Refract: return "refract";
+        case RayKind::Shadow:  return "shadow";
+        case RayKind::Count:   break;
+    }
+    return "unknown";
+}
+
+const char* TraceStats::name(Primitive primitive) {
+    switch (primitive) {
+        case Primitive::Sphere:   return "sphere";
+        case Primitive::Box:      return "box";
+        case Primitive::Triangle: return "triangle";
+        case Primitive::Plane:    return "plane";
+        case Primitive::Count:    break;
+    }
+    return "unknown";
+}
+
+void WriteStatsJson(std::ostream& out, const RenderStats& stats, double milliseconds) {
+    const TraceStats& trace = stats.trace;
+    out << "{\n"
+        << "  \"ms\": " << milliseconds << ",\n"
+        << "  \"mrays_per_s\": " << (milliseconds > 0.0 ? stats.rays / (milliseconds * 1e3) : 0.0) << ",\n"
+        << "  \"samples\": " << stats.samples << ",\n"
+        << "  \"cached\": " << stats.cached << ",\n"
+        << "  \"pruned\": " << stats.pruned << ",\n"
+        << "  \"rays\": {";
+    for (int i = 0; i < static_cast<int>(TraceStats::RayKind::Count); i++) {
+        auto kind = static_cast<TraceStats::RayKind>(i);
+        out << (i ? ", " : "") << "\"" << TraceStats::name(kind) << "\": " << trace[kind];
+    }
+    out << "},\n  \"tests\": {";
+    for (int i = 0; i < static_cast<int>(TraceStats::Primitive::Count); i++) {
+        auto primitive = static_cast<TraceStats::Primitive>(i);
+        out << (i ? ", " : "") << "\"" << TraceStats::name(primitive) << "\": " << trace[primitive];
+    }
+    out << "},\n"
+        << "  \"nodes\": " << trace.nodes << ",\n"
+        << "  \"depths\": [";
+    int last = TraceStats::DEPTHS;
+    while (last > 1 && trace.depths[last - 1] == 0)
+        last--;
+    for (int i = 0; i < last; i++)
+        out << (i ? ", " : "") << trace.depths[i];
+    out << "]\n}\n";
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <iosfwd>
+
+// Where the work of a frame goes: rays by kind and bounce, intersection
+// tests by primitive type and BVH and grid traversal steps. The counters
+// live in the thread that traces, so the hot paths touch no shared cache
+// lines; Render() clears them before every tile and adds them to the
+// RenderStats of the frame after it. Building with RAYTRACING_NO_STATS compiles the counting out.
+struct TraceStats {
+    enum class RayKind : uint8_t { Primary, Reflect, Refract, Shadow, Count };
+    enum class Primitive : uint8_t { Sphere, Box, Triangle, Plane, Count };
+    static constexpr int DEPTHS = 16; // deeper bounces share the last bin
+
+    uint64_t rays[static_cast<int>(RayKind::Count)] = {};
+    uint64_t tests[static_cast<int>(Primitive::Count)] = {}; // one per SIMD lane tested
+    uint64_t nodes = 0;                                        // BVH nodes and grid cells visited
+    uint64_t depths[DEPTHS] = {};                              // traced rays by bounce, primary at 0
+
+    uint64_t& operator[](RayKind kind)        { return rays[static_cast<int>(kind)]; }
+    uint64_t  operator[](RayKind kind) const  { return rays[static_cast<int>(kind)]; }
+    uint64_t& operator[](Primitive primitive)       { return tests[static_cast<int>(primitive)]; }
+    uint64_t  operator[](Primitive primitive) const { return tests[static_cast<int>(primitive)]; }
+
+    TraceStats& operator+=(const TraceStats& other);
+
+    static const char* name(RayKind kind);
+    static const char* name(Primitive primitive);
+};
+
+#ifdef RAYTRACING_NO_STATS
+constexpr bool TRACE_STATS = false;
+#else
+constexpr bool TRACE_STATS = true;
+#endif
+
+// The counters of the calling thread.
+inline TraceStats& ThreadTraceStats() {
+    static constinit thread_local TraceStats stats;
+    return stats;
+}
+
+inline void CountRay(TraceStats::RayKind kind, int bounce) {
+    if constexpr (TRACE_STATS) {
+        TraceStats& stats = ThreadTraceStats();
+        stats[kind]++;
+        if (kind != TraceStats::RayKind::Shadow)
+            stats.depths[bounce < TraceStats::DEPTHS ? bounce : TraceStats::DEPTHS - 1]++;
+    }
+}
+
+inline void CountTests(TraceStats::Primitive primitive, uint64_t count = 1) {
+    if constexpr (TRACE_STATS)
+        ThreadTraceStats()[primitive] += count;
+}
+
+// Nodes visited by one traversal, counted in a register and added to the
+// counters of the thread when the traversal returns.
+struct NodeCounter {
+    uint64_t visited = 0;
+
+    ~NodeCounter() {
+        if constexpr (TRACE_STATS)
+            ThreadTraceStats().nodes += visited;
+    }
+    void operator++(int) {
+        if constexpr (TRACE_STATS)
+            visited++;
+    }
+};
+
+struct RenderStats;
+
+// The statistics of one frame that took milliseconds, as a JSON object.
+void WriteStatsJson(std::ostream& out, const RenderStats& stats, double milliseconds);
@@ -0,0 +1,77 @@
+#pragma once
+
+// Eight float lanes for the AVX2 kernels. Only translation units compiled
+// for AVX2 include this. Everything here has internal linkage, so the
+// linker can never substitute AVX2 code for an inline function of the
+// baseline build. For the same reason this header includes nothing of the
+// renderer.
+
+#ifndef __AVX2__
+#error "wide.h needs a translation unit compiled for AVX2"
+#endif
+
+#include <immintrin.h>
+
+namespace {
+
+struct Mask8 {
+    __m256 v;
+
+    explicit Mask8(__m256 value) : v(value) {}
+
+    int bits() const { return _mm256_movemask_ps(v); }
+    bool any() const { return bits() != 0; }
+    bool none() const { return bits() == 0; }
+};
+
+struct Float8 {
+    __m256 v;
+
+    Float8() : v(_mm256_setzero_ps()) {}
+    explicit Float8(float value) : v(_mm256_set1_ps(value)) {}
+    explicit Float8(__m256 value) : v(value) {}
+
+    static Float8 load(const float* aligned) { return Float8(_mm256_load_ps(aligned)); }
+    // Lanes 0-3 from low and 4-7 from high, both 16-byte aligned.
+    static Float8 load(const float* low, const float* high) {
+        return Float8(_mm256_insertf128_ps(_mm256_castps128_ps256(_mm_load_ps(low)), _mm_load_ps(high), 1));
+    }
+    void store(float* aligned) const { _mm256_store_ps(aligned, v); }
+};
+
+inline Float8 operator+(const Float8& a, const Float8& b) { return Float8(_mm256_add_ps(a.v, b.v)); }
+inline Float8 operator-(const Float8& a, const Float8& b) { return Float8(_mm256_sub_ps(a.v, b.v)); }
+inline Float8 operator*(const Float8& a, const Float8& b) { return Float8(_mm256_mul_ps(a.v, b.v)); }
+inline Float8 operator/(const Float8& a, const Float8& b) { return Float8(_mm256_div_ps(a.v, b.v)); }
+inline Float8 operator-(const Float8& a) { return Float8(_mm256_xor_ps(a.v, _mm256_set1_ps(-0.0f))); }
+inline Float8 Sqrt(const Float8& a) { return Float8(_mm256_sqrt_ps(a.v)); }
+
+// Ordered, non-signalling comparisons, like the SSE ones.
+inline Mask8 operator<(const Float8& a, const Float8& b)  { return Mask8(_mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ)); }
+inline Mask8 operator>=(const Float8& a, const Float8& b) { return Mask8(_mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ)); }
+inline Mask8 operator&(const Mask8& a, const Mask8& b) { return Mask8(_mm256_and_ps(a.v, b.v)); }
+
+inline Float8 Select(const Mask8& mask, const Float8& a, const Float8& b) {
+    return Float8(_mm256_blendv_ps(b.v, a.v, mask.v));
+}
+// Same NaN behaviour as Min and Max of Float4.
+inline Float8 Min(const Float8& a, const Float8& b) { return Float8(_mm256_min_ps(b.v, a.v)); }
+inline Float8 Max(const Float8& a, const Float8& b) { return Float8(_mm256_max_ps(b.v, a.v)); }
+
+struct Vec3x8 {
+    Float8 x;
+    Float8 y;
+    Float8 z;
+
+    Vec3x8() = default;
+    Vec3x8(const Float8& X, const Float8& Y, const Float8& Z) : x(X), y(Y), z(Z) {}
+    Vec3x8(float X, float Y, float Z) : x(X), y(Y), z(Z) {}
+};
+
+inline Vec3x8 operator-(const Vec3x8& a, const Vec3x8& b) { return {a.x - b.x, a.y - b.y, a.z - b.z}; }
+
+inline Float8 Dot(const Vec3x8& a, const Vec3x8& b) {
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+} // namespace